@@ -0,0 +1,663 @@
+#include <iostream>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include "nnSparrow/nnSparrow.hpp"
+#include "nnSparrow/nnQuantized.hpp"
+using namespace std;
+
+
+// seconds per call of f, repeated until at least 0.2s elapsed
+template<typename F>
+double timeit(F f) {
+
+  int rep = 0;
+  clock_t st = clock();
+  do {
+    f();
+    rep++;
+  } while(clock() - st < CLOCKS_PER_SEC / 5);
+  return double(clock() - st) / CLOCKS_PER_SEC / rep;
+}
+
+void randomFill(vector<nnreal> &v) {
+  for(int i=0;i<v.size();i++)
+    v[i] = (double) rand() / RAND_MAX - 0.5;
+}
+
+void report(const char *name, double flops, double t0, double t1) {
+  printf("%-28s loop %8.2lf GFLOP/s   kernel %8.2lf GFLOP/s   x%.1lf\n",
+    name, flops / t0 * 1e-9, flops / t1 * 1e-9, t0 / t1);
+}
+
+// the dense layer products, as nnFLayer used to compute them
+void benchDense(int n, int np) {
+
+  vector<nnreal> W(n*np), dW(n*np), x(np), d(n), y(n), pdt(np);
+  randomFill(W);
+  randomFill(x);
+  randomFill(d);
+
+  printf("\ndense layer %d x %d\n", n, np);
+  double flops = 2.0 * n * np;
+
+  double t0 = timeit([&]() {
+    for(int i=0;i<n;i++) {
+      nnreal s = 0;
+      for(int j=0;j<np;j++)
+        s += W[i*np+j] * x[j];
+      y[i] += s;
+    }
+  });
+  double t1 = timeit([&]() { nnKernel::gemv(n, np, &W[0], np, &x[0], &y[0]); });
+  report("W * a (forward)", flops, t0, t1);
+
+  t0 = timeit([&]() {
+    for(int j=0;j<n;j++) {
+      nnreal dj = d[j];
+      for(int i=0;i<np;i++)
+        pdt[i] += W[j*np+i] * dj;
+    }
+  });
+  t1 = timeit([&]() { nnKernel::gemvT(n, np, &W[0], np, &d[0], &pdt[0]); });
+  report("W' * delta (backprop)", flops, t0, t1);
+
+  t0 = timeit([&]() {
+    for(int i=0;i<n;i++) {
+      nnreal di = d[i];
+      for(int j=0;j<np;j++)
+        dW[i*np+j] += di * x[j];
+    }
+  });
+  t1 = timeit([&]() { nnKernel::ger(n, np, &d[0], &x[0], &dW[0], np); });
+  report("delta * a' (gradient)", flops, t0, t1);
+}
+
+// one row of a range layer, the loops on the dense w x pw weights nnRangeLayer used to keep
+void benchRange(int pw, int st) {
+
+  int w = pw - st + 1;
+  long nw = nnKernel::prefixOffset(w, st);
+  vector<nnreal> W(w*pw), dW(w*pw), P(nw), dP(nw), x(pw), d(w), y(w), pdt(pw);
+  randomFill(W);
+  randomFill(P);
+  randomFill(x);
+  randomFill(d);
+
+  printf("\nrange layer row %d, start %d\n", pw, st);
+  double flops = 2.0 * nw;
+
+  double t0 = timeit([&]() {
+    for(int i=0;i<w;i++) {
+      nnreal s = 0;
+      for(int j=0;j<i+st;j++)
+        s += W[i*pw+j] * x[j];
+      y[i] += s;
+    }
+  });
+  double t1 = timeit([&]() { nnKernel::gemvPrefix(w, st, &P[0], &x[0], &y[0]); });
+  report("W * a (forward)", flops, t0, t1);
+
+  t0 = timeit([&]() {
+    for(int i=0;i<w;i++)
+      for(int j=0;j<i+st;j++)
+        pdt[j] += W[i*pw+j] * d[i];
+  });
+  t1 = timeit([&]() { nnKernel::gemvTPrefix(w, st, &P[0], &d[0], &pdt[0]); });
+  report("W' * delta (backprop)", flops, t0, t1);
+
+  t0 = timeit([&]() {
+    for(int i=0;i<w;i++)
+      for(int j=0;j<i+st;j++)
+        dW[i*pw+j] += d[i] * x[j];
+  });
+  t1 = timeit([&]() { nnKernel::gerPrefix(w, st, &d[0], &x[0], &dP[0]); });
+  report("delta * a' (gradient)", flops, t0, t1);
+}
+
+// batch size 1 forward of a dense layer with the weights in nnreal, FP16 and BF16
+void benchHalf(int n, int np) {
+
+  vector<nnreal> W(n*np), x(np), y(n);
+  vector<uint16_t> Wh(n*np), Wb(n*np);
+  randomFill(W);
+  randomFill(x);
+  nnHalf::pack(&W[0], n*np, nnHalf::FP16, &Wh[0]);
+  nnHalf::pack(&W[0], n*np, nnHalf::BF16, &Wb[0]);
+
+  double t = timeit([&]() { nnKernel::gemv(n, np, &W[0], np, &x[0], &y[0]); });
+  double th = timeit([&]() { nnKernel::gemvHalf(n, np, &Wh[0], np, nnHalf::FP16, &x[0], &y[0]); });
+  double tb = timeit([&]() { nnKernel::gemvHalf(n, np, &Wb[0], np, nnHalf::BF16, &x[0], &y[0]); });
+  printf("gemv %5d x %-5d %7.1lf MB: nnreal %8.1lf us   fp16 %8.1lf us x%.2lf   bf16 %8.1lf us x%.2lf\n",
+    n, np, n * np * sizeof(nnreal) / 1e6, t * 1e6, th * 1e6, t / th, tb * 1e6, t / tb);
+}
+
+// CSR copy of the entries of W kept with probability density, the others zeroed
+void sparsify(vector<nnreal> &W, int rows, int cols, double density, vector<int> &ptr, vector<int> &col, vector<nnreal> &val) {
+
+  ptr.assign(1, 0);
+  col.clear();
+  val.clear();
+  for(int i=0;i<rows;i++) {
+    for(int j=0;j<cols;j++) {
+      if((double) rand() / RAND_MAX < density) {
+        col.push_back(j);
+        val.push_back(W[i*cols+j]);
+      }
+      else
+        W[i*cols+j] = 0;
+    }
+    ptr.push_back(col.size());
+  }
+}
+
+// dense against CSR forward of a dense layer and of an fw x fw FWS filter on a w x w map, by density
+void benchSparse(int n, int np, int w, int fw) {
+
+  static const double dens[] = {0.5, 0.3, 0.2, 0.1, 0.05};
+  vector<int> ptr, col;
+  vector<nnreal> val;
+
+  printf("gemv %4d x %-4d  ", n, np);
+  for(int d=0;d<5;d++) {
+    vector<nnreal> W(n*np), x(np), y(n);
+    randomFill(W);
+    randomFill(x);
+    sparsify(W, n, np, dens[d], ptr, col, val);
+    double t0 = timeit([&]() { nnKernel::gemv(n, np, &W[0], np, &x[0], &y[0]); });
+    double t1 = timeit([&]() { nnKernel::spmv(n, &ptr[0], &col[0], &val[0], &x[0], &y[0]); });
+    printf("  %2.0lf%% x%.2lf", dens[d] * 100, t0 / t1);
+  }
+  printf("\n");
+
+  int ow = w - fw + 1;
+  printf("conv %3dx%-3d %dx%d  ", w, w, fw, fw);
+  for(int d=0;d<5;d++) {
+    vector<nnreal> f(fw*fw), x(w*w), y(ow*ow);
+    randomFill(f);
+    randomFill(x);
+    sparsify(f, 1, fw*fw, dens[d], ptr, col, val);
+    for(int k=0;k<col.size();k++)
+      col[k] = col[k] / fw * w + col[k] % fw;
+    double t0 = timeit([&]() {
+      for(int y0=0;y0<ow;y0++)
+        nnKernel::correlateRow(ow, &x[y0*w], w, 1, &f[0], fw, fw, &y[y0*ow]);
+    });
+    double t1 = timeit([&]() {
+      for(int y0=0;y0<ow;y0++)
+        nnKernel::correlateRowSparse(ow, &x[y0*w], (int)col.size(), &col[0], &val[0], &y[y0*ow]);
+    });
+    printf("  %2.0lf%% x%.2lf", dens[d] * 100, t0 / t1);
+  }
+  printf("\n");
+}
+
+void benchGemm(int m, int n, int k) {
+
+  vector<nnreal> A(m*k), B(n*k), C(m*n);
+  randomFill(A);
+  randomFill(B);
+
+  printf("\ngemm %d x %d x %d\n", m, n, k);
+  double flops = 2.0 * m * n * k;
+
+  double t0 = timeit([&]() {
+    for(int i=0;i<m;i++)
+      for(int j=0;j<n;j++) {
+        nnreal s = 0;
+        for(int p=0;p<k;p++)
+          s += A[i*k+p] * B[j*k+p];
+        C[i*n+j] += s;
+      }
+  });
+  double t1 = timeit([&]() { nnKernel::gemm(false, true, m, n, k, &A[0], k, &B[0], k, &C[0], n); });
+  report("A * B'", flops, t0, t1);
+}
+
+double maxError(const nnreal *a, const nnreal *b, int n) {
+  double e = 0;
+  for(int i=0;i<n;i++)
+    e = max(e, (double)fabs(a[i] - b[i]));
+  return e;
+}
+
+// the scatter loops the FWS and PWS layers used to backpropagate one sample with: the delta of every
+// output times its window goes to the filter of its sw x sh section, the filter times the delta to the
+// window of every previous map. A FWS layer is one section.
+void scatterBackward(nnLayer *l, const nnreal *conv, int fw, int fh, int sw, int sh, int st,
+  vector<nnreal> &dw, vector<nnreal> &db, vector<nnreal> &pdt) {
+
+  nnLayer *p = l->getPrevLayer();
+  int n = l->getUnitCount(), w = l->getWidth(), h = l->getHeight(), nm = l->getMapNum();
+  int pw = p->getWidth(), np = p->getUnitCount(), nmp = p->getMapNum();
+  int nf = fw * fh, cols = (w + sw - 1) / sw, ns = cols * ((h + sh - 1) / sh);
+  const nnreal *pa = p->getActivation(), *dt = l->getDelta();
+
+  dw.assign(nf * ns * nm, 0);
+  db.assign(ns * nm, 0);
+  pdt.assign(np * nmp, 0);
+  for(int mi=0;mi<nm;mi++) {
+    for(int y=0;y<h;y++) {
+      for(int x=0;x<w;x++) {
+        int sec = mi * ns + y / sh * cols + x / sw;
+        nnreal d = dt[mi * n + y * w + x];
+        db[sec] += d;
+        for(int pm=0;pm<np*nmp;pm+=np) {
+          for(int fy=0;fy<fh;fy++) {
+            for(int fx=0;fx<fw;fx++) {
+              int k = pm + (y * st + fy) * pw + x * st + fx;
+              dw[sec * nf + fy * fw + fx] += d * pa[k];
+              pdt[k] += conv[sec * nf + fy * fw + fx] * d;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// forward of a fw x fh convolution with nm maps on nmp previous maps of w x h
+void benchConv(int w, int h, int nmp, int fw, int fh, int nm) {
+
+  nnSparrow nn;
+  nnLayer *in = nn.addInputLayer(w + 2, h + 2, 1);
+  nnLayer *pl = nn.addFWSConvLayer(in, 3, 3, nmp);
+  nnFWSConvLayer *l = (nnFWSConvLayer*)nn.addFWSConvLayer(pl, fw, fh, nm);
+  nn.prepare();
+
+  vector<nnreal> x((w + 2) * (h + 2));
+  randomFill(x);
+  ((nnInputLayer*)in)->inputSample(&x[0], x.size());
+  pl->forward();
+  vector<nnreal> d(l->getTotalUnitCount());
+  randomFill(d);
+  memcpy(l->getDelta(), &d[0], d.size() * sizeof(nnreal));
+
+  printf("\nconvolution %dx%dx%d, %dx%d filter, %d maps\n", w, h, nmp, fw, fh, nm);
+  double flops = 2.0 * l->getTotalUnitCount() * fw * fh * nmp;
+
+  l->setEngine(nnFWSConvLayer::CONV_DIRECT);
+  double t0 = timeit([&]() { l->forward(); });
+  double b0 = timeit([&]() { l->backpropagation(); });
+  l->setEngine(nnFWSConvLayer::CONV_IM2COL);
+  double t1 = timeit([&]() { l->forward(); });
+  double b1 = timeit([&]() { l->backpropagation(); });
+  report("forward, im2col", flops, t0, t1);
+  printf("%-28s direct %7.3lf ms (%.1lfx forward)   im2col %7.3lf ms (%.1lfx forward), max error %.1le\n",
+    "backward", b0 * 1e3, b0 / t0, b1 * 1e3, b1 / t1, l->checkEngineBackward());
+
+  // the direct loops against the scatter loops they replaced, the previous delta before its updateDelta()
+  vector<nnreal> dw, db, pdt;
+  scatterBackward(l, l->getConv(), fw, fh, l->getWidth(), l->getHeight(), 1, dw, db, pdt);
+  memset(l->getDConv(), 0, dw.size() * sizeof(nnreal));
+  l->backpropagationDirect();
+  printf("%-28s direct against the scatter loops, max error %.1le\n", "backward",
+    max(maxError(&dw[0], l->getDConv(), dw.size()), maxError(&pdt[0], pl->getDelta(), pdt.size())));
+
+  l->setEngine(nnFWSConvLayer::CONV_FFT);
+  double t3 = timeit([&]() { l->forward(); });
+  double b3 = timeit([&]() { l->backpropagation(); });
+  report("forward, fft", flops, t0, t3);
+  printf("%-28s forward max error %.1le\n", "", l->checkEngine());
+  printf("%-28s fft %7.3lf ms, max error %.1le\n", "backward", b3 * 1e3, l->checkEngineBackward());
+  l->setEngine(nnFWSConvLayer::CONV_AUTO);
+  const char *engine[] = { "direct", "im2col", "winograd", "fft" };
+  printf("%-28s %s\n", "auto engine", engine[l->getEngine()]);
+
+  for(int m = 2; m <= 4; m += 2) {
+    l->setWinogradTile(m);
+    if(!l->setEngine(nnFWSConvLayer::CONV_WINOGRAD))
+      break;
+    int a = m + fw - 1;
+    char name[64];
+    sprintf(name, "forward, winograd F(%d,%d)", m, fw);
+    double t2 = timeit([&]() { l->forward(); });
+    report(name, flops, t0, t2);
+    printf("%-28s %.2lf multiplies per output instead of %d, max error %.1le\n",
+      "", double(a * a) / (m * m), fw * fh, l->checkEngine());
+  }
+}
+
+// partial weight sharing convolution, sw x sh sections, stride st
+void benchPWS(int w, int h, int fw, int sw, int st, int nm) {
+
+  // a 1x1 max pooling passes the input on and keeps the delta it receives, its updateDelta() does nothing
+  nnSparrow nn;
+  nnLayer *in = nn.addInputLayer(w, h, 1);
+  nnLayer *pl = nn.addMaxPoolingLayer(in, 1, 1);
+  nnPWSConvLayer *l = (nnPWSConvLayer*)nn.addPWSConvLayer(pl, fw, fw, sw, sw, nm, st, st);
+  nn.prepare();
+
+  vector<nnreal> x(w * h), d(l->getTotalUnitCount());
+  randomFill(x);
+  randomFill(d);
+  ((nnInputLayer*)in)->inputSample(&x[0], x.size());
+  pl->forward();
+  memcpy(l->getDelta(), &d[0], d.size() * sizeof(nnreal));
+
+  double flops = 2.0 * l->getTotalUnitCount() * fw * fw;
+  double t = timeit([&]() { l->forward(); });
+  double b = timeit([&]() { l->backpropagation(); });
+
+  vector<nnreal> dw, db, pdt;
+  scatterBackward(l, l->getConv(), fw, fw, sw, sw, st, dw, db, pdt);
+  memset(l->getDConv(), 0, dw.size() * sizeof(nnreal));
+  memset(l->getDConvb(), 0, db.size() * sizeof(nnreal));
+  l->backpropagation();
+  double err = max(maxError(&dw[0], l->getDConv(), dw.size()), maxError(&db[0], l->getDConvb(), db.size()));
+  err = max(err, maxError(&pdt[0], pl->getDelta(), pdt.size()));
+  printf("pws %3dx%-3d %dx%d filter, %dx%d sections, stride %d, %d maps: forward %7.3lf ms (%.2lf GFLOP/s), backward %7.3lf ms, max error %.1le\n",
+    w, h, fw, fw, sw, sw, st, nm, t * 1e3, flops / t * 1e-9, b * 1e3, err);
+}
+
+// max and average pooling of nm maps of w x h with f x f windows
+void benchPool(int w, int h, int f, int nm) {
+
+  nnSparrow nn;
+  nnLayer *in = nn.addInputLayer(w + 2, h + 2, 1);
+  nnLayer *pl = nn.addFWSConvLayer(in, 3, 3, nm);
+  nnLayer *mp = nn.addMaxPoolingLayer(pl, f, f);
+  nnLayer *ap = nn.addAvgPoolingLayer(pl, f, f);
+  nn.prepare();
+
+  vector<nnreal> x((w + 2) * (h + 2));
+  randomFill(x);
+  ((nnInputLayer*)in)->inputSample(&x[0], x.size());
+  pl->forward();
+
+  // backpropagation goes on into the conv layer's updateDelta, time it apart
+  double mf = timeit([&]() { mp->forward(); });
+  double af = timeit([&]() { ap->forward(); });
+  double ud = timeit([&]() { pl->updateDelta(); });
+  double mb = timeit([&]() { mp->backpropagation(); }) - ud;
+  double ab = timeit([&]() { ap->backpropagation(); }) - ud;
+  printf("pool %3dx%-3d %dx%d, %d maps: max forward %6.1lf us, backward %6.1lf us   avg forward %6.1lf us, backward %6.1lf us\n",
+    w, h, f, f, nm, mf * 1e6, mb * 1e6, af * 1e6, ab * 1e6);
+}
+
+// throughput and largest relative error against libm of an activation at each nnMath accuracy
+void benchActivation(const char *name, activation f, double (*ref)(double), double lo, double hi) {
+
+  const int n = 4096;
+  vector<nnreal> x(n), a(n);
+  for(int i=0;i<n;i++)
+    x[i] = lo + (hi - lo) * rand() / RAND_MAX;
+
+  static const char *acc[] = {"exact", "high", "fast"};
+  printf("%-10s [%5.0lf, %4.0lf]", name, lo, hi);
+  for(int k=nnMath::EXACT;k<=nnMath::FAST;k++) {
+    nnMath::setAccuracy(k);
+    double t = timeit([&]() { a = x; f(&a[0], n); });
+    a = x;
+    f(&a[0], n);
+    double err = 0;
+    for(int i=0;i<n;i++) {
+      double r = ref(x[i]);
+      double e = fabs(a[i] - r) / MAX(fabs(r), 1e-300);
+      if(e > err)
+        err = e;
+    }
+    printf("   %s %6.2lf ns %.1le", acc[k], t / n * 1e9, err);
+  }
+  printf("\n");
+  nnMath::setAccuracy(nnMath::HIGH);
+}
+
+// a 6x6 blob in one of the four quadrants of a noisy 32x32 image
+void quadrantSample(vector<double> &x, int c) {
+  x.assign(32*32, 0);
+  for(int i=0;i<x.size();i++)
+    x[i] = 0.2 * rand() / RAND_MAX;
+  int ox = (c & 1) * 16 + rand() % 10, oy = (c >> 1) * 16 + rand() % 10;
+  for(int y=0;y<6;y++)
+    for(int i=0;i<6;i++)
+      x[(oy + y)*32 + ox + i] += 0.8;
+}
+
+// a small LeNet trained on the quadrant blobs, against its int8 copy
+void benchQuantized(bool pws) {
+
+  nnSparrow nn;
+  nnLayer *l = nn.addInputLayer(32, 32, 1);
+  l = nn.addFWSConvLayer(l, 5, 5, 6, TANH);
+  l = nn.addMaxPoolingLayer(l, 2, 2);
+  if(pws)
+    l = nn.addPWSConvLayer(l, 3, 3, 4, 4, 8, 1, 1, TANH);
+  else
+    l = nn.addFWSConvLayer(l, 5, 5, 16, TANH);
+  l = nn.addAvgPoolingLayer(l, 2, 2);
+  l = nn.addFullLayer(l, 120, TANH);
+  nn.addSoftmaxLayer(l, 4);
+  nn.prepare();
+
+  vector<vector<double> > train(2000), test(500);
+  vector<int> label(2000), tlabel(500);
+  for(int i=0;i<train.size();i++) {
+    label[i] = rand() % 4;
+    quadrantSample(train[i], label[i]);
+  }
+  for(int i=0;i<test.size();i++) {
+    tlabel[i] = rand() % 4;
+    quadrantSample(test[i], tlabel[i]);
+  }
+  nn.setEpochCount(4);
+  nn.setLearningRate(0.01);
+  nn.train(train, label);
+
+  vector<vector<double> > calib(train.begin(), train.begin() + 100);
+  nnQuantizedNet q;
+  q.build(nn, calib);
+  printf("%s: ", pws ? "pws" : "fws");
+  q.report(nn, test, tlabel);
+
+  int o, k = 0;
+  double tf = timeit([&]() { nn.predict(test[k++ % test.size()], o); });
+  double tq = timeit([&]() { q.predict(test[k++ % test.size()], o); });
+  printf("predict float %6.1lf us, int8 %6.1lf us   x%.2lf\n", tf * 1e6, tq * 1e6, tf / tq);
+}
+
+// activation memory of a deep chain of full layers before and after freezing, and the predict time of both
+void benchPlanned(int depth, int width) {
+
+  nnSparrow nn;
+  nnLayer *l = nn.addInputLayer(width, 1, 1);
+  for(int i=0;i<depth;i++)
+    l = nn.addFullLayer(l, width, TANH);
+  nn.addSoftmaxLayer(l, 10);
+  nn.prepare();
+
+  vector<double> x(width);
+  for(int i=0;i<width;i++)
+    x[i] = (double)rand() / RAND_MAX;
+  int o;
+  size_t b = nn.getActivationBytes();
+  double t = timeit([&]() { nn.predict(x, o); });
+  nn.freeze();
+  size_t bf = nn.getActivationBytes();
+  double tf = timeit([&]() { nn.predict(x, o); });
+  printf("%2d x %4d full: activations %7zu -> %6zu bytes, predict %7.1lf -> %7.1lf us\n",
+    depth, width, b, bf, t * 1e6, tf * 1e6);
+}
+
+// a LeNet on 1000 random images: predict() one by one against predictBatch() in chunks of 32 on nt threads,
+// wall time per image
+void benchPredictBatch(int nt) {
+
+  nnSparrow nn;
+  nnLayer *l = nn.addInputLayer(32, 32, 1);
+  l = nn.addFWSConvLayer(l, 5, 5, 6, TANH);
+  l = nn.addMaxPoolingLayer(l, 2, 2);
+  l = nn.addFWSConvLayer(l, 5, 5, 16, TANH);
+  l = nn.addMaxPoolingLayer(l, 2, 2);
+  l = nn.addFullLayer(l, 120, TANH);
+  nn.addSoftmaxLayer(l, 10);
+  nn.prepare();
+  nn.setThreadCount(nt);
+
+  vector<vector<double> > x(1000, vector<double>(32*32));
+  for(int i=0;i<x.size();i++)
+    for(int j=0;j<x[i].size();j++)
+      x[i][j] = (double)rand() / RAND_MAX;
+  vector<int> label(x.size());
+
+  chrono::steady_clock::time_point st = chrono::steady_clock::now();
+  for(int i=0;i<x.size();i++)
+    nn.predict(x[i], label[i]);
+  double ts = chrono::duration<double>(chrono::steady_clock::now() - st).count();
+  st = chrono::steady_clock::now();
+  nn.predictBatch(x, label);
+  double tb = chrono::duration<double>(chrono::steady_clock::now() - st).count();
+  printf("%d threads: predict %6.1lf us, predictBatch %6.1lf us   x%.2lf\n",
+    nt, ts / x.size() * 1e6, tb / x.size() * 1e6, ts / tb);
+}
+
+// latency of one sample through wide layers, serial and split inside the layers over nt threads
+void benchIntraLayer(int nt) {
+
+  nnSparrow nn;
+  nnLayer *l = nn.addInputLayer(64, 64, 1);
+  l = nn.addFWSConvLayer(l, 3, 3, 32, RECTIFIER);
+  l = nn.addMaxPoolingLayer(l, 2, 2);
+  l = nn.addFWSConvLayer(l, 3, 3, 64, RECTIFIER);
+  l = nn.addMaxPoolingLayer(l, 2, 2);
+  l = nn.addFullLayer(l, 1024, RECTIFIER);
+  nn.addSoftmaxLayer(l, 10);
+  nn.prepare();
+  nn.freeze();
+  nn.setThreadCount(nt);
+
+  vector<double> x(64*64);
+  for(int j=0;j<x.size();j++)
+    x[j] = (double)rand() / RAND_MAX;
+
+  double t[2];
+  int label;
+  for(int p=0;p<2;p++) {
+    nn.setParallelThreshold(p ? 1 << 17 : 0);
+    nn.predict(x, label);
+    int reps = 50;
+    chrono::steady_clock::time_point st = chrono::steady_clock::now();
+    for(int r=0;r<reps;r++)
+      nn.predict(x, label);
+    t[p] = chrono::duration<double>(chrono::steady_clock::now() - st).count() / reps;
+  }
+  printf("%d threads: predict one sample %8.1lf us, split layers %8.1lf us   x%.2lf\n",
+    nt, t[0] * 1e6, t[1] * 1e6, t[0] / t[1]);
+}
+
+// one epoch of a LeNet on 2000 quadrant blobs in mini-batches of 64, on one thread and data parallel on nt
+void benchTrainParallel(int nt) {
+
+  vector<vector<double> > x(2000);
+  vector<int> label(x.size());
+  for(int i=0;i<x.size();i++) {
+    label[i] = rand() % 4;
+    quadrantSample(x[i], label[i]);
+  }
+
+  // serial, synchronous data parallel and hogwild on the same data
+  const char *name[3] = {"serial", "data parallel", "hogwild"};
+  for(int p=0;p<3;p++) {
+    // one thread has no workers, the parallel modes would just time the serial path again
+    if(p && nt < 2) {
+      printf("epoch %-13s skipped, %d hardware thread\n", name[p], nt);
+      continue;
+    }
+    srand(1);
+    nnSparrow nn;
+    nnLayer *l = nn.addInputLayer(32, 32, 1);
+    l = nn.addFWSConvLayer(l, 5, 5, 6, TANH);
+    l = nn.addMaxPoolingLayer(l, 2, 2);
+    l = nn.addFWSConvLayer(l, 5, 5, 16, TANH);
+    l = nn.addMaxPoolingLayer(l, 2, 2);
+    l = nn.addFullLayer(l, 120, TANH);
+    nn.addSoftmaxLayer(l, 4);
+    nn.setThreadCount(p ? nt : 1);
+    nn.setDataParallel(p == 1);
+    nn.setHogwild(p == 2);
+    nn.setTrainBatchCount(64);
+    nn.setEpochCount(1);
+
+    chrono::steady_clock::time_point st = chrono::steady_clock::now();
+    nn.train(x, label);
+    double t = chrono::duration<double>(chrono::steady_clock::now() - st).count();
+    printf("epoch %-13s %d threads %6.3lf s %8.0lf samples/s   acc %.3lf\n", name[p], nn.getThreadCount(), t, x.size() / t, nn.evaluate(x, label));
+  }
+}
+
+double refSigmoid(double x) { return 1.0 / (1.0 + exp(-x)); }
+double refSoftplus(double x) { return log1p(exp(x)); }
+double refExp(double x) { return exp(x); }
+double refTanh(double x) { return tanh(x); }
+
+int main()
+{
+  srand(0);
+  printf("nnreal is %s\n", sizeof(nnreal) == sizeof(float) ? "float" : "double");
+
+  benchDense(120, 1176);
+  benchDense(10, 120);
+  benchDense(1024, 1024);
+
+  benchRange(64, 8);
+  benchRange(1024, 16);
+
+  printf("\n16 bit weights\n");
+  benchHalf(120, 1176);
+  benchHalf(1024, 1024);
+  benchHalf(4096, 4096);
+
+  printf("\npruned weights, dense time / CSR time by density\n");
+  benchSparse(120, 1176, 28, 5);
+  benchSparse(1024, 1024, 64, 3);
+  benchSparse(4096, 1024, 128, 7);
+
+  benchGemm(10, 120, 1176);
+  benchGemm(64, 120, 1176);
+  benchGemm(256, 256, 256);
+
+  benchConv(32, 32, 1, 5, 5, 6);
+  benchConv(14, 14, 6, 5, 5, 16);
+  benchConv(64, 64, 8, 3, 3, 32);
+  benchConv(64, 64, 4, 9, 9, 8);
+  benchConv(128, 128, 1, 15, 15, 4);
+  benchConv(256, 256, 1, 15, 15, 4);
+
+  printf("\n");
+  benchPWS(100, 100, 5, 16, 1, 8);
+  benchPWS(100, 100, 3, 8, 2, 8);
+
+  printf("\n");
+  benchPool(24, 24, 2, 6);
+  benchPool(64, 64, 2, 32);
+  benchPool(63, 63, 3, 32);
+  benchPool(38, 38, 19, 8);
+
+  printf("\nactivation, time per element and max relative error\n");
+  benchActivation("exp", nnMath::exp, refExp, -30, 30);
+  benchActivation("sigmoid", nnActivation::sigmoid, refSigmoid, -30, 30);
+  benchActivation("tanh", nnActivation::tanh, refTanh, -10, 10);
+  benchActivation("softplus", nnActivation::softplus, refSoftplus, -30, 30);
+
+  printf("\nplanned activations of a frozen network\n");
+  benchPlanned(8, 256);
+  benchPlanned(16, 1024);
+
+  printf("\nbatched prediction\n");
+  benchPredictBatch(1);
+  benchPredictBatch(thread::hardware_concurrency());
+
+  printf("\nlayers split over threads\n");
+  benchIntraLayer(thread::hardware_concurrency());
+
+  printf("\ndata parallel training\n");
+  benchTrainParallel(thread::hardware_concurrency());
+
+  printf("\nint8 inference\n");
+  benchQuantized(false);
+  benchQuantized(true);
+
+  return 0;
+}
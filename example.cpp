@@ -42,18 +42,7 @@ void testResult(void *param) {
   nnSparrow *nn = (nnSparrow*)param;
 
   printf("\nTime consumption: %.2lfs\n", double(clock()-nn->getRunTime())/CLOCKS_PER_SEC);
-  int num = 0, cnum = 0;
-  int ret = 0;
-
-  for(int i=0;i<test_data.size();i++) {
-    if(nn->predict(test_data[i], ret)) {
-      num++;
-      if(test_label[i] == ret) {
-        cnum++;
-      }
-    }
-  }
-  double rate = double(cnum)/num;
+  double rate = nn->evaluate(test_data, test_label);
   printf("Accuracy: %.2lf%%\n", rate*100);
 
 };
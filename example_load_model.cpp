@@ -41,20 +41,17 @@ void testResult(void *param) {
 
   nnSparrow *nn = (nnSparrow*)param;
 
-  int num = 0, cnum = 0;
-  int ret = 0;
-
-  for(int i=0;i<test_data.size();i++) {
-    if(nn->predict(test_data[i], ret)) {
-      num++;
-      if(test_label[i] == ret) {
-        cnum++;
-      }
-    }
-  }
-  double rate = double(cnum)/num;
+  vector<vector<int> > confusion;
+  double rate = nn->evaluate(test_data, test_label, &confusion);
   printf("Accuracy: %.2lf%%\n", rate*100);
 
+  // rows are the true digits, columns the predicted ones
+  for(int i=0;i<confusion.size();i++) {
+    for(int j=0;j<confusion[i].size();j++)
+      printf("%5d", confusion[i][j]);
+    printf("\n");
+  }
+
 };
 
 
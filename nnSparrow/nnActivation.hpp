@@ -30,10 +30,12 @@
 #include <cstdio>
 #include <cfloat>
 
+#include "nnMath.hpp"
+
 #ifndef __NN_ACTIVATION__
 #define __NN_ACTIVATION__
 
-typedef void (*activation)(double*, int);
+typedef void (*activation)(nnreal*, int);
 
 enum ACTIVATION_TYPE {
   SIGMOID = 0,
@@ -58,36 +60,31 @@ public:
   }
 
 
-  static void sigmoid(double *a, int n) {
+  // the transcendental ones go through nnMath at its current accuracy
+  static void sigmoid(nnreal *a, int n) {
 
-    for(int i=0;i<n;i++) {
-      a[i] = 1.0 / ( exp(-a[i]) + 1.0 );
-    }
+    nnMath::sigmoid(a, n);
   }
-  static void dsigmoid(double *a, int n) {
+  static void dsigmoid(nnreal *a, int n) {
 
     for(int i=0;i<n;i++) {
       a[i] = a[i] * ( 1.0 - a[i] );
     }
   }
 
-  static void tanh(double *a, int n) {
+  static void tanh(nnreal *a, int n) {
 
-    for(int i=0;i<n;i++) {
-      double x1 = exp(a[i]);
-      double x2 = exp(-a[i]);
-       a[i] = (x1 - x2) / (x1 + x2);
-    }
+    nnMath::tanh(a, n);
   }
 
-  static void dtanh(double *a, int n) {
+  static void dtanh(nnreal *a, int n) {
 
     for(int i=0;i<n;i++) {
       a[i] = 1 - a[i]*a[i];
     }
   }
 
-  static void rectifier(double *a, int n) {
+  static void rectifier(nnreal *a, int n) {
 
     for(int i=0;i<n;i++) {
       if(a[i] < 0)
@@ -95,28 +92,24 @@ public:
     }
   }
 
-  static void drectifier(double *a, int n) {
+  static void drectifier(nnreal *a, int n) {
     for(int i=0;i<n;i++) {
       a[i] = (a[i] > 0) ? 1 : 0;
     }
   }
 
-  static void softplus(double *a, int n) {
-  	for(int i=0;i<n;i++) {
-  		a[i] = log( 1 + exp(a[i]) );
-  	}
+  static void softplus(nnreal *a, int n) {
+    nnMath::softplus(a, n);
   }
 
-  static void dsoftplus(double *a, int n) {
-  	for(int i=0;i<n;i++) {
-  		a[i] = 1.0 / (1 + exp(-a[i]) );
-  	}
+  static void dsoftplus(nnreal *a, int n) {
+    nnMath::sigmoid(a, n);
   }
 
-  static void original(double *a, int n) {
+  static void original(nnreal *a, int n) {
   }
 
-  static void doriginal(double *a, int n) {
+  static void doriginal(nnreal *a, int n) {
     for(int i=0;i<n;i++) {
       a[i] = 1;
     }
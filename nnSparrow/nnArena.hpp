@@ -0,0 +1,164 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "nnKernel.hpp"
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifndef __NN_ARENA__
+#define __NN_ARENA__
+
+// One block holding the nnreal buffers of a network, each starting on a cache line. Buffers are
+// recorded with add(), then build() moves them in and repoints them.
+class nnArena {
+
+public:
+	enum ARENA_MODE {
+		HEAP = 0,
+		ALIGNED,
+		// backed by 2MB pages where the system has transparent huge pages
+		HUGE_PAGES
+	};
+
+	static const size_t ALIGNMENT = 64;
+	static const size_t HUGE_PAGE = 2 << 20;
+
+protected:
+	struct Buffer {
+		nnreal **p;
+		long n;
+	};
+	std::vector<Buffer> _buffers;
+	char *_base;
+	size_t _size;
+	int _mode;
+	// the mapping _base was aligned in, for munmap
+	void *_map;
+	size_t _map_size;
+
+public:
+	nnArena() {
+		_base = NULL;
+		_size = 0;
+		_mode = HEAP;
+		_map = NULL;
+		_map_size = 0;
+	}
+	~nnArena() {
+		if(!_base)
+			return;
+#ifdef __linux__
+		if(_mode == HUGE_PAGES) {
+			munmap(_map, _map_size);
+			return;
+		}
+#endif
+		free(_base);
+	}
+
+	// record the buffer *p of n values, NULL or empty ones are skipped
+	void add(nnreal **p, long n) {
+		if(*p && n > 0) {
+			Buffer b = {p, n};
+			_buffers.push_back(b);
+		}
+	}
+
+	// copy the recorded buffers into the arena and point them there. The buffers they leave are freed,
+	// unless they lie in prev, the arena they are moving from. HEAP gives every buffer its own new[].
+	void build(int mode, const nnArena *prev) {
+
+		_mode = mode;
+		_size = 0;
+		for(int i = 0; i < _buffers.size(); i++)
+			_size += roundUp(_buffers[i].n * sizeof(nnreal), ALIGNMENT);
+
+		if(mode != HEAP && _size > 0)
+			allocate();
+
+		size_t off = 0;
+		for(int i = 0; i < _buffers.size(); i++) {
+			nnreal *old = *_buffers[i].p;
+			long n = _buffers[i].n;
+			nnreal *p;
+			if(_base) {
+				p = (nnreal*)(_base + off);
+				off += roundUp(n * sizeof(nnreal), ALIGNMENT);
+			}
+			else
+				p = new nnreal[n];
+			memcpy(p, old, n * sizeof(nnreal));
+			if(!(prev && prev->contains(old)))
+				delete [] old;
+			*_buffers[i].p = p;
+		}
+		_buffers.clear();
+	}
+
+	bool contains(const void *p) const {
+		return _base && (const char*)p >= _base && (const char*)p < _base + _size;
+	}
+	// bytes held by the arena, 0 in HEAP mode
+	size_t getSize() const {
+		return _base ? _size : 0;
+	}
+	int getMode() const {
+		return _mode;
+	}
+
+	static size_t roundUp(size_t n, size_t a) {
+		return (n + a - 1) / a * a;
+	}
+
+protected:
+	void allocate() {
+#ifdef __linux__
+		if(_mode == HUGE_PAGES) {
+			// mmap only aligns to 4K, a page more leaves room to start on a 2MB boundary
+			_size = roundUp(_size, HUGE_PAGE);
+			size_t len = _size + HUGE_PAGE;
+			void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(p != MAP_FAILED) {
+				_map = p;
+				_map_size = len;
+				_base = (char*)roundUp((size_t)p, HUGE_PAGE);
+				madvise(_base, _size, MADV_HUGEPAGE);
+				return;
+			}
+		}
+#endif
+		_mode = ALIGNED;
+		_size = roundUp(_size, ALIGNMENT);
+		_base = (char*)aligned_alloc(ALIGNMENT, _size);
+	}
+};
+
+#endif
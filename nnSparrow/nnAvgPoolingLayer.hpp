@@ -36,7 +36,6 @@ class nnAvgPoolingLayer : public nnLayer {
 private:
 	int _filter_width;
 	int _filter_height;
-	int* _u_W_idx;
 
 public:
 
@@ -44,7 +43,6 @@ public:
 
 		_filter_width = 0;
 		_filter_height = 0;
-		_u_W_idx = NULL;
 		_layer_type = AVG_POOLING_LAYER;
 
 	}
@@ -68,127 +66,80 @@ public:
 
 		this->_unit_count = _width * _height;
 		this->_prev_unit_count = prev ? prev->getUnitCount() : 0;
-		_u_W_idx = NULL;
 
 		this->_layer_type = AVG_POOLING_LAYER;
 	}
 	~nnAvgPoolingLayer() {
+	}
 
-		if(_u_W_idx)
-			delete [] _u_W_idx;
+	int getFilterWidth() {
+		return _filter_width;
+	}
+	int getFilterHeight() {
+		return _filter_height;
 	}
 
 	void init() {
 		clear();
-		int n = _unit_count, np = _prev_unit_count, nm = _map_num;
-
-
-		_u_a = new double[n*nm];
-		memset(_u_a, 0, sizeof(double)*n*nm);
-
-		_u_delta = new double[n*nm];
-		memset(_u_delta, 0, sizeof(double)*n*nm);
-
-
-		_u_W_idx = new int[n*_filter_height*2];
-		memset(_u_W_idx, -1, sizeof(int)*n*_filter_height*2);
-
-
-		mapFilterToWeights();
-
-	}
-
-
-	void mapFilterToWeights() {
-
-		int pw = _prev->getWidth();
-		int ph = _prev->getHeight();
-		int fw = _filter_width;
-		int fh = _filter_height;
-		int n = _unit_count, np = _prev_unit_count;
-
-		int wn = fh * 2;
-
-		int step = 0;
-		for(int i = 0; i < n; i++) {
-			for(int j = 0; j < fh * pw; j += pw) {
-				if(step + j >= pw * ph)
-					break;
-
-				int lu = MIN(fw, (step/pw + 1)*pw-step);
-
-				_u_W_idx[i*wn + 2*j/pw + 0] = step + j + 0;
-				_u_W_idx[i*wn + 2*j/pw + 1] = step + j + lu;
-
-			}
-			if(step % pw + fw >= pw)
-				step = (step / pw + fh) * pw;
-			else
-				step += fw;
-		}
+		initBatch();
 	}
 
 	void forward() {
 
-		const int n = _unit_count, np = _prev_unit_count, nm = _map_num;
+		const int n = _unit_count, np = _prev_unit_count, nm = _map_num * _batch_count;
 		const int pw = _prev->getWidth();
+		const int ph = _prev->getHeight();
 		const int fw = _filter_width;
 		const int fh = _filter_height;
 
-		double *ppa = _prev->getActivation();
-		double *pa = _u_a;
-
-		int wn = fh*2;
-
-		for(int mi = 0; mi < nm; mi++, ppa += np) {
-
-			int *pidx = _u_W_idx;
-			for(int i = 0; i < n; i++, pidx += wn, pa++) {
-				double sum = 0;
-				int sz = 0;
-				for(int j = 0; j < wn; j += 2) {
-					int st = *(pidx + j + 0);
-					if(st < 0)
-						break;
-					int ed = *(pidx + j + 1);
-					for(int k = st; k < ed; k++) {
-						sum += *(ppa + k);
-						sz ++;
-					}
+		// windows of a row are fw apart, the last one may be cut by the edge of the map
+		const int nfull = MIN(_width, pw / fw);
+		const int lw = pw - nfull * fw;
+
+		// the planes of every map and sample split among the threads
+		parallelRange(nm, (long)np, [&](int m0, int m1) {
+			const nnreal *ppa = _prev->getActivation() + (long)m0*np;
+			nnreal *pa = _u_a + (long)m0*n;
+
+			for(int mi = m0; mi < m1; mi++, ppa += np, pa += n) {
+				for(int y = 0; y < _height; y++) {
+					const nnreal *row = ppa + y*fh*pw;
+					int ch = MIN(fh, ph - y*fh);
+					nnKernel::avgPoolRow(nfull, row, pw, fw, ch, pa + y*_width);
+					if(nfull < _width)
+						nnKernel::avgPoolRow(1, row + nfull*fw, pw, lw, ch, pa + y*_width + nfull);
 				}
-				*pa = sum / sz;
 			}
-		}
+		});
 	}
 
 	void backpropagation() {
 
-		double *ppd = _prev->getDelta();
-		const int n = _unit_count, np = _prev_unit_count, nm = _map_num;
+		nnreal *ppd = _prev->getDelta();
+		const int n = _unit_count, np = _prev_unit_count, nm = _map_num * _batch_count;
+		const int pw = _prev->getWidth();
+		const int ph = _prev->getHeight();
+		const int fw = _filter_width;
+		const int fh = _filter_height;
+		const int nfull = MIN(_width, pw / fw);
+		const int lw = pw - nfull * fw;
 
 		if(ppd) {
-			memset(ppd, 0, sizeof(double)*_prev->getTotalUnitCount());
-			double *pd = _u_delta;
-
-			int wn = _filter_height*2;
-
-			for(int mi = 0; mi < nm; mi++, pd += n, ppd += np) {
-
-				int *pidx = _u_W_idx;
-				for(int i = 0; i < n; i++, pidx += wn) {
-
-					double d = *(pd + i);
-					for(int j = 0; j < wn; j += 2) {
-						int st = *(pidx + j + 0);
-						if(st < 0)
-							break;
-						int ed = *(pidx + j + 1);
-						for(int k = st; k < ed; k++) {
-							*(ppd + k) = d;
-						}
+			// the windows cover the previous map, every unit is written
+			parallelRange(nm, (long)np, [&](int m0, int m1) {
+				const nnreal *pd = _u_delta + (long)m0*n;
+				nnreal *pp = ppd + (long)m0*np;
+
+				for(int mi = m0; mi < m1; mi++, pd += n, pp += np) {
+					for(int y = 0; y < _height; y++) {
+						nnreal *row = pp + y*fh*pw;
+						int ch = MIN(fh, ph - y*fh);
+						nnKernel::unpoolAvgRow(nfull, pd + y*_width, fw, ch, row, pw);
+						if(nfull < _width)
+							nnKernel::unpoolAvgRow(1, pd + y*_width + nfull, lw, ch, row + nfull*fw, pw);
 					}
 				}
-			}
+			});
 
 			_prev->updateDelta();
 		}
@@ -207,10 +158,6 @@ public:
 	void clear() {
 
 		nnLayer::clear();
-		if(_u_W_idx) {
-			delete [] _u_W_idx;
-			_u_W_idx = NULL;
-		}
 	}
 	void write(std::ofstream &fout) {
 
@@ -227,6 +174,10 @@ public:
 		fin >> _width >> _height >> _map_num;
 		init();
 	}
+
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
 };
 
 
@@ -0,0 +1,180 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <algorithm>
+
+#ifndef __NN_FFT__
+#define __NN_FFT__
+
+// 2D radix-2 FFT on a w x h plane, w and h powers of two, stored row by row.
+// Two real planes go through one complex transform as a + i b.
+class nnFFT {
+
+public:
+	typedef std::complex<double> cplx;
+
+protected:
+	int _w;
+	int _h;
+
+	std::vector<cplx> _tw_w;
+	std::vector<cplx> _tw_h;
+	std::vector<int> _rev_w;
+	std::vector<int> _rev_h;
+
+	static void setupAxis(int n, std::vector<cplx> &tw, std::vector<int> &rev) {
+
+		tw.resize(n/2);
+		for(int k = 0; k < n/2; k++)
+			tw[k] = std::polar(1.0, -2 * M_PI * k / n);
+
+		rev.resize(n);
+		int bits = 0;
+		while((1 << bits) < n)
+			bits++;
+		for(int i = 0; i < n; i++) {
+			int r = 0;
+			for(int b = 0; b < bits; b++)
+				r |= ((i >> b) & 1) << (bits - 1 - b);
+			rev[i] = r;
+		}
+	}
+
+	// in place transform of n elements, each a run of len complex numbers at x + i*len,
+	// so that the columns of a plane are transformed together row against row
+	static void transform(cplx *x, int n, int len, const cplx *tw, const int *rev, bool inverse) {
+
+		for(int i = 0; i < n; i++) {
+			int j = rev[i];
+			if(i < j) {
+				for(int l = 0; l < len; l++)
+					std::swap(x[i*len + l], x[j*len + l]);
+			}
+		}
+
+		double sgn = inverse ? -1 : 1;
+		for(int size = 2; size <= n; size <<= 1) {
+			int half = size >> 1, step = n / size;
+			for(int st = 0; st < n; st += size) {
+				for(int k = 0; k < half; k++) {
+					double wr = tw[k*step].real(), wi = sgn * tw[k*step].imag();
+					double *a = (double*)(x + (st + k)*len);
+					double *b = (double*)(x + (st + k + half)*len);
+					for(int l = 0; l < 2*len; l += 2) {
+						double tr = b[l]*wr - b[l+1]*wi;
+						double ti = b[l]*wi + b[l+1]*wr;
+						b[l] = a[l] - tr;
+						b[l+1] = a[l+1] - ti;
+						a[l] += tr;
+						a[l+1] += ti;
+					}
+				}
+			}
+		}
+	}
+
+public:
+	nnFFT() {
+		_w = 0;
+		_h = 0;
+	}
+
+	static int roundUp(int n) {
+		int p = 1;
+		while(p < n)
+			p <<= 1;
+		return p;
+	}
+
+	bool setup(int w, int h) {
+		if(w < 1 || h < 1 || roundUp(w) != w || roundUp(h) != h)
+			return false;
+		_w = w;
+		_h = h;
+		setupAxis(w, _tw_w, _rev_w);
+		setupAxis(h, _tw_h, _rev_h);
+		return true;
+	}
+
+	int getWidth() {
+		return _w;
+	}
+	int getHeight() {
+		return _h;
+	}
+	int getSize() {
+		return _w * _h;
+	}
+
+	void forward(cplx *x) {
+		for(int y = 0; y < _h; y++)
+			transform(x + y*_w, _w, 1, &_tw_w[0], &_rev_w[0], false);
+		transform(x, _h, _w, &_tw_h[0], &_rev_h[0], false);
+	}
+
+	// inverse transform, scaled by 1/(w*h)
+	void inverse(cplx *x) {
+		transform(x, _h, _w, &_tw_h[0], &_rev_h[0], true);
+		for(int y = 0; y < _h; y++)
+			transform(x + y*_w, _w, 1, &_tw_w[0], &_rev_w[0], true);
+		double s = 1.0 / (_w * _h);
+		for(int i = 0; i < _w * _h; i++)
+			x[i] *= s;
+	}
+
+	// x = a + i b of the pw x ph planes a and b, zero padded, b may be NULL
+	template<typename T>
+	void load(const T *a, const T *b, int pw, int ph, cplx *x) {
+		std::fill(x, x + _w*_h, cplx(0));
+		for(int y = 0; y < ph; y++) {
+			for(int i = 0; i < pw; i++)
+				x[y*_w + i] = cplx(a[y*pw + i], b ? b[y*pw + i] : 0);
+		}
+	}
+
+	template<typename T>
+	void load(const T *a, int pw, int ph, cplx *x) {
+		load(a, (const T*)NULL, pw, ph, x);
+	}
+
+	// spectra of a and b from z = fft(a + i b)
+	void split(const cplx *z, cplx *fa, cplx *fb) {
+		for(int v = 0; v < _h; v++) {
+			const cplx *zr = z + ((_h - v) & (_h - 1)) * _w;
+			for(int u = 0; u < _w; u++) {
+				cplx p = z[v*_w + u], q = std::conj(zr[(_w - u) & (_w - 1)]);
+				fa[v*_w + u] = 0.5 * (p + q);
+				fb[v*_w + u] = cplx(0.5 * (p.imag() - q.imag()), -0.5 * (p.real() - q.real()));
+			}
+		}
+	}
+};
+
+#endif
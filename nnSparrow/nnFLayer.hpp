@@ -36,10 +36,104 @@ class nnFLayer : public nnLayer {
 protected:
 
 	int _actv_type;
-	double* _u_dW;
-	double* _u_db;
-	double* _u_vW;
-	double* _u_vb;
+	nnreal* _u_dW;
+	nnreal* _u_db;
+	nnreal* _u_vW;
+	nnreal* _u_vb;
+
+	// rows of 16 bit weights widened for the batched products
+	nnreal* _u_Wrow;
+
+	// CSR copy of pruned weights: row pointers, columns, values
+	int* _u_sptr;
+	int* _u_scol;
+	nnreal* _u_sval;
+
+	// the batch of the previous layer, see nnLayer::getBlocks()
+	std::vector<Block> _blocks;
+
+	enum {
+		WIDEN_ROWS = 32,
+		// rows and columns of the threads start at multiples of the blocks of the gemv kernels
+		ROW_ALIGN = 16
+	};
+
+	// _u_a = bias + W * previous activations, of every sample in the batch, the rows split among the threads
+	void product() {
+		// [bc, np]*[np, n] + [bc, n]
+		int n = _unit_count, np = _prev_unit_count, bc = _batch_count;
+		for(int b = 0; b < bc; b++)
+			memcpy(_u_a + b*n, _u_b, n*sizeof(nnreal));
+
+		nnreal *pua = _prev->getActivation();
+		_prev->getBlocks(_blocks);
+		if(_u_Wh && bc > 1) {
+			// one widening buffer
+			for(int r = 0; r < n; r += WIDEN_ROWS) {
+				int rows = MIN(WIDEN_ROWS, n - r);
+				nnHalf::unpack(_u_Wh + r*np, rows*np, _weight_storage, _u_Wrow);
+				for(int k = 0; k < _blocks.size(); k++) {
+					const Block &B = _blocks[k];
+					nnKernel::gemm(false, true, bc, rows, B.n, B.a, B.ld, _u_Wrow + B.j0, np, _u_a + r, n);
+				}
+			}
+			return;
+		}
+		parallelRange(n, (long)bc * np, [&](int r0, int r1) {
+			int rows = r1 - r0;
+			if(_u_sval) {
+				static thread_local std::vector<nnreal> x;
+				for(int b = 0; b < bc; b++)
+					nnKernel::spmv(rows, _u_sptr + r0, _u_scol, _u_sval, prevSample(b, x), _u_a + b*n + r0);
+			}
+			else if(_u_Wh)
+				nnKernel::gemvHalf(rows, np, _u_Wh + r0*np, np, _weight_storage, pua, _u_a + r0);
+			else if(bc == 1)
+				nnKernel::gemv(rows, np, _u_W + r0*np, np, pua, _u_a + r0);
+			else {
+				for(int k = 0; k < _blocks.size(); k++) {
+					const Block &B = _blocks[k];
+					nnKernel::gemm(false, true, bc, rows, B.n, B.a, B.ld, _u_W + r0*np + B.j0, np, _u_a + r0, n);
+				}
+			}
+		}, ROW_ALIGN);
+	}
+
+	// sample b of the previous activations, gathered into x if the batch comes in several blocks
+	const nnreal *prevSample(int b, std::vector<nnreal> &x) {
+		if(_blocks.size() == 1)
+			return _blocks[0].a + (long)b*_blocks[0].ld;
+		x.resize(_prev_unit_count);
+		for(int k = 0; k < _blocks.size(); k++) {
+			const Block &B = _blocks[k];
+			memcpy(&x[B.j0], B.a + (long)b*B.ld, B.n*sizeof(nnreal));
+		}
+		return &x[0];
+	}
+
+	// row i of the weights, widened into _u_Wrow if they are kept in 16 bit
+	const nnreal *weightRow(int i) {
+		int np = _prev_unit_count;
+		if(!_u_Wh)
+			return _u_W + i*np;
+		nnHalf::unpack(_u_Wh + i*np, np, _weight_storage, _u_Wrow);
+		return _u_Wrow;
+	}
+
+	void clearSparse() {
+		if(_u_sptr) {
+			release(_u_sptr);
+			_u_sptr = NULL;
+		}
+		if(_u_scol) {
+			release(_u_scol);
+			_u_scol = NULL;
+		}
+		if(_u_sval) {
+			release(_u_sval);
+			_u_sval = NULL;
+		}
+	}
 
 public:
 	nnFLayer(nnLayer *prev=NULL) : nnLayer(prev, NULL) {
@@ -47,6 +141,10 @@ public:
 		_u_db = NULL;
 		_u_vW = NULL;
 		_u_vb = NULL;
+		_u_Wrow = NULL;
+		_u_sptr = NULL;
+		_u_scol = NULL;
+		_u_sval = NULL;
 		_actv_type = SIGMOID;
 		_layer_type = FULL_LAYER;
 	}
@@ -65,22 +163,37 @@ public:
 		_u_db = NULL;
 		_u_vW = NULL;
 		_u_vb = NULL;
+		_u_Wrow = NULL;
+		_u_sptr = NULL;
+		_u_scol = NULL;
+		_u_sval = NULL;
 
 		this->_actv_type = at;
 		this->_layer_type = FULL_LAYER;
 	}
 	~nnFLayer() {
-		if(_u_dW)
-			delete [] _u_dW;
-		if(_u_db)
-			delete [] _u_db;
-		if(_u_vW)
-			delete [] _u_vW;
-		if(_u_vb)
-			delete [] _u_vb;
+		clearTraining();
+		if(_u_Wrow)
+			release(_u_Wrow);
+		clearSparse();
 	}
 
 
+	int getActivationType() {
+		return _actv_type;
+	}
+
+	void appendBuffers(nnArena &arena) {
+		long n = _unit_count, nw = n * _prev_unit_count;
+		nnLayer::appendBuffers(arena);
+		arena.add(&_u_W, nw);
+		arena.add(&_u_b, n);
+		arena.add(&_u_dW, nw);
+		arena.add(&_u_db, n);
+		arena.add(&_u_vW, nw);
+		arena.add(&_u_vb, n);
+	}
+
 	void init() {
 
 		int np = _prev_unit_count;
@@ -91,87 +204,196 @@ public:
 
 		double rg = sqrt(6) / sqrt(n + np);
 
-		_u_W = new double[n*np];
+		_u_W = new nnreal[n*np];
 		for(int i=0;i<n*np;i++) {
-			_u_W[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_W[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
 
-		_u_b = new double[n];
+		_u_b = new nnreal[n];
 		for(int i=0;i<n;i++) {
-			_u_b[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_b[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
 
-		_u_a = new double[n];
-		memset(_u_a, 0, n*sizeof(double));
+		initBatch();
+		if(_trainable)
+			initTraining();
 
-		_u_delta = new double[n];
-		memset(_u_delta, 0, n*sizeof(double));
-
-		_u_dW = new double[n*np];
-		memset(_u_dW, 0, n*np*sizeof(double));
+		this->_act_f = nnActivation::getActivation(_actv_type);
+		this->_d_act_f = nnActivation::getDActivation(_actv_type);
+	}
 
-		_u_db = new double[n];
-		memset(_u_db, 0, n*sizeof(double));
 
-		_u_vW = new double[n*np];
-		memset(_u_vW, 0, n*np*sizeof(double));
+	// no weight gradient or momentum while the weights are in 16 bit
+	void initTraining() {
 
-		_u_vb = new double[n];
-		memset(_u_vb, 0, n*sizeof(double));
+		int n = _unit_count, np = _prev_unit_count;
+		clearTraining();
+		if(_u_W) {
+			_u_dW = new nnreal[n*np];
+			memset(_u_dW, 0, n*np*sizeof(nnreal));
+			_u_vW = new nnreal[n*np];
+			memset(_u_vW, 0, n*np*sizeof(nnreal));
+		}
+		_u_db = new nnreal[n];
+		memset(_u_db, 0, n*sizeof(nnreal));
+		_u_vb = new nnreal[n];
+		memset(_u_vb, 0, n*sizeof(nnreal));
+	}
+	void clearTraining() {
+		release(_u_dW);
+		release(_u_db);
+		release(_u_vW);
+		release(_u_vb);
+		_u_dW = _u_db = _u_vW = _u_vb = NULL;
+	}
 
-		this->_act_f = nnActivation::getActivation(_actv_type);
-		this->_d_act_f = nnActivation::getDActivation(_actv_type);
+	void forward() {
+		//_u_a = _prev->getActivation() * _u_W.transpose() + _u_b;
+		product();
+		_act_f(_u_a, _unit_count*_batch_count);
 	}
 
+	// the gradient and momentum buffers go with the nnreal weights and come back zeroed
+	void setWeightStorage(int type) {
 
-	void forward() {
- 		// [n, np]*[np, 1] + [n, 1]
-		//_u_a = _u_W * _prev->getActivation() + _u_b;
 		int n = _unit_count, np = _prev_unit_count;
-		memcpy(_u_a, _u_b, n*sizeof(double));
-
-		double *pua = _prev->getActivation();
-		for(int i=0;i<n;i++) {
-			double d = 0;
-			for(int j=0;j<np;j++) {
-				d += _u_W[i*np+j] * pua[j];
+		if(type == _weight_storage || !(_u_W || _u_Wh))
+			return;
+
+		if(type == nnHalf::NONE) {
+			_u_W = new nnreal[n*np];
+			nnHalf::unpack(_u_Wh, n*np, _weight_storage, _u_W);
+			release(_u_Wh);
+			_u_Wh = NULL;
+			release(_u_Wrow);
+			_u_Wrow = NULL;
+
+			if(_trainable) {
+				_u_dW = new nnreal[n*np];
+				memset(_u_dW, 0, n*np*sizeof(nnreal));
+				_u_vW = new nnreal[n*np];
+				memset(_u_vW, 0, n*np*sizeof(nnreal));
 			}
-			_u_a[i] += d;
 		}
-		_act_f(_u_a, n);
+		else if(_u_Wh) {
+			for(int i = 0; i < n*np; i++)
+				_u_Wh[i] = nnHalf::fromFloat(nnHalf::toFloat(_u_Wh[i], _weight_storage), type);
+		}
+		else {
+			_u_Wh = new uint16_t[n*np];
+			nnHalf::pack(_u_W, n*np, type, _u_Wh);
+			_u_Wrow = new nnreal[WIDEN_ROWS*np];
+			release(_u_W);
+			_u_W = NULL;
+			release(_u_dW);
+			_u_dW = NULL;
+			release(_u_vW);
+			_u_vW = NULL;
+		}
+		_weight_storage = type;
+		updateSparse();
+	}
 
+	void appendWeightMagnitudes(std::vector<nnreal> &m) {
+		if(!_u_W)
+			return;
+		for(int i = 0; i < _unit_count*_prev_unit_count; i++)
+			m.push_back(fabs(_u_W[i]));
+	}
+	void prune(double threshold) {
+		if(!_u_W)
+			return;
+		pruneWeights(_u_W, _u_vW, _unit_count*_prev_unit_count, threshold);
+		updateSparse();
 	}
-	void backpropagation() {
 
-		//accumulate dW, db
-		//_u_dW = mu*_u_dW + _u_delta * _prev->getActivation().transpose(); [n,1] * [1,np]
+	void updateSparse() {
+
 		int n = _unit_count, np = _prev_unit_count;
-		double *pua = _prev->getActivation();
+		clearSparse();
+		if(!(_u_W || _u_Wh))
+			return;
+
+		int nnz = 0;
+		for(int i = 0; i < n; i++) {
+			const nnreal *w = weightRow(i);
+			for(int j = 0; j < np; j++)
+				nnz += w[j] != 0;
+		}
+		if(nnz >= nnKernel::sparseBreakEven<nnreal>(false) * n * np)
+			return;
+
+		_u_sptr = new int[n + 1];
+		_u_scol = new int[nnz];
+		_u_sval = new nnreal[nnz];
+		int k = 0;
 		for(int i = 0; i < n; i++) {
-			double d = _u_delta[i];
+			const nnreal *w = weightRow(i);
+			_u_sptr[i] = k;
 			for(int j = 0; j < np; j++) {
-				//_u_dW[i*np+j] *= mu;
-				_u_dW[i*np+j] += d * pua[j];
+				if(w[j] != 0) {
+					_u_scol[k] = j;
+					_u_sval[k++] = w[j];
+				}
 			}
 		}
+		_u_sptr[n] = k;
+	}
+	bool isSparse() {
+		return _u_sval != NULL;
+	}
+	bool readsBlocks() {
+		return true;
+	}
+	void backpropagation() {
+
+		//accumulate dW, db
+		//_u_dW = mu*_u_dW + _u_delta.transpose() * _prev->getActivation(); [n,bc] * [bc,np]
+		int n = _unit_count, np = _prev_unit_count, bc = _batch_count;
+		nnreal *pua = _prev->getActivation();
+		_prev->getBlocks(_blocks);
+		parallelRange(n, (long)bc * np, [&](int r0, int r1) {
+			if(bc == 1)
+				nnKernel::ger(r1 - r0, np, _u_delta + r0, pua, _u_dW + r0*np, np);
+			else {
+				for(int k = 0; k < _blocks.size(); k++) {
+					const Block &B = _blocks[k];
+					nnKernel::gemm(true, false, r1 - r0, B.n, bc, _u_delta + r0, n, B.a, B.ld, _u_dW + r0*np + B.j0, np);
+				}
+			}
+		}, ROW_ALIGN);
 
 		//_u_db = mu*_u_db + _u_delta;
-		for(int i=0;i<n;i++) {
-			//_u_db[i] *= mu;
-		 	_u_db[i] += _u_delta[i];
+		for(int b = 0; b < bc; b++) {
+			nnreal *dt = _u_delta + b*n;
+			for(int i=0;i<n;i++) {
+				//_u_db[i] *= mu;
+			 	_u_db[i] += dt[i];
+			}
 		}
 
-		//t = (_u_W.transpose() * _u_delta); // [np, n] * [n, 1]
-		double *pdt = _prev->getDelta();
+		//t = (_u_delta * _u_W); // [bc, n] * [n, np], the columns split among the threads
+		nnreal *pdt = _prev->getDelta();
 		if(pdt) {
 
-			memset(pdt, 0, np*sizeof(double));
-			for(int j = 0; j < n; j++) {
-				double d = _u_delta[j];
-				for(int i = 0; i < np; i++) {
-					pdt[i] += _u_W[j*np+i] * d;
+			parallelRange(np, (long)bc * n, [&](int c0, int c1) {
+				if(bc == 1) {
+					memset(pdt + c0, 0, (c1 - c0)*sizeof(nnreal));
+					nnKernel::gemvT(n, c1 - c0, _u_W + c0, np, _u_delta, pdt + c0);
+					return;
 				}
-			}
+				// the columns of every block inside the range of the thread
+				for(int k = 0; k < _blocks.size(); k++) {
+					const Block &B = _blocks[k];
+					int lo = MAX(c0, B.j0), hi = MIN(c1, B.j0 + B.n);
+					if(lo >= hi || !B.d)
+						continue;
+					nnreal *d = B.d + (lo - B.j0);
+					for(int b = 0; b < bc; b++)
+						memset(d + (long)b*B.ld, 0, (hi - lo)*sizeof(nnreal));
+					nnKernel::gemm(false, false, bc, hi - lo, n, _u_delta, n, _u_W + lo, np, d, B.ld);
+				}
+			}, ROW_ALIGN);
 
 			_prev->updateDelta();
 		}
@@ -185,28 +407,15 @@ public:
 		double rm = 1.0 / m;
 
 		//_u_W = _u_W - alpha * ( rm * _u_dW + lambda * _u_W );
-		for(int i=0;i<n*np;i++) {
-			_u_vW[i] = _u_vW[i] * mu + alpha * (rm * _u_dW[i] + lambda * _u_W[i]);
-			_u_W[i] -= _u_vW[i];
-			//_u_W[i] -= alpha * (rm * _u_dW[i] + lambda * _u_W[i]);
-		}
+		parallelRange(n*np, 1, [&](int b, int e) {
+			momentumStep(_u_W, _u_vW, _u_dW, b, e, alpha, rm, lambda, mu);
+			// pruned weights stay at zero, the CSR copy is rebuilt by updateSparse() after training
+			applyMask(_u_W, _u_vW, b, e);
+		});
+		clearSparse();
 
 		//_u_b = _u_b - alpha * ( rm * _u_db );
-		for(int i=0;i<n;i++) {
-			//_u_b[i] -= alpha * (rm * _u_db[i]);
-			_u_vb[i] = _u_vb[i] * mu + alpha * (rm * _u_db[i]);
-			_u_b[i] -= _u_vb[i];
-			//printf("%lf ", _u_b[i] );
-		}
-
-		for(int i = 0; i < n; i++) {
-			for(int j = 0; j < np; j++) {
-				_u_dW[i*np+j] = 0;
-			}
-		}
-		for(int i=0;i<n;i++) {
-			_u_db[i] = 0;
-		}
+		momentumStep(_u_b, _u_vb, _u_db, 0, n, alpha, rm, 0, mu);
 
 	}
 	void updateDelta() {
@@ -214,18 +423,20 @@ public:
 		// mat = ( W'delta )
 		// f'(z), where a = f(z) is sigmoid funtion
 
-		_d_act_f(_u_a, _unit_count);
+		int n = _unit_count * _batch_count;
+		_d_act_f(_u_a, n);
 
-		for(int i=0;i<_unit_count;i++) {
+		for(int i=0;i<n;i++) {
 			_u_delta[i] *= _u_a[i];
 		}
 	}
 
-	bool calculateDelta(double *result, int n) {
+	// result holds the n expected outputs of every sample in the batch
+	bool calculateDelta(nnreal *result, int n) {
 		if(n != _unit_count)
 			return false;
 
-		for(int i=0;i<_unit_count;i++)
+		for(int i=0;i<_unit_count*_batch_count;i++)
 			_u_delta[i] = -(result[i] - _u_a[i]);
 
 
@@ -239,22 +450,12 @@ public:
 	void clear() {
 		nnLayer::clear();
 
-		if(_u_dW) {
-			delete [] _u_dW;
-			_u_dW = NULL;
-		}
-		if(_u_db) {
-			delete [] _u_db;
-			_u_db = NULL;
-		}
-		if(_u_vW) {
-			delete [] _u_vW;
-			_u_vW = NULL;
-		}
-		if(_u_vb) {
-			delete [] _u_vb;
-			_u_vb = NULL;
+		clearTraining();
+		if(_u_Wrow) {
+			release(_u_Wrow);
+			_u_Wrow = NULL;
 		}
+		clearSparse();
 
 	}
 	void write(std::ofstream &fout) {
@@ -264,8 +465,9 @@ public:
 		fout << _unit_count << " " << _prev_unit_count << " ";
 
 		for(int i=0;i<_unit_count;i++) {
+			const nnreal *w = weightRow(i);
 			for(int j=0;j<_prev_unit_count;j++)
-				fout << _u_W[i*_prev_unit_count+j] << " ";
+				fout << w[j] << " ";
 			fout<<std::endl;
 		}
 		for(int i=0;i<_unit_count;i++) {
@@ -287,8 +489,28 @@ public:
 		for(int i=0;i<_unit_count;i++) {
 			fin >> _u_b[i];
 		}
+		updateSparse();
+	}
+
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
+	void detachWeights() {
+		nnLayer::detachWeights();
+		_u_sptr = _u_scol = NULL;
+		_u_sval = NULL;
+	}
+	void appendGradients(std::vector<std::pair<nnreal*, long> > &g) {
+		g.push_back(std::make_pair(_u_dW, (long)_unit_count * _prev_unit_count));
+		g.push_back(std::make_pair(_u_db, (long)_unit_count));
 	}
 
+protected:
+	void detachCopy(nnLayer *src) {
+		nnLayer::detachCopy(src);
+		_u_dW = _u_db = _u_vW = _u_vb = NULL;
+		_u_Wrow = _u_Wh ? new nnreal[WIDEN_ROWS*_prev_unit_count] : NULL;
+	}
 };
 
 
@@ -26,6 +26,8 @@
 */
 
 #include "nnLayer.hpp"
+#include "nnWinograd.hpp"
+#include "nnFFT.hpp"
 
 
 #ifndef __NN_FWS_CONV_LAYER__
@@ -40,19 +42,56 @@ private:
 	int _filter_size;
 
 	int _actv_type;
+	int _engine;
 
 
-	double* _u_conv;
-	double* _u_dconv;
+	nnreal* _u_conv;
+	nnreal* _u_dconv;
 
-	double* _u_convb;
-	double* _u_dconvb;
+	nnreal* _u_convb;
+	nnreal* _u_dconvb;
 
-	double *_u_vel;
-	double *_u_velb;
+	nnreal *_u_vel;
+	nnreal *_u_velb;
 
+	//two filters widened from 16 bit weights
+	nnreal *_u_filt;
+
+	//pruned filters: taps of map mi are [_u_sptr[mi], _u_sptr[mi+1]), at fy*pw + fx of the summed maps
+	int *_u_sptr;
+	int *_u_soff;
+	nnreal *_u_sval;
+
+	//sum of the previous maps and its delta
+	nnreal *_u_sum;
+	nnreal *_u_dsum;
+
+	//im2col workspace: patch matrices of the batch and their delta
+	nnreal *_u_col;
+	nnreal *_u_dcol;
+
+	//winograd: transformed filters
+	nnWinograd _winograd;
+	int _wino_tile;
+	nnreal *_u_wino;
+
+	//fft: filter spectra and the planes of a sample
+	nnFFT _fft;
+	nnFFT::cplx *_u_fconv;
+	nnFFT::cplx *_u_fwork;
+
+	//transformed filters are up to date with the weights
+	bool _transform_ready;
 
 public:
+	enum CONV_ENGINE {
+		CONV_DIRECT = 0,
+		CONV_IM2COL,
+		CONV_WINOGRAD,
+		CONV_FFT,
+		CONV_AUTO	// direct, im2col or fft, whichever is estimated fastest for the layer (default)
+	};
+
 	nnFWSConvLayer(nnLayer *prev=NULL) : nnLayer(prev, NULL) {
 		_filter_size = 0;
 		_filter_width = 0;
@@ -63,6 +102,20 @@ public:
 		_u_dconvb = NULL;
 		_u_vel = NULL;
 		_u_velb = NULL;
+		_u_filt = NULL;
+		_u_sptr = NULL;
+		_u_soff = NULL;
+		_u_sval = NULL;
+		_u_sum = NULL;
+		_u_dsum = NULL;
+		_u_col = NULL;
+		_u_dcol = NULL;
+		_u_wino = NULL;
+		_wino_tile = 0;
+		_u_fconv = NULL;
+		_u_fwork = NULL;
+		_transform_ready = false;
+		_engine = CONV_AUTO;
 		_actv_type = SIGMOID;
 		_layer_type = FWS_CONV_LAYER;
 	}
@@ -98,34 +151,235 @@ public:
 		_u_dconvb = NULL;
 		_u_vel = NULL;
 		_u_velb = NULL;
+		_u_filt = NULL;
+		_u_sptr = NULL;
+		_u_soff = NULL;
+		_u_sval = NULL;
+		_u_sum = NULL;
+		_u_dsum = NULL;
+		_u_col = NULL;
+		_u_dcol = NULL;
+		_u_wino = NULL;
+		_wino_tile = 0;
+		_u_fconv = NULL;
+		_u_fwork = NULL;
+		_transform_ready = false;
+		_engine = CONV_AUTO;
 
 	}
 	~nnFWSConvLayer() {
 
 		if(_u_conv)
-			delete [] _u_conv;
-		if(_u_dconv)
-			delete [] _u_dconv;
+			release(_u_conv);
 		if(_u_convb)
-			delete [] _u_convb;
-		if(_u_dconvb)
-			delete [] _u_dconvb;
-		if(_u_vel)
-			delete [] _u_vel;
-		if(_u_velb)
-			delete [] _u_velb;
+			release(_u_convb);
+		clearTraining();
+		if(_u_filt)
+			release(_u_filt);
+		clearSparse();
+		if(_u_sum)
+			release(_u_sum);
+		if(_u_dsum)
+			release(_u_dsum);
+		if(_u_col)
+			release(_u_col);
+		if(_u_dcol)
+			release(_u_dcol);
+		if(_u_wino)
+			release(_u_wino);
+		if(_u_fconv)
+			release(_u_fconv);
+		if(_u_fwork)
+			release(_u_fwork);
+	}
+
+	int getEngine() {
+		return _engine;
+	}
+	// false if the engine cannot run this layer, the engine is then left unchanged
+	// CONV_AUTO is resolved once the layer knows its sizes, getEngine() then returns the choice
+	bool setEngine(int e) {
+		if(e == CONV_WINOGRAD && _filter_size && !supportsWinograd())
+			return false;
+		_engine = e;
+		if(_u_a)
+			initWorkspace();
+		return true;
+	}
+
+	// stride 1 square 3x3 and 5x5 filters
+	bool supportsWinograd() {
+		return _filter_width == _filter_height && (_filter_width == 3 || _filter_width == 5);
+	}
+	int getWinogradTile() {
+		return _winograd.getTileSize();
+	}
+	// output tile of 2x2 or 4x4, 0 picks F(4x4, 3x3) and F(2x2, 5x5)
+	void setWinogradTile(int m) {
+		_wino_tile = m;
+		if(_u_a)
+			initWorkspace();
 	}
 
-	double *getDConv() {
+	int getFilterWidth() {
+		return _filter_width;
+	}
+	int getFilterHeight() {
+		return _filter_height;
+	}
+	int getActivationType() {
+		return _actv_type;
+	}
+
+	nnreal *getDConv() {
 		return _u_dconv;
 	}
-	double *getConv() {
+	nnreal *getConv() {
 		return _u_conv;
 	}
-	double *getConvb() {
+	nnreal *getConvb() {
 		return _u_convb;
 	}
 
+	// filter of map mi, widened into _u_filt if the weights are kept in 16 bit;
+	// maps of different parity use different halves of _u_filt
+	const nnreal *filter(int mi) {
+		return filter(mi, _u_filt + (mi & 1)*_filter_size);
+	}
+	// filter of map mi, widened into f if the weights are kept in 16 bit
+	const nnreal *filter(int mi, nnreal *f) {
+		int nf = _filter_size;
+		if(!_u_Wh)
+			return _u_conv + mi*nf;
+		nnHalf::unpack(_u_Wh + mi*nf, nf, _weight_storage, f);
+		return f;
+	}
+	// a filter for the maps of one thread, see parallelRange()
+	nnreal *threadFilter() {
+		static thread_local std::vector<nnreal> f;
+		f.resize(_filter_size);
+		return &f[0];
+	}
+
+	// the gradient and momentum buffers go with the nnreal weights and come back zeroed
+	void setWeightStorage(int type) {
+
+		int nf = _filter_size, nm = _map_num;
+		if(type == _weight_storage || !(_u_conv || _u_Wh))
+			return;
+
+		if(type == nnHalf::NONE) {
+			_u_conv = new nnreal[nf*nm];
+			nnHalf::unpack(_u_Wh, nf*nm, _weight_storage, _u_conv);
+			release(_u_Wh);
+			_u_Wh = NULL;
+			release(_u_filt);
+			_u_filt = NULL;
+
+			if(_trainable) {
+				_u_dconv = new nnreal[nf*nm];
+				memset(_u_dconv, 0, nf*nm*sizeof(nnreal));
+				_u_vel = new nnreal[nf*nm];
+				memset(_u_vel, 0, nf*nm*sizeof(nnreal));
+			}
+		}
+		else if(_u_Wh) {
+			for(int i = 0; i < nf*nm; i++)
+				_u_Wh[i] = nnHalf::fromFloat(nnHalf::toFloat(_u_Wh[i], _weight_storage), type);
+		}
+		else {
+			_u_Wh = new uint16_t[nf*nm];
+			nnHalf::pack(_u_conv, nf*nm, type, _u_Wh);
+			_u_filt = new nnreal[2*nf];
+			release(_u_conv);
+			_u_conv = NULL;
+			release(_u_dconv);
+			_u_dconv = NULL;
+			release(_u_vel);
+			_u_vel = NULL;
+		}
+		_weight_storage = type;
+		transformFilters();
+		updateSparse();
+	}
+
+	void clearSparse() {
+		if(_u_sptr) {
+			release(_u_sptr);
+			_u_sptr = NULL;
+		}
+		if(_u_soff) {
+			release(_u_soff);
+			_u_soff = NULL;
+		}
+		if(_u_sval) {
+			release(_u_sval);
+			_u_sval = NULL;
+		}
+	}
+
+	void appendWeightMagnitudes(std::vector<nnreal> &m) {
+		if(!_u_conv)
+			return;
+		for(int i = 0; i < _filter_size*_map_num; i++)
+			m.push_back(fabs(_u_conv[i]));
+	}
+	void prune(double threshold) {
+		if(!_u_conv)
+			return;
+		pruneWeights(_u_conv, _u_vel, _filter_size*_map_num, threshold);
+		_transform_ready = false;
+		updateSparse();
+	}
+
+	void updateSparse() {
+
+		int nf = _filter_size, nm = _map_num;
+		int pw = _width + _filter_width - 1;
+		clearSparse();
+		if(!(_u_conv || _u_Wh))
+			return;
+
+		int nnz = 0;
+		for(int mi = 0; mi < nm; mi++) {
+			const nnreal *f = filter(mi);
+			for(int i = 0; i < nf; i++)
+				nnz += f[i] != 0;
+		}
+		if(nnz >= nnKernel::sparseBreakEven<nnreal>(true) * nf * nm)
+			return;
+
+		_u_sptr = new int[nm + 1];
+		_u_soff = new int[nnz];
+		_u_sval = new nnreal[nnz];
+		int k = 0;
+		for(int mi = 0; mi < nm; mi++) {
+			const nnreal *f = filter(mi);
+			_u_sptr[mi] = k;
+			for(int i = 0; i < nf; i++) {
+				if(f[i] != 0) {
+					_u_soff[k] = i / _filter_width * pw + i % _filter_width;
+					_u_sval[k++] = f[i];
+				}
+			}
+		}
+		_u_sptr[nm] = k;
+	}
+	bool isSparse() {
+		return _u_sval != NULL;
+	}
+
+	void appendBuffers(nnArena &arena) {
+		long nm = _map_num, nw = (long)_filter_size * nm;
+		nnLayer::appendBuffers(arena);
+		arena.add(&_u_conv, nw);
+		arena.add(&_u_dconv, nw);
+		arena.add(&_u_vel, nw);
+		arena.add(&_u_convb, nm);
+		arena.add(&_u_dconvb, nm);
+		arena.add(&_u_velb, nm);
+	}
+
 	void init() {
 
 		clear();
@@ -133,165 +387,643 @@ public:
 
 		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
 
-		_u_a = new double[n*nm];
-		memset(_u_a, 0, n*nm*sizeof(double));
-
-		_u_delta = new double[n*nm];
-		memset(_u_delta, 0, n*nm*sizeof(double));
+		initBatch();
 
 
 		//conv
-		_u_conv = new double[nf*nm];
+		_u_conv = new nnreal[nf*nm];
 		for(int i=0;i<nf*nm;i++) {
-			_u_conv[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_conv[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
-		_u_dconv = new double[nf*nm];
-		memset(_u_dconv, 0, nf*nm*sizeof(double));
-
-		_u_vel = new double[nf*nm];
-		memset(_u_vel, 0, nf*nm*sizeof(double));
 
 		//bias
-		_u_convb = new double[nm];
+		_u_convb = new nnreal[nm];
 		for(int i=0;i<nm;i++) {
-			_u_convb[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_convb[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
-		_u_dconvb = new double[nm];
-		memset(_u_dconvb, 0, nm*sizeof(double));
 
-		_u_velb = new double[nm];
-		memset(_u_velb, 0, nm*sizeof(double));
+		if(_trainable)
+			initTraining();
 
 		this->_act_f = nnActivation::getActivation(_actv_type);
 		this->_d_act_f = nnActivation::getDActivation(_actv_type);
 
 	}
 
+	void initBatch() {
+		nnLayer::initBatch();
+		initWorkspace();
+	}
+
+	// no filter gradient or momentum while the filters are in 16 bit
+	void initTraining() {
+
+		int nf = _filter_size, nm = _map_num;
+		clearTraining();
+		if(_u_conv) {
+			_u_dconv = new nnreal[nf*nm];
+			memset(_u_dconv, 0, nf*nm*sizeof(nnreal));
+			_u_vel = new nnreal[nf*nm];
+			memset(_u_vel, 0, nf*nm*sizeof(nnreal));
+		}
+		_u_dconvb = new nnreal[nm];
+		memset(_u_dconvb, 0, nm*sizeof(nnreal));
+		_u_velb = new nnreal[nm];
+		memset(_u_velb, 0, nm*sizeof(nnreal));
+	}
+	void clearTraining() {
+		release(_u_dconv);
+		release(_u_dconvb);
+		release(_u_vel);
+		release(_u_velb);
+		_u_dconv = _u_dconvb = _u_vel = _u_velb = NULL;
+	}
+
+	void initWorkspace() {
+
+		int n = _unit_count, np = _prev_unit_count, nf = _filter_size;
+
+		clearWorkspace();
+
+		_u_sum = new nnreal[np];
+		if(_trainable)
+			_u_dsum = new nnreal[np];
+		if(_engine == CONV_WINOGRAD && !supportsWinograd())
+			_engine = CONV_DIRECT;
+		if(_engine == CONV_AUTO)
+			_engine = chooseEngine();
+		if(_engine == CONV_IM2COL) {
+			_u_col = new nnreal[nf*n*_batch_size];
+			if(_trainable)
+				_u_dcol = new nnreal[nf*n];
+		}
+		if(_engine == CONV_WINOGRAD) {
+			int m = _wino_tile ? _wino_tile : (_filter_width == 3 ? 4 : 2);
+			_winograd.setup(m, _filter_width);
+			int a = _winograd.getInputTileSize();
+			_u_wino = new nnreal[a*a*_map_num];
+		}
+		if(_engine == CONV_FFT) {
+			// a circular correlation on the plane rounded up to powers of two does not wrap
+			// inside the output, nor does the full convolution of the delta inside the plane
+			_fft.setup(nnFFT::roundUp(_width + _filter_width - 1), nnFFT::roundUp(_height + _filter_height - 1));
+			int sz = _fft.getSize();
+			_u_fconv = new nnFFT::cplx[sz*_map_num];
+			_u_fwork = new nnFFT::cplx[sz*5];
+		}
+		_transform_ready = false;
+		if(_u_conv || _u_Wh)
+			transformFilters();
+	}
+
+	// time of one sample forward and backward, in ns at the rates of the benchmark: the direct loops at
+	// 4.2 GMAC/s on long rows and less on short ones, the im2col gemm at 11 GMAC/s plus 4 ns for every
+	// patch element gathered and folded back, the fft at 13 flops per ns
+	int chooseEngine() {
+
+		int nf = _filter_size, n = _unit_count, nm = _map_num, w = _width;
+		double macs = 3.0 * n * nf * nm;
+		double direct = macs / (4.2 * w / (w + 6.0));
+		double im2col = macs / 11 + 4.0 * n * nf;
+		double pw = nnFFT::roundUp(_width + _filter_width - 1);
+		double ph = nnFFT::roundUp(_height + _filter_height - 1);
+		double fft = 3 * (5 * pw * ph * log2(pw * ph) * (2 + 1.5 * nm) + 8 * pw * ph * nm * 2) / 13;
+		if(fft < direct && fft < im2col)
+			return CONV_FFT;
+		return (im2col < direct) ? CONV_IM2COL : CONV_DIRECT;
+	}
+
+	void clearWorkspace() {
+
+		if(_u_sum) {
+			release(_u_sum);
+			_u_sum = NULL;
+		}
+		if(_u_dsum) {
+			release(_u_dsum);
+			_u_dsum = NULL;
+		}
+		if(_u_col) {
+			release(_u_col);
+			_u_col = NULL;
+		}
+		if(_u_dcol) {
+			release(_u_dcol);
+			_u_dcol = NULL;
+		}
+		if(_u_wino) {
+			release(_u_wino);
+			_u_wino = NULL;
+		}
+		if(_u_fconv) {
+			release(_u_fconv);
+			_u_fconv = NULL;
+		}
+		if(_u_fwork) {
+			release(_u_fwork);
+			_u_fwork = NULL;
+		}
+		_transform_ready = false;
+	}
+
+	// winograd filter transforms or filter spectra of the engine
+	void transformFilters() {
+
+		int nm = _map_num;
+		if(_engine == CONV_WINOGRAD) {
+			int a = _winograd.getInputTileSize();
+			for(int mi = 0; mi < nm; mi++)
+				_winograd.transformFilter(filter(mi), _u_wino + mi*a*a);
+		}
+		if(_engine == CONV_FFT) {
+			int sz = _fft.getSize();
+			for(int mi = 0; mi < nm; mi += 2) {
+				_fft.load(filter(mi), mi + 1 < nm ? filter(mi + 1) : NULL,
+					_filter_width, _filter_height, _u_fwork);
+				_fft.forward(_u_fwork);
+				_fft.split(_u_fwork, _u_fconv + mi*sz, mi + 1 < nm ? _u_fconv + (mi + 1)*sz : _u_fwork + sz);
+			}
+		}
+		_transform_ready = true;
+	}
+
+	// the filter of a map is shared by all previous maps, so they can be summed up first
+	const nnreal *sumMaps(const nnreal *pua) {
+		return nnKernel::sumRows(_prev->getMapNum(), _prev_unit_count, pua, _u_sum);
+	}
+
 	void forward() {
 
-		//_u_a = _u_W * _prev->getActivation() + _u_convb;// [n, np]*[np, 1]
-		int n = _unit_count, np = _prev_unit_count, nm = _map_num, nf = _filter_size;
+		if(_u_sval) {
+			forwardSparse();
+			return;
+		}
+		switch(_engine) {
+			case CONV_IM2COL:
+				forwardIm2col();
+				break;
+			case CONV_WINOGRAD:
+				forwardWinograd();
+				break;
+			case CONV_FFT:
+				forwardFFT();
+				break;
+			default:
+				forwardDirect();
+				break;
+		}
+	}
+
+	// largest difference between the output of the engine and of the direct loops on the current input
+	double checkEngine() {
+
+		int na = getTotalUnitCount() * _batch_count;
+		nnreal *a = new nnreal[na];
+
+		forward();
+		memcpy(a, _u_a, na*sizeof(nnreal));
+		forwardDirect();
+
+		double err = 0;
+		for(int i = 0; i < na; i++) {
+			if(fabs(a[i] - _u_a[i]) > err)
+				err = fabs(a[i] - _u_a[i]);
+		}
+
+		memcpy(_u_a, a, na*sizeof(nnreal));
+		delete [] a;
+		return err;
+	}
+
+	// F(m x m, r x r) tiles on the sum of the previous maps
+	void forwardWinograd() {
+
+		int n = _unit_count, np = _prev_unit_count, nm = _map_num;
 		int nmp =  _prev->getMapNum();
-		int pw = _prev->getWidth();
-		int fw = _filter_width;
-		int fh = _filter_height;
 
-		double *ua = _u_a;
-		double *pua = _prev->getActivation();
-		double *cv = _u_conv;
-		for(int mi = 0; mi < nm; mi++, ua += n, cv += nf) {
+		if(!_transform_ready)
+			transformFilters();
+
+		int a = _winograd.getInputTileSize();
+		nnreal *ua = _u_a;
+		nnreal *pua = _prev->getActivation();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp, ua += n * nm) {
+			_winograd.transformInput(sumMaps(pua), _prev->getWidth(), _prev->getHeight(), _width, _height);
+			parallelRange(nm, (long)n * a * a, [&](int m0, int m1) {
+				static thread_local std::vector<nnreal> work;
+				work.resize(_winograd.getWorkspaceSize());
+				_winograd.forwardMaps(_width, _height, m1 - m0, _u_wino + m0*a*a, _u_convb + m0, ua + m0*n, &work[0]);
+				_act_f(ua + m0*n, n*(m1 - m0));
+			});
+		}
+	}
 
-			for(int i = 0; i < n; i++)
-				*(ua + i) = _u_convb[mi];
+	// correlation as S .* conj(G) on the padded plane, two maps per inverse transform
+	void forwardFFT() {
 
-			for(int sh = 0; sh < np * nmp; sh += np) {
-				int step = 0, h = 0;
-				for(int i = 0; i < n; i++, h++, step++ ) {
-					if(h >= _width) {
-						step = (step / pw + 1) * pw;
-						h = 0;
+		int n = _unit_count, np = _prev_unit_count, nm = _map_num;
+		int nmp =  _prev->getMapNum();
+		int w = _width, h = _height;
+		int sz = _fft.getSize(), fw = _fft.getWidth();
+
+		if(!_transform_ready)
+			transformFilters();
+
+		nnFFT::cplx *S = _u_fwork;
+		// an inverse transform per pair of maps
+		long cost = (long)(5 * sz * log2(sz));
+
+		nnreal *ua = _u_a;
+		nnreal *pua = _prev->getActivation();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp, ua += n * nm) {
+
+			_fft.load(sumMaps(pua), _prev->getWidth(), _prev->getHeight(), S);
+			_fft.forward(S);
+
+			parallelRange((nm + 1) / 2, cost, [&](int p0, int p1) {
+				static thread_local std::vector<nnFFT::cplx> work;
+				work.resize(sz);
+				nnFFT::cplx *Z = &work[0];
+
+				for(int mi = 2*p0; mi < MIN(nm, 2*p1); mi += 2) {
+					bool pair = mi + 1 < nm;
+					const nnFFT::cplx *G1 = _u_fconv + mi*sz, *G2 = _u_fconv + (mi + 1)*sz;
+					for(int i = 0; i < sz; i++) {
+						// Z = S conj(G1) + i S conj(G2)
+						double sr = S[i].real(), si = S[i].imag();
+						double zr = sr*G1[i].real() + si*G1[i].imag();
+						double zi = si*G1[i].real() - sr*G1[i].imag();
+						if(pair) {
+							zr -= si*G2[i].real() - sr*G2[i].imag();
+							zi += sr*G2[i].real() + si*G2[i].imag();
+						}
+						Z[i] = nnFFT::cplx(zr, zi);
 					}
-					double d = 0;
-					for(int j1 = 0, j2 = 0; j2 < nf; j1 += pw, j2 += fw ) {
-						for(int k = 0; k < fw; k++ ) {
-							d += (*(cv + j2 + k)) * (*(pua + sh + (step + j1) + k));
+					_fft.inverse(Z);
+
+					for(int y = 0; y < h; y++) {
+						for(int x = 0; x < w; x++) {
+							ua[mi*n + y*w + x] = _u_convb[mi] + Z[y*fw + x].real();
+							if(pair)
+								ua[(mi + 1)*n + y*w + x] = _u_convb[mi + 1] + Z[y*fw + x].imag();
 						}
 					}
-					*(ua + i) += d;
+					_act_f(ua + mi*n, pair ? 2*n : n);
 				}
+			});
+		}
+	}
 
-			}
+	// [nm, nf] * [nf, n] gemm on the patch matrix of each sample
+	void forwardIm2col() {
+
+		int n = _unit_count, np = _prev_unit_count, nm = _map_num, nf = _filter_size;
+		int nmp =  _prev->getMapNum();
+		int pw = _prev->getWidth();
+
+		nnreal *ua = _u_a;
+		nnreal *pua = _prev->getActivation();
+		nnreal *col = _u_col;
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp, ua += n * nm, col += nf * n) {
 
-			_act_f(ua, n);
+			nnKernel::im2col(sumMaps(pua), pw, _width, _height, _filter_width, _filter_height, col);
+
+			parallelRange(nm, (long)n * nf, [&](int m0, int m1) {
+				for(int mi = m0; mi < m1; mi++) {
+					for(int i = 0; i < n; i++)
+						ua[mi*n + i] = _u_convb[mi];
+				}
+				if(_u_Wh) {
+					nnreal *f = threadFilter();
+					for(int mi = m0; mi < m1; mi++)
+						nnKernel::gemm(false, false, 1, n, nf, filter(mi, f), nf, col, n, ua + mi*n, n);
+				}
+				else
+					nnKernel::gemm(false, false, m1 - m0, n, nf, _u_conv + m0*nf, nf, col, n, ua + m0*n, n);
+
+				_act_f(ua + m0*n, n*(m1 - m0));
+			});
 		}
 	}
-	void backpropagation() {
 
-		//accumulate dW
-		//dW = _u_delta * _prev->getActivation().transpose();
-		//[n, 1] *[1, np]
-		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
-		//int cc = nm / _prev->getMapNum();
-		int nmp = _prev->getMapNum();
+	// the direct loops on the taps left by pruning, whatever the engine. A trainable im2col layer
+	// still gathers the patches its backpropagation reads.
+	void forwardSparse() {
+
+		int n = _unit_count, np = _prev_unit_count, nm = _map_num, nf = _filter_size;
+		int nmp =  _prev->getMapNum();
+		int pw = _prev->getWidth();
+
+		nnreal *pua = _prev->getActivation();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp) {
+
+			const nnreal *s = sumMaps(pua);
+			if(_engine == CONV_IM2COL && _trainable)
+				nnKernel::im2col(s, pw, _width, _height, _filter_width, _filter_height, _u_col + b*nf*n);
+			nnreal *uab = _u_a + b*n*nm;
+			parallelRange(nm, (long)n * (_u_sptr[nm] / nm + 1), [&](int m0, int m1) {
+				for(int mi = m0; mi < m1; mi++) {
+
+					nnreal *ua = uab + mi*n;
+					int k = _u_sptr[mi], nt = _u_sptr[mi+1] - k;
+					for(int i = 0; i < n; i++)
+						ua[i] = _u_convb[mi];
+					for(int y = 0; y < _height; y++)
+						nnKernel::correlateRowSparse(_width, s + y*pw, nt, _u_soff + k, _u_sval + k, ua + y*_width);
+
+					_act_f(ua, n);
+				}
+			});
+		}
+	}
+
+	// direct correlation of the summed previous maps, row by row
+	void forwardDirect() {
+
+		//_u_a = _u_W * _prev->getActivation() + _u_convb;// [n, np]*[np, 1]
+		int n = _unit_count, np = _prev_unit_count, nm = _map_num, nf = _filter_size;
+		int nmp =  _prev->getMapNum();
 		int pw = _prev->getWidth();
 		int fw = _filter_width;
 		int fh = _filter_height;
 
-		//cblas_dscal(nm*nf, mu, _u_dconv, 1);
-		// for(int i = 0; i < nm*nf; i++) {
-		// 	_u_dconv[i] *= mu;
-		// }
+		nnreal *pua = _prev->getActivation();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp) {
 
-		double *dc = _u_dconv;
+			const nnreal *s = sumMaps(pua);
+			nnreal *uab = _u_a + b*n*nm;
+			parallelRange(nm, (long)n * nf, [&](int m0, int m1) {
+				nnreal *f = _u_Wh ? threadFilter() : NULL;
+				for(int mi = m0; mi < m1; mi++) {
 
-		double *pua = _prev->getActivation();
-		double *dt = _u_delta;
+					nnreal *ua = uab + mi*n;
+					const nnreal *cv = filter(mi, f);
+					for(int i = 0; i < n; i++)
+						*(ua + i) = _u_convb[mi];
 
-		//feature map loop
-		for(int mi = 0; mi < nm; mi++, dt += n, dc += nf) {
+					for(int y = 0; y < _height; y++)
+						nnKernel::correlateRow(_width, s + y*pw, pw, 1, cv, fw, fh, ua + y*_width);
 
-			for(int sh = 0; sh < np * nmp; sh += np) {
-				int step = 0, h = 0;
-				for(int i = 0; i < n; i++, h++, step++ ) {
-					if(h >= _width) {
-						step = (step / pw + 1) * pw;
-						h = 0;
-					}
-					double d = *(dt + i);
-					for(int j1 = 0, j2 = 0; j2 < nf; j1 += pw, j2 += fw ) {
-						for(int k = 0; k < fw; k++ ) {
-							*(dc + j2 + k) += d * (*(pua + sh + (step + j1) + k));
-						}
-					}
+					_act_f(ua, n);
 				}
-			}
+			});
 		}
+	}
+	void backpropagation() {
+
+		backpropagationEngine();
 
 		//_u_dconvb = mu*_u_dconvb + _u_delta;
-		dt = _u_delta;
-		for(int mi = 0; mi < nm; mi++, dt += n) {
-			double sum = 0;
-			for(int i=0;i<n;i++) {
-				sum += dt[i];
+		int n = _unit_count, nm = _map_num;
+		nnreal *dt = _u_delta;
+		for(int b = 0; b < _batch_count; b++) {
+			for(int mi = 0; mi < nm; mi++, dt += n) {
+				nnreal sum = 0;
+				for(int i=0;i<n;i++) {
+					sum += dt[i];
+				}
+				// _u_dconvb[mi] *= mu;
+				_u_dconvb[mi] += sum;
 			}
-			// _u_dconvb[mi] *= mu;
-			_u_dconvb[mi] += sum;
-		}
-
-		//t = (_u_W.transpose() * _u_delta); // [np, n] * [n, 1]
-		//_prev->updateDelta();
-		double *pdt = _prev->getDelta();
-		if(pdt) {
-
-			memset(pdt, 0, sizeof(double)*_prev->getTotalUnitCount());
-			dt = _u_delta;
-			double *cv = _u_conv;
-			for(int mi = 0; mi < nm; mi++, dt += n, cv += nf) {
-
-				//int sh = np * (mi / cc);
-				for(int sh = 0; sh < np * nmp; sh += np) {
-					int step = 0, h = 0;
-					for(int i = 0; i < n; i++, h++, step++ ) {
-						if(h >= _width) {
-							step = (step / pw + 1) * pw;
-							h = 0;
+		}
+
+		if(_prev->getDelta())
+			_prev->updateDelta();
+	}
+
+	// dW and the delta of the previous maps, the bias gradient and updateDelta() are left to the caller
+	void backpropagationEngine() {
+
+		switch(_engine) {
+			case CONV_IM2COL:
+				backpropagationIm2col();
+				break;
+			case CONV_FFT:
+				backpropagationFFT();
+				break;
+			default:
+				backpropagationDirect();
+				break;
+		}
+	}
+
+	// largest difference in dW and in the delta of the previous maps between the engine and the direct
+	// loops, both from the current delta of a trainable layer. The bias gradient does not depend on the
+	// engine. Runs forward() first for the patches of im2col, dW is left as it was.
+	double checkEngineBackward() {
+
+		if(!_u_dconv)
+			return 0;
+
+		int nw = _filter_size * _map_num;
+		int npd = _prev_unit_count * _prev->getMapNum() * _batch_count;
+		nnreal *pdt = _prev->getDelta();
+		nnreal *dw = new nnreal[2*nw];
+		nnreal *pd = pdt ? new nnreal[npd] : NULL;
+
+		forward();
+		memcpy(dw + nw, _u_dconv, nw*sizeof(nnreal));
+		memset(_u_dconv, 0, nw*sizeof(nnreal));
+		backpropagationEngine();
+		memcpy(dw, _u_dconv, nw*sizeof(nnreal));
+		if(pdt)
+			memcpy(pd, pdt, npd*sizeof(nnreal));
+		memset(_u_dconv, 0, nw*sizeof(nnreal));
+		backpropagationDirect();
+
+		double err = 0;
+		for(int i = 0; i < nw; i++) {
+			if(fabs(dw[i] - _u_dconv[i]) > err)
+				err = fabs(dw[i] - _u_dconv[i]);
+		}
+		for(int i = 0; pdt && i < npd; i++) {
+			if(fabs(pd[i] - pdt[i]) > err)
+				err = fabs(pd[i] - pdt[i]);
+		}
+
+		memcpy(_u_dconv, dw + nw, nw*sizeof(nnreal));
+		delete [] dw;
+		delete [] pd;
+		return err;
+	}
+
+	// every previous map receives the same delta, the delta of their sum
+	void copyPrevDelta(nnreal *pdt) {
+
+		int np = _prev_unit_count, nmp = _prev->getMapNum();
+		for(int sh = 0; sh < np * nmp; sh += np)
+			memcpy(pdt + sh, _u_dsum, np*sizeof(nnreal));
+	}
+
+	// dW = delta * patches', delta of the patches = W' * delta, folded back by col2im
+	void backpropagationIm2col() {
+
+		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
+		int nmp = _prev->getMapNum();
+		int pw = _prev->getWidth();
+
+		nnreal *pdt = _prev->getDelta();
+		nnreal *dt = _u_delta;
+		nnreal *col = _u_col;
+		for(int b = 0; b < _batch_count; b++, dt += n * nm, col += nf * n) {
+
+			// the maps of dW, then the columns of the patch delta, split among the threads
+			parallelRange(nm, (long)n * nf, [&](int m0, int m1) {
+				nnKernel::gemm(false, true, m1 - m0, nf, n, dt + m0*n, n, col, n, _u_dconv + m0*nf, nf);
+			});
+
+			if(pdt) {
+				parallelRange(n, (long)nf * nm, [&](int c0, int c1) {
+					for(int k = 0; k < nf; k++)
+						memset(_u_dcol + k*n + c0, 0, (c1 - c0)*sizeof(nnreal));
+					nnKernel::gemm(true, false, nf, c1 - c0, nm, _u_conv, nf, dt + c0, n, _u_dcol + c0, n);
+				});
+
+				memset(_u_dsum, 0, np*sizeof(nnreal));
+				nnKernel::col2im(_u_dcol, pw, _width, _height, _filter_width, _filter_height, _u_dsum);
+				copyPrevDelta(pdt + b * np * nmp);
+			}
+		}
+	}
+
+	// dW and the delta of the summed previous maps by row-wise dot products and axpys
+	void backpropagationDirect() {
+
+		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
+		int nmp = _prev->getMapNum();
+		int pw = _prev->getWidth();
+		int ph = _prev->getHeight();
+		int fw = _filter_width;
+		int fh = _filter_height;
+		int w = _width, h = _height;
+
+		nnreal *pua = _prev->getActivation();
+		nnreal *pdt = _prev->getDelta();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp) {
+
+			const nnreal *s = sumMaps(pua);
+			nnreal *dtb = _u_delta + b*n*nm;
+
+			// the filters of dW split among the threads by maps
+			parallelRange(nm, (long)n * nf, [&](int m0, int m1) {
+				for(int mi = m0; mi < m1; mi++) {
+					const nnreal *dt = dtb + mi*n;
+					nnreal *dc = _u_dconv + mi*nf;
+					for(int fy = 0; fy < fh; fy++) {
+						for(int fx = 0; fx < fw; fx++) {
+							nnreal d = 0;
+							const nnreal *ps = s + fy*pw + fx;
+							for(int y = 0; y < h; y++) {
+								d += nnKernel::dot(w, dt + y*w, ps + y*pw, 1);
+							}
+							dc[fy*fw + fx] += d;
 						}
-						double d = *(dt + i);
-						for(int j1 = 0, j2 = 0; j2 < nf; j1 += pw, j2 += fw ) {
-							for(int k = 0; k < fw; k++ ) {
-								*(pdt + sh + (step + j1) + k) += *(cv + j2 + k) * d;
+					}
+				}
+			});
+
+			// the delta of the sum by rows, every row adding up the maps in order
+			if(pdt) {
+				parallelRange(ph, (long)w * nf * nm, [&](int r0, int r1) {
+					memset(_u_dsum + r0*pw, 0, (r1 - r0)*pw*sizeof(nnreal));
+					for(int mi = 0; mi < nm; mi++) {
+						const nnreal *dt = dtb + mi*n;
+						const nnreal *cv = _u_conv + mi*nf;
+						for(int fy = 0; fy < fh; fy++) {
+							for(int fx = 0; fx < fw; fx++) {
+								nnreal c = cv[fy*fw + fx];
+								nnreal *pds = _u_dsum + fy*pw + fx;
+								for(int y = MAX(0, r0 - fy); y < MIN(h, r1 - fy); y++) {
+									nnKernel::axpy(w, c, dt + y*w, 1, pds + y*pw);
+								}
 							}
 						}
 					}
+				});
+				copyPrevDelta(pdt + b * np * nmp);
+			}
+		}
+	}
+
+	// dW = correlation of S with the delta, S .* conj(D), delta of the sum = full convolution, D .* G
+	void backpropagationFFT() {
+
+		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
+		int nmp = _prev->getMapNum();
+		int pw = _prev->getWidth(), ph = _prev->getHeight();
+		int w = _width, h = _height;
+		int sz = _fft.getSize(), fw = _fft.getWidth();
+
+		if(!_transform_ready)
+			transformFilters();
+
+		nnFFT::cplx *S = _u_fwork, *Z = _u_fwork + sz, *D1 = _u_fwork + 2*sz, *D2 = _u_fwork + 3*sz;
+		nnFFT::cplx *DS = _u_fwork + 4*sz;
+
+		nnreal *pua = _prev->getActivation();
+		nnreal *pdt = _prev->getDelta();
+		nnreal *dt = _u_delta;
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp, dt += n * nm) {
+
+			_fft.load(sumMaps(pua), pw, ph, S);
+			_fft.forward(S);
+			if(pdt)
+				std::fill(DS, DS + sz, nnFFT::cplx(0));
+
+			for(int mi = 0; mi < nm; mi += 2) {
+				bool pair = mi + 1 < nm;
+				const nnFFT::cplx *G1 = _u_fconv + mi*sz, *G2 = _u_fconv + (mi + 1)*sz;
+
+				_fft.load(dt + mi*n, pair ? dt + (mi + 1)*n : NULL, w, h, Z);
+				_fft.forward(Z);
+				_fft.split(Z, D1, D2);
+
+				for(int i = 0; i < sz; i++) {
+					// Z = S conj(D1) + i S conj(D2)
+					double sr = S[i].real(), si = S[i].imag();
+					double zr = sr*D1[i].real() + si*D1[i].imag();
+					double zi = si*D1[i].real() - sr*D1[i].imag();
+					zr -= si*D2[i].real() - sr*D2[i].imag();
+					zi += sr*D2[i].real() + si*D2[i].imag();
+					Z[i] = nnFFT::cplx(zr, zi);
+				}
+				if(pdt) {
+					for(int i = 0; i < sz; i++) {
+						double r = D1[i].real()*G1[i].real() - D1[i].imag()*G1[i].imag();
+						double c = D1[i].real()*G1[i].imag() + D1[i].imag()*G1[i].real();
+						if(pair) {
+							r += D2[i].real()*G2[i].real() - D2[i].imag()*G2[i].imag();
+							c += D2[i].real()*G2[i].imag() + D2[i].imag()*G2[i].real();
+						}
+						DS[i] += nnFFT::cplx(r, c);
+					}
+				}
+				_fft.inverse(Z);
+
+				nnreal *dc = _u_dconv + mi*nf;
+				for(int fy = 0; fy < _filter_height; fy++) {
+					for(int fx = 0; fx < _filter_width; fx++) {
+						dc[fy*_filter_width + fx] += Z[fy*fw + fx].real();
+						if(pair)
+							dc[nf + fy*_filter_width + fx] += Z[fy*fw + fx].imag();
+					}
 				}
 			}
-			_prev->updateDelta();
+
+			if(pdt) {
+				_fft.inverse(DS);
+				for(int y = 0; y < ph; y++) {
+					for(int x = 0; x < pw; x++)
+						_u_dsum[y*pw + x] = DS[y*fw + x].real();
+				}
+				copyPrevDelta(pdt + b * np * nmp);
+			}
 		}
 	}
 
 	void updateDelta() {
 
-		int n = _unit_count, nm = _map_num;
+		int n = _unit_count, nm = _map_num * _batch_count;
 		// mat = ( W'delta )
 		// f'(z), where a = f(z) is sigmoid funtion
 		_d_act_f(_u_a, n*nm);
@@ -309,24 +1041,17 @@ public:
 		//cblas_dscal(nf*nm, 1-alpha*lambda, _u_conv, 1);
 		//cblas_daxpy(nf*nm, -alpha*rm, _u_dconv, 1, _u_conv, 1);
 
-		for(int i = 0; i < nf*nm; i++) {
-			_u_vel[i] = _u_vel[i]*mu + alpha * ( rm * _u_dconv[i] + lambda * _u_conv[i] );
-			_u_conv[i] -= _u_vel[i];
-		}
+		parallelRange(nf*nm, 1, [&](int b, int e) {
+			momentumStep(_u_conv, _u_vel, _u_dconv, b, e, alpha, rm, lambda, mu);
+			// pruned weights stay at zero, the taps are gathered again by updateSparse() after training
+			applyMask(_u_conv, _u_vel, b, e);
+		});
+		clearSparse();
 
 		//_u_convb = _u_convb - alpha * (rm * _u_dconvb );
 		//cblas_daxpy(nm, -alpha*rm, _u_dconvb, 1, _u_convb, 1);
-		for(int i = 0; i < nm; i++) {
-			_u_velb[i] = _u_velb[i]*mu + alpha * ( rm * _u_dconvb[i] );
-			_u_convb[i] -= _u_velb[i];
-		}
-
-		for(int i = 0; i < nm*nf; i++) {
-			_u_dconv[i] = 0;
-		}
-		for(int i = 0; i < nm; i++) {
-			_u_dconvb[i] = 0;
-		}
+		momentumStep(_u_convb, _u_velb, _u_dconvb, 0, nm, alpha, rm, 0, mu);
+		_transform_ready = false;
 	}
 
 
@@ -338,29 +1063,20 @@ public:
 	void clear() {
 		nnLayer::clear();
 		if(_u_conv) {
-			delete [] _u_conv;
+			release(_u_conv);
 			_u_conv = NULL;
 		}
 		if(_u_convb) {
-			delete [] _u_convb;
+			release(_u_convb);
 			_u_convb = NULL;
 		}
-		if(_u_dconv) {
-			delete [] _u_dconv;
-			_u_dconv = NULL;
-		}
-		if(_u_dconvb) {
-			delete [] _u_dconvb;
-			_u_dconvb = NULL;
-		}
-		if(_u_vel) {
-			delete [] _u_vel;
-			_u_vel = NULL;
-		}
-		if(_u_velb) {
-			delete [] _u_velb;
-			_u_velb = NULL;
+		clearTraining();
+		if(_u_filt) {
+			release(_u_filt);
+			_u_filt = NULL;
 		}
+		clearSparse();
+		clearWorkspace();
 	}
 
 	void write(std::ofstream &fout) {
@@ -370,8 +1086,10 @@ public:
 		fout << _unit_count << " " << _prev_unit_count << " ";
 		fout << _filter_width << " " << _filter_height << " ";
 		fout << _width << " " << _height << " " << _map_num << std::endl;
-		for(int i=0;i<_filter_size*_map_num;i++) {
-			fout << _u_conv[i] << " ";
+		for(int mi=0;mi<_map_num;mi++) {
+			const nnreal *cv = filter(mi);
+			for(int i=0;i<_filter_size;i++)
+				fout << cv[i] << " ";
 		}
 		fout<<std::endl;
 		for(int i=0;i<_map_num;i++) {
@@ -397,8 +1115,39 @@ public:
 			fin >> _u_convb[i];
 		}
 
+		transformFilters();
+		updateSparse();
 	}
 
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
+	void detachWeights() {
+		nnLayer::detachWeights();
+		_u_conv = _u_convb = NULL;
+		_u_sptr = _u_soff = NULL;
+		_u_sval = NULL;
+	}
+	void appendGradients(std::vector<std::pair<nnreal*, long> > &g) {
+		g.push_back(std::make_pair(_u_dconv, (long)_filter_size * _map_num));
+		g.push_back(std::make_pair(_u_dconvb, (long)_map_num));
+	}
+	// the filter transforms are redone on the next forward()
+	void weightsChanged() {
+		clearSparse();
+		_transform_ready = false;
+	}
+
+protected:
+	// the filter transforms are redone by initBatch()
+	void detachCopy(nnLayer *src) {
+		nnLayer::detachCopy(src);
+		_u_dconv = _u_dconvb = _u_vel = _u_velb = NULL;
+		_u_filt = _u_Wh ? new nnreal[2*_filter_size] : NULL;
+		_u_sum = _u_dsum = _u_col = _u_dcol = _u_wino = NULL;
+		_u_fconv = _u_fwork = NULL;
+		_transform_ready = false;
+	}
 };
 
 
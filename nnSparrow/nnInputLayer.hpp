@@ -57,16 +57,23 @@ public:
   void init() {
 
     nnLayer::clear();
-    _u_a = new double[_unit_count];
+    initBatch();
     //_u_delta = new double[_unit_count];
   }
-  bool inputSample(double *a, int n) {
-		if(n != _unit_count)
+  void initBatch() {
+    if(_u_a)
+      release(_u_a);
+    _u_a = new nnreal[_unit_count * _batch_size];
+  }
+  // copy a sample of float or double into slot b of the batch
+  template<typename T>
+  bool inputSample(const T *a, int n, int b = 0) {
+		if(n != _unit_count || b >= _batch_size)
 			return false;
-    memcpy(_u_a, a, sizeof(double)*n);
-		// for(int i=0;i<n;i++) {
-		// 	_u_a[i] = a[i];
-		// }
+		nnreal *ua = _u_a + b*n;
+		for(int i=0;i<n;i++) {
+			ua[i] = a[i];
+		}
 		return true;
 	}
 
@@ -99,6 +106,9 @@ public:
     init();
   }
 
+  nnLayer *replicate() {
+    return copyOf(this);
+  }
 };
 
 #endif
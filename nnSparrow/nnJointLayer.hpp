@@ -31,31 +31,40 @@
 
 #define __NN_JOINT_LAYER__
 
+// Children work in slices of the buffers of the joint layer. With a single sample they are laid out
+// as the joined sample, so joining costs nothing. A next layer that readsBlocks() takes larger batches
+// as the children left them, one block each; for other layers they are interleaved by copies.
 class nnJointLayer : public nnLayer {
 
 protected:
 
 	std::vector<nnLayer*> _children;
+	// first unit of each child in a joined sample
+	std::vector<int> _offset;
+
+	// children activations and deltas, child i at _offset[i] * samples in a slice
+	nnreal* _u_ca;
+	nnreal* _u_cdelta;
+	// joined samples of batches of more than one sample, for a next layer that does not read blocks
+	nnreal* _u_ja;
+	nnreal* _u_jdelta;
+	// _u_ca belongs to a planner, see placeActivation()
+	bool _placed;
 
 public:
 	nnJointLayer(std::vector<nnLayer*> &ch) :	nnLayer(NULL, NULL) {
 
-		int tot = 0;
-
-		int sz = ch.size();
-		for(int i=0;i<sz;i++) {
-			_children.push_back(ch[i]);
-			tot += ch[i]->getTotalUnitCount();
-		}
+		_children = ch;
+		join();
 
-		this->_unit_count = tot;
-		this->_prev_unit_count = tot;
-		this->_width = tot;
 		this->_height = 1;
 		this->_map_num = 1;
 
-		_u_a = NULL;
-		_u_delta = NULL;
+		_u_ca = NULL;
+		_u_cdelta = NULL;
+		_u_ja = NULL;
+		_u_jdelta = NULL;
+		_placed = false;
 	}
 	nnJointLayer() : nnLayer(NULL, NULL) {
 
@@ -65,13 +74,15 @@ public:
 		this->_height = 1;
 		this->_map_num = 1;
 
-		_u_a = NULL;
-		_u_delta = NULL;
-
+		_u_ca = NULL;
+		_u_cdelta = NULL;
+		_u_ja = NULL;
+		_u_jdelta = NULL;
+		_placed = false;
 	}
 
 	~nnJointLayer() {
-
+		clear();
 	}
 
 
@@ -80,11 +91,7 @@ public:
 		//clear();
 		int n = this->_unit_count;
 		if(n > 0) {
-			_u_a = new double[n]; //Eigen::MatrixXd::Zero(n,1);
-			memset(_u_a, 0, n*sizeof(double));
-
-			_u_delta = new double[n]; //Eigen::MatrixXd::Zero(n,1);
-			memset(_u_delta, 0, n*sizeof(double));
+			initBatch();
 		}
 
 	}
@@ -93,35 +100,96 @@ public:
 
 		_children.push_back(l);
 	}
+	void appendInputLayers(std::vector<nnLayer*> &in) {
+		in.insert(in.end(), _children.begin(), _children.end());
+	}
 	void join() {
 		int tot = 0;
 		int sz = _children.size();
+		_offset.resize(sz);
 		for(int i=0;i<sz;i++) {
+			_offset[i] = tot;
 			tot += _children[i]->getTotalUnitCount();
 		}
 		this->_unit_count = this->_prev_unit_count = tot;
+		this->_width = tot;
 	}
 
-	void forward() {
+	void initBatch() {
+
+		int n = _unit_count * _batch_size;
+
+		releaseBuffers();
+		_u_ca = new nnreal[n];
+		memset(_u_ca, 0, n*sizeof(nnreal));
+		if(_trainable) {
+			_u_cdelta = new nnreal[n];
+			memset(_u_cdelta, 0, n*sizeof(nnreal));
+		}
+		bind();
+	}
+	void setBatchCount(int b) {
+		nnLayer::setBatchCount(b);
+		bind();
+	}
+
+	// the children write into the joined buffer before the joint layer runs
+	long getActivationSize() {
+		return (long)_unit_count * _batch_size;
+	}
+	void placeActivation(nnreal *a) {
+		if(_u_ca && !_placed)
+			release(_u_ca);
+		_u_ca = a;
+		_placed = true;
+		bind();
+	}
+
+	// the children's own buffers, which the next layer reads in place
+	void getBlocks(std::vector<Block> &blocks) {
+
+		if(!readByBlocks()) {
+			nnLayer::getBlocks(blocks);
+			return;
+		}
+		blocks.resize(_children.size());
+		for(int i=0;i<_children.size();i++) {
+			int n = _children[i]->getTotalUnitCount();
+			Block k = {_offset[i], n, n, _children[i]->getActivation(), _children[i]->getDelta()};
+			blocks[i] = k;
+		}
+	}
 
-		int sh = 0;
+	void forward() {
 
+		if(readByBlocks())
+			return;
+		int tot = _unit_count;
 		for(int i=0;i<_children.size();i++) {
-			double *pa = _children[i]->getActivation();
 			int n = _children[i]->getTotalUnitCount();
-			memcpy(_u_a+sh, pa, sizeof(double)*n);
-			sh += n;
+			nnreal *pa = _children[i]->getActivation();
+			for(int b = 0; b < _batch_count; b++) {
+				nnreal *ua = _u_a + b*tot + _offset[i];
+				if(ua != pa + b*n)
+					memcpy(ua, pa + b*n, sizeof(nnreal)*n);
+			}
 		}
 
 	}
 	void backpropagation() {
 
-		int sh = 0;
+		int tot = _unit_count;
 		for(int i=0;i<_children.size();i++) {
-			double *pdt = _children[i]->getDelta();
 			int n = _children[i]->getTotalUnitCount();
-			memcpy(pdt, _u_delta+sh, sizeof(double)*n);
-			sh += n;
+			nnreal *pdt = _children[i]->getDelta();
+			if(!pdt)
+				continue;
+			for(int b = 0; b < _batch_count && !readByBlocks(); b++) {
+				nnreal *dt = _u_delta + b*tot + _offset[i];
+				if(dt != pdt + b*n)
+					memcpy(pdt + b*n, dt, sizeof(nnreal)*n);
+			}
+			_children[i]->updateDelta();
 		}
 
 	}
@@ -140,8 +208,10 @@ public:
 	}
 
 	void clear() {
+		releaseBuffers();
 		nnLayer::clear();
 		_children.clear();
+		_offset.clear();
 	}
 
 	void write(std::ofstream &fout) {
@@ -153,6 +223,68 @@ public:
 
 	}
 
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
+	void relink(std::map<nnLayer*, nnLayer*> &copies) {
+		nnLayer::relink(copies);
+		for(int i=0;i<_children.size();i++)
+			_children[i] = copies[_children[i]];
+	}
+
+protected:
+	void detachCopy(nnLayer *src) {
+		nnLayer::detachCopy(src);
+		_u_ca = _u_cdelta = _u_ja = _u_jdelta = NULL;
+		_placed = false;
+	}
+
+	// batches of more than one sample that the next layer reads from the children
+	bool readByBlocks() {
+		return _batch_count > 1 && _next && _next->readsBlocks();
+	}
+
+	// hand the children their slices and expose the joined buffers of the current batch count, the
+	// buffer of joined samples is set up by the first batch that needs it
+	void bind() {
+
+		if(!_u_ca)
+			return;
+		int s = _batch_count > 1 ? _batch_size : 1;
+		for(int i=0;i<_children.size();i++) {
+			// input layers are set up after the other layers and keep their own buffers
+			if(_children[i]->getLayerType() != INPUT_LAYER)
+				_children[i]->shareBatch(_u_ca + _offset[i]*s, _u_cdelta ? _u_cdelta + _offset[i]*s : NULL);
+		}
+		bool join = _batch_count > 1 && !readByBlocks();
+		if(join && !_u_ja) {
+			int n = _unit_count * _batch_size;
+			_u_ja = new nnreal[n];
+			memset(_u_ja, 0, n*sizeof(nnreal));
+			if(_trainable) {
+				_u_jdelta = new nnreal[n];
+				memset(_u_jdelta, 0, n*sizeof(nnreal));
+			}
+		}
+		_u_a = join ? _u_ja : _u_ca;
+		_u_delta = join ? _u_jdelta : _u_cdelta;
+		_shared_batch = true;
+	}
+	void releaseBuffers() {
+
+		releaseBatch();
+		if(_u_ca && !_placed)
+			release(_u_ca);
+		if(_u_cdelta)
+			release(_u_cdelta);
+		if(_u_ja)
+			release(_u_ja);
+		if(_u_jdelta)
+			release(_u_jdelta);
+		_u_ca = _u_cdelta = _u_ja = _u_jdelta = NULL;
+		_placed = false;
+	}
+
 };
 
 
@@ -0,0 +1,1351 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <memory.h>
+#include <stdint.h>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#ifndef __NN_KERNEL__
+#define __NN_KERNEL__
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+// scalar type of the network buffers, float when built with NN_USE_FLOAT
+#ifdef NN_USE_FLOAT
+typedef float nnreal;
+#else
+typedef double nnreal;
+#endif
+
+// 16 bit storage of weights: IEEE half (FP16) or the upper half of a float (BF16), both rounded to nearest even
+class nnHalf {
+
+public:
+	enum TYPE {
+		NONE = 0,	// weights kept in nnreal
+		FP16,
+		BF16
+	};
+
+	static inline uint16_t fromFloat(float f, int type) {
+
+		uint32_t x;
+		memcpy(&x, &f, 4);
+		if(type == BF16) {
+			if((x & 0x7fffffff) > 0x7f800000)
+				return (uint16_t)((x >> 16) | 0x40);
+			return (uint16_t)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+		}
+#ifdef __F16C__
+		return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+		uint32_t sign = (x >> 16) & 0x8000, ax = x & 0x7fffffff, h;
+		if(ax >= 0x7f800000)
+			h = 0x7c00 | ((ax > 0x7f800000) ? 0x200 : 0);
+		else if(ax >= 0x477ff000)
+			h = 0x7c00;
+		else if(ax < 0x38800000) {
+			// below the normal halfs, the float adder rounds the subnormal mantissa
+			float a, m = 0.5f;
+			uint32_t mb;
+			memcpy(&a, &ax, 4);
+			a += m;
+			memcpy(&x, &a, 4);
+			memcpy(&mb, &m, 4);
+			h = x - mb;
+		}
+		else {
+			uint32_t odd = (ax >> 13) & 1;
+			h = (ax + ((uint32_t)(15 - 127) << 23) + 0xfff + odd) >> 13;
+		}
+		return (uint16_t)(sign | h);
+#endif
+	}
+
+	static inline float toFloat(uint16_t h, int type) {
+
+		uint32_t x;
+		float f;
+		if(type == BF16)
+			x = (uint32_t)h << 16;
+		else {
+#ifdef __F16C__
+			return _cvtsh_ss(h);
+#else
+			uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+			if(e == 0) {
+				f = ldexpf((float)m, -24);
+				return (h & 0x8000) ? -f : f;
+			}
+			x = ((uint32_t)(h & 0x8000) << 16) | ((e == 31) ? 0x7f800000 : (e + 112) << 23) | (m << 13);
+#endif
+		}
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	template<typename T>
+	static void pack(const T *a, int n, int type, uint16_t *h) {
+		for(int i = 0; i < n; i++)
+			h[i] = fromFloat((float)a[i], type);
+	}
+	template<typename T>
+	static void unpack(const uint16_t *h, int n, int type, T *a) {
+		for(int i = 0; i < n; i++)
+			a[i] = toFloat(h[i], type);
+	}
+};
+
+// SIMD register traits used by the kernels below.
+// width: lanes per register, mr x nr: register tile of the gemm micro kernel.
+template<typename T>
+struct nnVec {
+	typedef T reg;
+	typedef bool mask;
+	enum { width = 1, mr = 4, nr = 4 };
+
+	static inline reg zero() { return 0; }
+	static inline reg set1(T a) { return a; }
+	static inline reg load(const T *p) { return *p; }
+	static inline reg load2(const T *p) { return *p; }
+	// widened FP16 and BF16 weights
+	static inline reg loadh(const uint16_t *p) { return nnHalf::toFloat(*p, nnHalf::FP16); }
+	static inline reg loadb(const uint16_t *p) { return nnHalf::toFloat(*p, nnHalf::BF16); }
+	// p[idx[0]], ..., p[idx[width - 1]]
+	static inline reg gather(const T *p, const int *idx) { return p[*idx]; }
+	static inline void store(T *p, reg a) { *p = a; }
+	static inline reg add(reg a, reg b) { return a + b; }
+	static inline reg fmadd(reg a, reg b, reg c) { return a * b + c; }
+	static inline T sum(reg a) { return a; }
+	static inline mask gt(reg a, reg b) { return a > b; }
+	// m ? b : a
+	static inline reg blend(mask m, reg a, reg b) { return m ? b : a; }
+	static inline reg sub(reg a, reg b) { return a - b; }
+	static inline reg mul(reg a, reg b) { return a * b; }
+	static inline reg div(reg a, reg b) { return a / b; }
+	static inline reg min(reg a, reg b) { return a < b ? a : b; }
+	static inline reg max(reg a, reg b) { return a > b ? a : b; }
+	static inline reg round(reg a) { return nearbyint(a); }
+	// a * 2^n, n integral and inside the exponent range
+	static inline reg scale2(reg a, reg n) { return ldexp(a, (int)n); }
+};
+
+#if defined(__AVX512F__)
+
+template<>
+struct nnVec<double> {
+	typedef __m512d reg;
+	typedef __mmask8 mask;
+	enum { width = 8, mr = 8, nr = 16 };
+
+	static inline reg zero() { return _mm512_setzero_pd(); }
+	static inline reg set1(double a) { return _mm512_set1_pd(a); }
+	static inline reg load(const double *p) { return _mm512_loadu_pd(p); }
+	// p[0], p[2], ..., p[14]
+	static inline reg load2(const double *p) {
+		return _mm512_permutex2var_pd(_mm512_loadu_pd(p), _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0), _mm512_loadu_pd(p + 8));
+	}
+	static inline reg loadh(const uint16_t *p) { return _mm512_cvtps_pd(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p))); }
+	static inline reg loadb(const uint16_t *p) {
+		return _mm512_cvtps_pd(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)), 16)));
+	}
+	static inline reg gather(const double *p, const int *idx) {
+		return _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i*)idx), p, 8);
+	}
+	static inline void store(double *p, reg a) { _mm512_storeu_pd(p, a); }
+	static inline reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+	static inline reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_pd(a, b, c); }
+	static inline double sum(reg a) { return _mm512_reduce_add_pd(a); }
+	static inline mask gt(reg a, reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+	static inline reg blend(mask m, reg a, reg b) { return _mm512_mask_blend_pd(m, a, b); }
+	static inline reg sub(reg a, reg b) { return _mm512_sub_pd(a, b); }
+	static inline reg mul(reg a, reg b) { return _mm512_mul_pd(a, b); }
+	static inline reg div(reg a, reg b) { return _mm512_div_pd(a, b); }
+	static inline reg min(reg a, reg b) { return _mm512_min_pd(a, b); }
+	static inline reg max(reg a, reg b) { return _mm512_max_pd(a, b); }
+	static inline reg round(reg a) { return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	static inline reg scale2(reg a, reg n) { return _mm512_scalef_pd(a, n); }
+};
+
+template<>
+struct nnVec<float> {
+	typedef __m512 reg;
+	typedef __mmask16 mask;
+	enum { width = 16, mr = 8, nr = 32 };
+
+	static inline reg zero() { return _mm512_setzero_ps(); }
+	static inline reg set1(float a) { return _mm512_set1_ps(a); }
+	static inline reg load(const float *p) { return _mm512_loadu_ps(p); }
+	// p[0], p[2], ..., p[30]
+	static inline reg load2(const float *p) {
+		return _mm512_permutex2var_ps(_mm512_loadu_ps(p),
+			_mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0), _mm512_loadu_ps(p + 16));
+	}
+	static inline reg loadh(const uint16_t *p) { return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)p)); }
+	static inline reg loadb(const uint16_t *p) {
+		return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p)), 16));
+	}
+	static inline reg gather(const float *p, const int *idx) {
+		return _mm512_i32gather_ps(_mm512_loadu_si512(idx), p, 4);
+	}
+	static inline void store(float *p, reg a) { _mm512_storeu_ps(p, a); }
+	static inline reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+	static inline reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+	static inline float sum(reg a) { return _mm512_reduce_add_ps(a); }
+	static inline mask gt(reg a, reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	static inline reg blend(mask m, reg a, reg b) { return _mm512_mask_blend_ps(m, a, b); }
+	static inline reg sub(reg a, reg b) { return _mm512_sub_ps(a, b); }
+	static inline reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+	static inline reg div(reg a, reg b) { return _mm512_div_ps(a, b); }
+	static inline reg min(reg a, reg b) { return _mm512_min_ps(a, b); }
+	static inline reg max(reg a, reg b) { return _mm512_max_ps(a, b); }
+	static inline reg round(reg a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	static inline reg scale2(reg a, reg n) { return _mm512_scalef_ps(a, n); }
+};
+
+#elif defined(__AVX2__)
+
+template<>
+struct nnVec<double> {
+	typedef __m256d reg;
+	typedef __m256d mask;
+	enum { width = 4, mr = 6, nr = 8 };
+
+	static inline reg zero() { return _mm256_setzero_pd(); }
+	static inline reg set1(double a) { return _mm256_set1_pd(a); }
+	static inline reg load(const double *p) { return _mm256_loadu_pd(p); }
+	// p[0], p[2], p[4], p[6]
+	static inline reg load2(const double *p) {
+		return _mm256_permute4x64_pd(_mm256_unpacklo_pd(_mm256_loadu_pd(p), _mm256_loadu_pd(p + 4)), 0xD8);
+	}
+	static inline reg loadh(const uint16_t *p) {
+#ifdef __F16C__
+		return _mm256_cvtps_pd(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)p)));
+#else
+		return _mm256_setr_pd(nnHalf::toFloat(p[0], nnHalf::FP16), nnHalf::toFloat(p[1], nnHalf::FP16),
+			nnHalf::toFloat(p[2], nnHalf::FP16), nnHalf::toFloat(p[3], nnHalf::FP16));
+#endif
+	}
+	static inline reg loadb(const uint16_t *p) {
+		return _mm256_cvtps_pd(_mm_castsi128_ps(_mm_slli_epi32(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)p)), 16)));
+	}
+	static inline reg gather(const double *p, const int *idx) {
+		return _mm256_i32gather_pd(p, _mm_loadu_si128((const __m128i*)idx), 8);
+	}
+	static inline void store(double *p, reg a) { _mm256_storeu_pd(p, a); }
+	static inline reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+	static inline reg fmadd(reg a, reg b, reg c) {
+#ifdef __FMA__
+		return _mm256_fmadd_pd(a, b, c);
+#else
+		return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+	}
+	static inline double sum(reg a) {
+		__m128d lo = _mm256_castpd256_pd128(a);
+		__m128d hi = _mm256_extractf128_pd(a, 1);
+		lo = _mm_add_pd(lo, hi);
+		return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+	}
+	static inline mask gt(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+	static inline reg blend(mask m, reg a, reg b) { return _mm256_blendv_pd(a, b, m); }
+	static inline reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+	static inline reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+	static inline reg div(reg a, reg b) { return _mm256_div_pd(a, b); }
+	static inline reg min(reg a, reg b) { return _mm256_min_pd(a, b); }
+	static inline reg max(reg a, reg b) { return _mm256_max_pd(a, b); }
+	static inline reg round(reg a) { return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	// the biased exponent n + 1023 built in the integer lanes
+	static inline reg scale2(reg a, reg n) {
+		__m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+		e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+		return _mm256_mul_pd(a, _mm256_castsi256_pd(e));
+	}
+};
+
+template<>
+struct nnVec<float> {
+	typedef __m256 reg;
+	typedef __m256 mask;
+	enum { width = 8, mr = 6, nr = 16 };
+
+	static inline reg zero() { return _mm256_setzero_ps(); }
+	static inline reg set1(float a) { return _mm256_set1_ps(a); }
+	static inline reg load(const float *p) { return _mm256_loadu_ps(p); }
+	// p[0], p[2], ..., p[14]
+	static inline reg load2(const float *p) {
+		__m256 a = _mm256_shuffle_ps(_mm256_loadu_ps(p), _mm256_loadu_ps(p + 8), 0x88);
+		return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(a), 0xD8));
+	}
+	static inline reg loadh(const uint16_t *p) {
+#ifdef __F16C__
+		return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+#else
+		float t[8];
+		nnHalf::unpack(p, 8, nnHalf::FP16, t);
+		return _mm256_loadu_ps(t);
+#endif
+	}
+	static inline reg loadb(const uint16_t *p) {
+		return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)), 16));
+	}
+	static inline reg gather(const float *p, const int *idx) {
+		return _mm256_i32gather_ps(p, _mm256_loadu_si256((const __m256i*)idx), 4);
+	}
+	static inline void store(float *p, reg a) { _mm256_storeu_ps(p, a); }
+	static inline reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+	static inline reg fmadd(reg a, reg b, reg c) {
+#ifdef __FMA__
+		return _mm256_fmadd_ps(a, b, c);
+#else
+		return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+	}
+	static inline float sum(reg a) {
+		__m128 lo = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+		lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+		return _mm_cvtss_f32(_mm_add_ss(lo, _mm_movehdup_ps(lo)));
+	}
+	static inline mask gt(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static inline reg blend(mask m, reg a, reg b) { return _mm256_blendv_ps(a, b, m); }
+	static inline reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+	static inline reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+	static inline reg div(reg a, reg b) { return _mm256_div_ps(a, b); }
+	static inline reg min(reg a, reg b) { return _mm256_min_ps(a, b); }
+	static inline reg max(reg a, reg b) { return _mm256_max_ps(a, b); }
+	static inline reg round(reg a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	// the biased exponent n + 127 built in the integer lanes
+	static inline reg scale2(reg a, reg n) {
+		__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+		return _mm256_mul_ps(a, _mm256_castsi256_ps(e));
+	}
+};
+
+#endif
+
+
+class nnKernel {
+
+public:
+	// cache blocking of gemm: kc x nc panel of B stays in L2/L3, mc x kc block of A in L2
+	enum {
+		GEMM_KC = 256,
+		GEMM_MC = 96,
+		GEMM_NC = 2048,
+		GEMV_BLOCK = 2048
+	};
+
+	// y[m] += A[m, n] * x[n]
+	template<typename T>
+	static void gemv(int m, int n, const T *A, int lda, const T *x, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		for(int jb = 0; jb < n; jb += GEMV_BLOCK) {
+			const int je = MIN(n, jb + GEMV_BLOCK);
+
+			int i = 0;
+			// 4 rows share every load of x
+			for(; i + 4 <= m; i += 4) {
+				const T *a0 = A + i*lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+				typename V::reg s0 = V::zero(), s1 = V::zero(), s2 = V::zero(), s3 = V::zero();
+				typename V::reg t0 = V::zero(), t1 = V::zero(), t2 = V::zero(), t3 = V::zero();
+				int j = jb;
+				for(; j + 2*W <= je; j += 2*W) {
+					typename V::reg x0 = V::load(x + j), x1 = V::load(x + j + W);
+					s0 = V::fmadd(V::load(a0 + j), x0, s0);
+					s1 = V::fmadd(V::load(a1 + j), x0, s1);
+					s2 = V::fmadd(V::load(a2 + j), x0, s2);
+					s3 = V::fmadd(V::load(a3 + j), x0, s3);
+					t0 = V::fmadd(V::load(a0 + j + W), x1, t0);
+					t1 = V::fmadd(V::load(a1 + j + W), x1, t1);
+					t2 = V::fmadd(V::load(a2 + j + W), x1, t2);
+					t3 = V::fmadd(V::load(a3 + j + W), x1, t3);
+				}
+				for(; j + W <= je; j += W) {
+					typename V::reg x0 = V::load(x + j);
+					s0 = V::fmadd(V::load(a0 + j), x0, s0);
+					s1 = V::fmadd(V::load(a1 + j), x0, s1);
+					s2 = V::fmadd(V::load(a2 + j), x0, s2);
+					s3 = V::fmadd(V::load(a3 + j), x0, s3);
+				}
+				T d0 = V::sum(V::add(s0, t0)), d1 = V::sum(V::add(s1, t1));
+				T d2 = V::sum(V::add(s2, t2)), d3 = V::sum(V::add(s3, t3));
+				for(; j < je; j++) {
+					d0 += a0[j] * x[j];
+					d1 += a1[j] * x[j];
+					d2 += a2[j] * x[j];
+					d3 += a3[j] * x[j];
+				}
+				y[i] += d0;
+				y[i+1] += d1;
+				y[i+2] += d2;
+				y[i+3] += d3;
+			}
+			for(; i < m; i++) {
+				const T *a0 = A + i*lda;
+				typename V::reg s0 = V::zero();
+				int j = jb;
+				for(; j + W <= je; j += W) {
+					s0 = V::fmadd(V::load(a0 + j), V::load(x + j), s0);
+				}
+				T d0 = V::sum(s0);
+				for(; j < je; j++) {
+					d0 += a0[j] * x[j];
+				}
+				y[i] += d0;
+			}
+		}
+	}
+
+	// y[m] += A[m, n] * x[n], A stored as 16 bit of the nnHalf type and widened in the registers
+	template<typename T>
+	static void gemvHalf(int m, int n, const uint16_t *A, int lda, int type, const T *x, T *y) {
+		if(type == nnHalf::BF16)
+			gemvWiden<T, nnHalf::BF16>(m, n, A, lda, x, y);
+		else
+			gemvWiden<T, nnHalf::FP16>(m, n, A, lda, x, y);
+	}
+
+	// densities of pruned weights below which spmv and correlateRowSparse beat gemv and correlateRow,
+	// as measured by the benchmark; float runs twice the lanes of the dense kernels but not of the gathers
+	template<typename T>
+	static double sparseBreakEven(bool conv) {
+		if(sizeof(T) == sizeof(float))
+			return 0.2;
+		return conv ? 0.4 : 0.25;
+	}
+
+	// y[m] += A * x for A in CSR: the nonzeros of row i are val[ptr[i]..ptr[i+1]) in the columns col[]
+	template<typename T>
+	static void spmv(int m, const int *ptr, const int *col, const T *val, const T *x, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		for(int i = 0; i < m; i++) {
+			int k = ptr[i], e = ptr[i+1];
+			typename V::reg s = V::zero();
+			for(; k + W <= e; k += W)
+				s = V::fmadd(V::load(val + k), V::gather(x, col + k), s);
+			T d = V::sum(s);
+			for(; k < e; k++)
+				d += val[k] * x[col[k]];
+			y[i] += d;
+		}
+	}
+
+	// rows of growing length packed one after the other: row i holds the st + i first entries of a row of A
+	static inline long prefixOffset(int i, int st) {
+		return (long)i*st + (long)i*(i - 1)/2;
+	}
+
+	// y[m] += A * x for packed prefix rows: y[i] += sum of A_i[j] * x[j], j < st + i
+	template<typename T>
+	static void gemvPrefix(int m, int st, const T *A, const T *x, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int i = 0;
+		// 4 rows share every load of x up to the length of the first, the others add 1 to 3 entries
+		for(; i + 4 <= m; i += 4) {
+			const int len = st + i;
+			const T *a0 = A + prefixOffset(i, st), *a1 = a0 + len, *a2 = a1 + len + 1, *a3 = a2 + len + 2;
+			typename V::reg s0 = V::zero(), s1 = V::zero(), s2 = V::zero(), s3 = V::zero();
+			int j = 0;
+			for(; j + W <= len; j += W) {
+				typename V::reg x0 = V::load(x + j);
+				s0 = V::fmadd(V::load(a0 + j), x0, s0);
+				s1 = V::fmadd(V::load(a1 + j), x0, s1);
+				s2 = V::fmadd(V::load(a2 + j), x0, s2);
+				s3 = V::fmadd(V::load(a3 + j), x0, s3);
+			}
+			T d0 = V::sum(s0), d1 = V::sum(s1), d2 = V::sum(s2), d3 = V::sum(s3);
+			for(; j < len; j++) {
+				d0 += a0[j] * x[j];
+				d1 += a1[j] * x[j];
+				d2 += a2[j] * x[j];
+				d3 += a3[j] * x[j];
+			}
+			d1 += a1[len] * x[len];
+			d2 += a2[len] * x[len] + a2[len+1] * x[len+1];
+			d3 += a3[len] * x[len] + a3[len+1] * x[len+1] + a3[len+2] * x[len+2];
+			y[i] += d0;
+			y[i+1] += d1;
+			y[i+2] += d2;
+			y[i+3] += d3;
+		}
+		for(; i < m; i++) {
+			const int len = st + i;
+			const T *a0 = A + prefixOffset(i, st);
+			typename V::reg s0 = V::zero();
+			int j = 0;
+			for(; j + W <= len; j += W)
+				s0 = V::fmadd(V::load(a0 + j), V::load(x + j), s0);
+			T d0 = V::sum(s0);
+			for(; j < len; j++)
+				d0 += a0[j] * x[j];
+			y[i] += d0;
+		}
+	}
+
+	// y[st + m - 1] += A' * x for packed prefix rows
+	template<typename T>
+	static void gemvTPrefix(int m, int st, const T *A, const T *x, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int i = 0;
+		// 4 rows share every load and store of y
+		for(; i + 4 <= m; i += 4) {
+			const int len = st + i;
+			const T *a0 = A + prefixOffset(i, st), *a1 = a0 + len, *a2 = a1 + len + 1, *a3 = a2 + len + 2;
+			const T x0 = x[i], x1 = x[i+1], x2 = x[i+2], x3 = x[i+3];
+			typename V::reg c0 = V::set1(x0), c1 = V::set1(x1), c2 = V::set1(x2), c3 = V::set1(x3);
+			int j = 0;
+			for(; j + W <= len; j += W) {
+				typename V::reg t = V::load(y + j);
+				t = V::fmadd(V::load(a0 + j), c0, t);
+				t = V::fmadd(V::load(a1 + j), c1, t);
+				t = V::fmadd(V::load(a2 + j), c2, t);
+				t = V::fmadd(V::load(a3 + j), c3, t);
+				V::store(y + j, t);
+			}
+			for(; j < len; j++)
+				y[j] += a0[j] * x0 + a1[j] * x1 + a2[j] * x2 + a3[j] * x3;
+			y[len] += a1[len] * x1 + a2[len] * x2 + a3[len] * x3;
+			y[len+1] += a2[len+1] * x2 + a3[len+1] * x3;
+			y[len+2] += a3[len+2] * x3;
+		}
+		for(; i < m; i++)
+			axpy(st + i, x[i], A + prefixOffset(i, st), 1, y);
+	}
+
+	// A += x * y' on packed prefix rows: A_i[j] += x[i] * y[j], j < st + i
+	template<typename T>
+	static void gerPrefix(int m, int st, const T *x, const T *y, T *A) {
+		for(int i = 0; i < m; i++)
+			axpy(st + i, x[i], y, 1, A + prefixOffset(i, st));
+	}
+
+	// y[n] += A[m, n]' * x[m]
+	template<typename T>
+	static void gemvT(int m, int n, const T *A, int lda, const T *x, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		for(int jb = 0; jb < n; jb += GEMV_BLOCK) {
+			const int je = MIN(n, jb + GEMV_BLOCK);
+
+			int i = 0;
+			// 4 rows per pass, so every element of y is loaded and stored m/4 times
+			for(; i + 4 <= m; i += 4) {
+				const T *a0 = A + i*lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+				typename V::reg x0 = V::set1(x[i]), x1 = V::set1(x[i+1]);
+				typename V::reg x2 = V::set1(x[i+2]), x3 = V::set1(x[i+3]);
+				int j = jb;
+				for(; j + W <= je; j += W) {
+					typename V::reg s = V::load(y + j);
+					s = V::fmadd(V::load(a0 + j), x0, s);
+					s = V::fmadd(V::load(a1 + j), x1, s);
+					s = V::fmadd(V::load(a2 + j), x2, s);
+					s = V::fmadd(V::load(a3 + j), x3, s);
+					V::store(y + j, s);
+				}
+				for(; j < je; j++) {
+					y[j] += a0[j]*x[i] + a1[j]*x[i+1] + a2[j]*x[i+2] + a3[j]*x[i+3];
+				}
+			}
+			for(; i < m; i++) {
+				const T *a0 = A + i*lda;
+				typename V::reg x0 = V::set1(x[i]);
+				int j = jb;
+				for(; j + W <= je; j += W) {
+					V::store(y + j, V::fmadd(V::load(a0 + j), x0, V::load(y + j)));
+				}
+				for(; j < je; j++) {
+					y[j] += a0[j] * x[i];
+				}
+			}
+		}
+	}
+
+	// A[m, n] += x[m] * y[n]'
+	template<typename T>
+	static void ger(int m, int n, const T *x, const T *y, T *A, int lda) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		for(int i = 0; i < m; i++) {
+			T *a0 = A + i*lda;
+			typename V::reg x0 = V::set1(x[i]);
+			int j = 0;
+			for(; j + 2*W <= n; j += 2*W) {
+				V::store(a0 + j, V::fmadd(V::load(y + j), x0, V::load(a0 + j)));
+				V::store(a0 + j + W, V::fmadd(V::load(y + j + W), x0, V::load(a0 + j + W)));
+			}
+			for(; j < n; j++) {
+				a0[j] += x[i] * y[j];
+			}
+		}
+	}
+
+	// C[m, n] += op(A)[m, k] * op(B)[k, n]
+	// op(A) is A[m, k] or, if ta, A[k, m] transposed; likewise for op(B)
+	template<typename T>
+	static void gemm(bool ta, bool tb, int m, int n, int k,
+		const T *A, int lda, const T *B, int ldb, T *C, int ldc) {
+
+		typedef nnVec<T> V;
+		const int MR = V::mr, NR = V::nr;
+
+		if(m <= 0 || n <= 0 || k <= 0)
+			return;
+
+		static thread_local std::vector<T> pa, pb;
+		pa.resize(GEMM_MC * GEMM_KC);
+		pb.resize(GEMM_KC * (GEMM_NC + NR));
+
+		for(int jc = 0; jc < n; jc += GEMM_NC) {
+			const int nc = MIN(GEMM_NC, n - jc);
+
+			for(int pc = 0; pc < k; pc += GEMM_KC) {
+				const int kc = MIN(GEMM_KC, k - pc);
+				packB(tb, kc, nc, B, ldb, pc, jc, &pb[0]);
+
+				for(int ic = 0; ic < m; ic += GEMM_MC) {
+					const int mc = MIN(GEMM_MC, m - ic);
+					packA(ta, mc, kc, A, lda, ic, pc, &pa[0]);
+
+					for(int jr = 0; jr < nc; jr += NR) {
+						const int nr = MIN(NR, nc - jr);
+						for(int ir = 0; ir < mc; ir += MR) {
+							const int mr = MIN(MR, mc - ir);
+							T *c = C + (ic + ir)*ldc + jc + jr;
+							if(mr == MR && nr == NR) {
+								microKernel(kc, &pa[ir*kc], &pb[jr*kc], c, ldc);
+							}
+							else {
+								T tmp[MR*NR];
+								memset(tmp, 0, sizeof(tmp));
+								microKernel(kc, &pa[ir*kc], &pb[jr*kc], tmp, NR);
+								for(int r = 0; r < mr; r++)
+									for(int s = 0; s < nr; s++)
+										c[r*ldc + s] += tmp[r*NR + s];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// y[n] += a * x[n*incx]
+	template<typename T>
+	static void axpy(int n, T a, const T *x, int incx, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int j = 0;
+		if(incx == 1) {
+			typename V::reg va = V::set1(a);
+			for(; j + W <= n; j += W) {
+				V::store(y + j, V::fmadd(V::load(x + j), va, V::load(y + j)));
+			}
+		}
+		for(; j < n; j++) {
+			y[j] += a * x[j*incx];
+		}
+	}
+
+	// y[n*incy] += a * x[n]
+	template<typename T>
+	static void axpyTo(int n, T a, const T *x, T *y, int incy) {
+
+		if(incy == 1) {
+			axpy(n, a, x, 1, y);
+			return;
+		}
+		for(int j = 0; j < n; j++) {
+			y[j*incy] += a * x[j];
+		}
+	}
+
+	// x[n] . y[n*incy]
+	template<typename T>
+	static T dot(int n, const T *x, const T *y, int incy) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int j = 0;
+		T d = 0;
+		if(incy == 1) {
+			typename V::reg s = V::zero();
+			for(; j + W <= n; j += W) {
+				s = V::fmadd(V::load(x + j), V::load(y + j), s);
+			}
+			d = V::sum(s);
+		}
+		for(; j < n; j++) {
+			d += x[j] * y[j*incy];
+		}
+		return d;
+	}
+
+	// sum of the m rows of x[m, n]; x itself if it has one row, out[n] otherwise
+	template<typename T>
+	static const T* sumRows(int m, int n, const T *x, T *out) {
+
+		if(m == 1)
+			return x;
+
+		memcpy(out, x, n*sizeof(T));
+		for(int i = 1; i < m; i++) {
+			axpy(n, (T)1, x + i*n, 1, out);
+		}
+		return out;
+	}
+
+	// out[n] += f[fh, fw] correlated with a row of outputs: out[i] += sum f[fy, fx] * x[fy*ld + i*inc + fx]
+	// square 1x1, 3x3, 5x5 and 7x7 filters with stride 1 or 2 run a kernel unrolled at compile time
+	template<typename T>
+	static void correlateRow(int n, const T *x, int ld, int inc, const T *f, int fw, int fh, T *out) {
+
+		if(fw == fh && (inc == 1 || inc == 2)) {
+			switch(fw) {
+				case 1:
+					if(inc == 1) correlateRowFixed<1, 1>(n, x, ld, f, out);
+					else correlateRowFixed<1, 2>(n, x, ld, f, out);
+					return;
+				case 3:
+					if(inc == 1) correlateRowFixed<3, 1>(n, x, ld, f, out);
+					else correlateRowFixed<3, 2>(n, x, ld, f, out);
+					return;
+				case 5:
+					if(inc == 1) correlateRowFixed<5, 1>(n, x, ld, f, out);
+					else correlateRowFixed<5, 2>(n, x, ld, f, out);
+					return;
+				case 7:
+					if(inc == 1) correlateRowFixed<7, 1>(n, x, ld, f, out);
+					else correlateRowFixed<7, 2>(n, x, ld, f, out);
+					return;
+				default:
+					break;
+			}
+		}
+		correlateRowGeneric(n, x, ld, inc, f, fw, fh, out);
+	}
+
+	// out[n] += sum of the nt taps of a pruned filter: out[i] += val[t] * x[off[t] + i], off[t] = fy*ld + fx
+	template<typename T>
+	static void correlateRowSparse(int n, const T *x, int nt, const int *off, const T *val, T *out) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int i = 0;
+		for(; i + 2*W <= n; i += 2*W) {
+			typename V::reg s0 = V::load(out + i), s1 = V::load(out + i + W);
+			for(int t = 0; t < nt; t++) {
+				typename V::reg c = V::set1(val[t]);
+				s0 = V::fmadd(c, V::load(x + off[t] + i), s0);
+				s1 = V::fmadd(c, V::load(x + off[t] + i + W), s1);
+			}
+			V::store(out + i, s0);
+			V::store(out + i + W, s1);
+		}
+		for(; i + W <= n; i += W) {
+			typename V::reg s0 = V::load(out + i);
+			for(int t = 0; t < nt; t++)
+				s0 = V::fmadd(V::set1(val[t]), V::load(x + off[t] + i), s0);
+			V::store(out + i, s0);
+		}
+		for(; i < n; i++) {
+			T d = out[i];
+			for(int t = 0; t < nt; t++)
+				d += val[t] * x[off[t] + i];
+			out[i] = d;
+		}
+	}
+
+	// correlateRow of an F x F filter with stride S, the taps held in registers
+	template<int F, int S, typename T>
+	static void correlateRowFixed(int n, const T *x, int ld, const T *f, T *out) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		typename V::reg c[F*F];
+		for(int k = 0; k < F*F; k++)
+			c[k] = V::set1(f[k]);
+
+		int i = 0;
+		// load2 reads one element past the last input of its W outputs, stay inside the row
+		for(; i + 2*W <= n - (S > 1); i += 2*W) {
+			typename V::reg s0 = V::load(out + i), s1 = V::load(out + i + W);
+			for(int fy = 0; fy < F; fy++) {
+				const T *px = x + fy*ld + i*S;
+				for(int fx = 0; fx < F; fx++) {
+					s0 = V::fmadd(c[fy*F + fx], S == 1 ? V::load(px + fx) : V::load2(px + fx), s0);
+					s1 = V::fmadd(c[fy*F + fx], S == 1 ? V::load(px + fx + W) : V::load2(px + fx + W*S), s1);
+				}
+			}
+			V::store(out + i, s0);
+			V::store(out + i + W, s1);
+		}
+		for(; i + W <= n - (S > 1); i += W) {
+			typename V::reg s = V::load(out + i);
+			for(int fy = 0; fy < F; fy++) {
+				const T *px = x + fy*ld + i*S;
+				for(int fx = 0; fx < F; fx++)
+					s = V::fmadd(c[fy*F + fx], S == 1 ? V::load(px + fx) : V::load2(px + fx), s);
+			}
+			V::store(out + i, s);
+		}
+		for(; i < n; i++) {
+			T d = 0;
+			const T *px = x + i*S;
+			for(int fy = 0; fy < F; fy++) {
+				for(int fx = 0; fx < F; fx++)
+					d += f[fy*F + fx] * px[fy*ld + fx];
+			}
+			out[i] += d;
+		}
+	}
+
+	// correlateRow of any filter and stride, vectorized for stride 1
+	template<typename T>
+	static void correlateRowGeneric(int n, const T *x, int ld, int inc, const T *f, int fw, int fh, T *out) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int i = 0;
+		if(inc == 1) {
+			for(; i + 2*W <= n; i += 2*W) {
+				typename V::reg s0 = V::load(out + i), s1 = V::load(out + i + W);
+				for(int fy = 0; fy < fh; fy++) {
+					const T *px = x + fy*ld + i;
+					for(int fx = 0; fx < fw; fx++) {
+						typename V::reg c = V::set1(f[fy*fw + fx]);
+						s0 = V::fmadd(c, V::load(px + fx), s0);
+						s1 = V::fmadd(c, V::load(px + fx + W), s1);
+					}
+				}
+				V::store(out + i, s0);
+				V::store(out + i + W, s1);
+			}
+		}
+		for(; i < n; i++) {
+			T d = 0;
+			const T *px = x + i*inc;
+			for(int fy = 0; fy < fh; fy++) {
+				for(int fx = 0; fx < fw; fx++)
+					d += f[fy*fw + fx] * px[fy*ld + fx];
+			}
+			out[i] += d;
+		}
+	}
+
+	// pooling over a row of n fw x fh windows, window i at x + i*fw, rows ld apart.
+	// arg holds the offset fy*fw + fx of the first maximum inside each window, I must hold fw*fh - 1.
+	template<typename T, typename I>
+	static void maxPoolRow(int n, const T *x, int ld, int fw, int fh, T *out, I *arg) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int i = 0;
+		if(fw == 2 && fh == 2) {
+			// even and odd columns of the row pair, the odd load reads one past the last window
+			const T *x1 = x + ld;
+			T k[W];
+			for(; i + W < n; i += W) {
+				typename V::reg m = V::load2(x + 2*i), id = V::zero();
+				typename V::reg v = V::load2(x + 2*i + 1);
+				typename V::mask g = V::gt(v, m);
+				m = V::blend(g, m, v);
+				id = V::blend(g, id, V::set1(1));
+				v = V::load2(x1 + 2*i);
+				g = V::gt(v, m);
+				m = V::blend(g, m, v);
+				id = V::blend(g, id, V::set1(2));
+				v = V::load2(x1 + 2*i + 1);
+				g = V::gt(v, m);
+				m = V::blend(g, m, v);
+				id = V::blend(g, id, V::set1(3));
+				V::store(out + i, m);
+				V::store(k, id);
+				for(int j = 0; j < W; j++)
+					arg[i + j] = (I)k[j];
+			}
+		}
+		for(; i < n; i++) {
+			const T *px = x + i*fw;
+			T m = px[0];
+			int a = 0;
+			for(int fy = 0; fy < fh; fy++) {
+				for(int fx = 0; fx < fw; fx++) {
+					if(px[fy*ld + fx] > m) {
+						m = px[fy*ld + fx];
+						a = fy*fw + fx;
+					}
+				}
+			}
+			out[i] = m;
+			arg[i] = a;
+		}
+	}
+
+	// the delta of every window to the position of its maximum, zero elsewhere
+	template<typename T, typename I>
+	static void unpoolMaxRow(int n, const T *d, const I *arg, int fw, int fh, T *x, int ld) {
+
+		for(int fy = 0; fy < fh; fy++)
+			memset(x + fy*ld, 0, n*fw*sizeof(T));
+		if(fw*fh > 256) {
+			for(int i = 0; i < n; i++)
+				x[i*fw + arg[i] / fw * ld + arg[i] % fw] = d[i];
+			return;
+		}
+		int off[256];
+		for(int fy = 0; fy < fh; fy++) {
+			for(int fx = 0; fx < fw; fx++)
+				off[fy*fw + fx] = fy*ld + fx;
+		}
+		for(int i = 0; i < n; i++)
+			x[i*fw + off[arg[i]]] = d[i];
+	}
+
+	// mean of every window
+	template<typename T>
+	static void avgPoolRow(int n, const T *x, int ld, int fw, int fh, T *out) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		int i = 0;
+		const T r = (T)1 / (fw * fh);
+		if(fw == 2 && fh == 2) {
+			const T *x1 = x + ld;
+			typename V::reg vr = V::set1(r);
+			for(; i + W < n; i += W) {
+				typename V::reg s = V::add(V::add(V::load2(x + 2*i), V::load2(x + 2*i + 1)),
+					V::add(V::load2(x1 + 2*i), V::load2(x1 + 2*i + 1)));
+				V::store(out + i, V::fmadd(s, vr, V::zero()));
+			}
+		}
+		for(; i < n; i++) {
+			const T *px = x + i*fw;
+			T s = 0;
+			for(int fy = 0; fy < fh; fy++) {
+				for(int fx = 0; fx < fw; fx++)
+					s += px[fy*ld + fx];
+			}
+			out[i] = s * r;
+		}
+	}
+
+	// the delta of every window to all of its units
+	template<typename T>
+	static void unpoolAvgRow(int n, const T *d, int fw, int fh, T *x, int ld) {
+
+		if(fw == 2) {
+			for(int fy = 0; fy < fh; fy++) {
+				T *px = x + fy*ld;
+				for(int i = 0; i < n; i++) {
+					px[2*i] = d[i];
+					px[2*i + 1] = d[i];
+				}
+			}
+			return;
+		}
+		for(int i = 0; i < n; i++) {
+			T *px = x + i*fw;
+			for(int fy = 0; fy < fh; fy++) {
+				for(int fx = 0; fx < fw; fx++)
+					px[fy*ld + fx] = d[i];
+			}
+		}
+	}
+
+	// col[fw*fh, w*h] holds the fw x fh patch of every output pixel of a valid,
+	// stride 1 convolution of the pw wide plane x, row k = fy*fw + fx
+	template<typename T>
+	static void im2col(const T *x, int pw, int w, int h, int fw, int fh, T *col) {
+
+		const int n = w * h;
+		for(int fy = 0; fy < fh; fy++) {
+			for(int fx = 0; fx < fw; fx++, col += n) {
+				const T *px = x + fy*pw + fx;
+				for(int y = 0; y < h; y++) {
+					memcpy(col + y*w, px + y*pw, w*sizeof(T));
+				}
+			}
+		}
+	}
+
+	// adjoint of im2col, accumulates the patches of col into the plane x
+	template<typename T>
+	static void col2im(const T *col, int pw, int w, int h, int fw, int fh, T *x) {
+
+		const int n = w * h;
+		for(int fy = 0; fy < fh; fy++) {
+			for(int fx = 0; fx < fw; fx++, col += n) {
+				T *px = x + fy*pw + fx;
+				for(int y = 0; y < h; y++) {
+					axpy(w, (T)1, col + y*w, 1, px + y*pw);
+				}
+			}
+		}
+	}
+
+	// y[m] = A[m, k] * x[k] of int8 rows and uint8 x in int32
+	static void gemvInt8(int m, int k, const int8_t *A, int lda, const uint8_t *x, int32_t *y) {
+
+		int i = 0;
+#if defined(__AVX512BW__)
+		for(; i + 4 <= m; i += 4) {
+			const int8_t *a0 = A + i*lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+			__m512i s0 = _mm512_setzero_si512(), s1 = s0, s2 = s0, s3 = s0;
+			for(int j = 0; j < k; j += 64) {
+				// the last block is masked, no byte past k is read
+				__mmask64 mk = (j + 64 <= k) ? ~(__mmask64)0 : (((__mmask64)1 << (k - j)) - 1);
+				__m512i xv = _mm512_maskz_loadu_epi8(mk, x + j);
+				s0 = dotInt8(s0, xv, _mm512_maskz_loadu_epi8(mk, a0 + j));
+				s1 = dotInt8(s1, xv, _mm512_maskz_loadu_epi8(mk, a1 + j));
+				s2 = dotInt8(s2, xv, _mm512_maskz_loadu_epi8(mk, a2 + j));
+				s3 = dotInt8(s3, xv, _mm512_maskz_loadu_epi8(mk, a3 + j));
+			}
+			y[i] = _mm512_reduce_add_epi32(s0);
+			y[i+1] = _mm512_reduce_add_epi32(s1);
+			y[i+2] = _mm512_reduce_add_epi32(s2);
+			y[i+3] = _mm512_reduce_add_epi32(s3);
+		}
+		for(; i < m; i++) {
+			const int8_t *a0 = A + i*lda;
+			__m512i s0 = _mm512_setzero_si512();
+			for(int j = 0; j < k; j += 64) {
+				__mmask64 mk = (j + 64 <= k) ? ~(__mmask64)0 : (((__mmask64)1 << (k - j)) - 1);
+				s0 = dotInt8(s0, _mm512_maskz_loadu_epi8(mk, x + j), _mm512_maskz_loadu_epi8(mk, a0 + j));
+			}
+			y[i] = _mm512_reduce_add_epi32(s0);
+		}
+#elif defined(__AVX2__)
+		for(; i + 4 <= m; i += 4) {
+			const int8_t *a0 = A + i*lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+			__m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+			int j = 0;
+			for(; j + 32 <= k; j += 32) {
+				__m256i xv = _mm256_loadu_si256((const __m256i*)(x + j));
+				s0 = dotInt8(s0, xv, _mm256_loadu_si256((const __m256i*)(a0 + j)));
+				s1 = dotInt8(s1, xv, _mm256_loadu_si256((const __m256i*)(a1 + j)));
+				s2 = dotInt8(s2, xv, _mm256_loadu_si256((const __m256i*)(a2 + j)));
+				s3 = dotInt8(s3, xv, _mm256_loadu_si256((const __m256i*)(a3 + j)));
+			}
+			int32_t d0 = sumInt32(s0), d1 = sumInt32(s1), d2 = sumInt32(s2), d3 = sumInt32(s3);
+			for(; j < k; j++) {
+				d0 += a0[j] * x[j];
+				d1 += a1[j] * x[j];
+				d2 += a2[j] * x[j];
+				d3 += a3[j] * x[j];
+			}
+			y[i] = d0;
+			y[i+1] = d1;
+			y[i+2] = d2;
+			y[i+3] = d3;
+		}
+#endif
+		for(; i < m; i++) {
+			const int8_t *a0 = A + i*lda;
+			int32_t d0 = 0;
+			for(int j = 0; j < k; j++)
+				d0 += a0[j] * x[j];
+			y[i] = d0;
+		}
+	}
+
+	// out[m*ldo + i] = sum f[m, fy, fx] * x[fy*ld + i*inc + fx] in int32 for nm filters of fh rows of fw4 int8,
+	// fw4 a multiple of 4 and nm of 8. The 4 taps of a group are packed for 4 outputs per 128-bit lane
+	// by a byte shuffle, up to inc 4, so x must stay readable 64 bytes past the last tap.
+	static void correlateRowInt8(int n, const uint8_t *x, int ld, int inc, const int8_t *f, int fw4, int fh, int nm, int32_t *out, int ldo) {
+
+		const int fs = fh * fw4;
+		int i = 0;
+#if defined(__AVX512BW__) || defined(__AVX2__)
+		if(inc <= 4) {
+			char pt[16];
+			for(int p = 0; p < 4; p++)
+				for(int t = 0; t < 4; t++)
+					pt[p*4 + t] = p*inc + t;
+			__m128i pat = _mm_loadu_si128((const __m128i*)pt);
+#if defined(__AVX512BW__)
+			const __m512i pat4 = _mm512_broadcast_i32x4(pat);
+			for(; i < n; i += 16) {
+				__mmask16 mk = (i + 16 <= n) ? 0xFFFF : (__mmask16)((1 << (n - i)) - 1);
+				for(int m0 = 0; m0 < nm; m0 += 8) {
+					__m512i s[8];
+					for(int mm = 0; mm < 8; mm++)
+						s[mm] = _mm512_setzero_si512();
+					for(int fy = 0; fy < fh; fy++) {
+						for(int g = 0; g < fw4; g += 4) {
+							const uint8_t *p = x + fy*ld + i*inc + g;
+							__m512i b = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)p));
+							b = _mm512_inserti32x4(b, _mm_loadu_si128((const __m128i*)(p + 4*inc)), 1);
+							b = _mm512_inserti32x4(b, _mm_loadu_si128((const __m128i*)(p + 8*inc)), 2);
+							b = _mm512_inserti32x4(b, _mm_loadu_si128((const __m128i*)(p + 12*inc)), 3);
+							b = _mm512_shuffle_epi8(b, pat4);
+							const int8_t *w = f + m0*fs + fy*fw4 + g;
+							for(int mm = 0; mm < 8; mm++) {
+								int32_t wg;
+								memcpy(&wg, w + mm*fs, 4);
+								s[mm] = dotInt8(s[mm], b, _mm512_set1_epi32(wg));
+							}
+						}
+					}
+					for(int mm = 0; mm < 8; mm++)
+						_mm512_mask_storeu_epi32(out + (m0 + mm)*ldo + i, mk, s[mm]);
+				}
+			}
+#else
+			const __m256i pat2 = _mm256_broadcastsi128_si256(pat);
+			for(; i + 8 <= n; i += 8) {
+				for(int m0 = 0; m0 < nm; m0 += 8) {
+					__m256i s[8];
+					for(int mm = 0; mm < 8; mm++)
+						s[mm] = _mm256_setzero_si256();
+					for(int fy = 0; fy < fh; fy++) {
+						for(int g = 0; g < fw4; g += 4) {
+							const uint8_t *p = x + fy*ld + i*inc + g;
+							__m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+								_mm_loadu_si128((const __m128i*)(p + 4*inc)), 1);
+							b = _mm256_shuffle_epi8(b, pat2);
+							const int8_t *w = f + m0*fs + fy*fw4 + g;
+							for(int mm = 0; mm < 8; mm++) {
+								int32_t wg;
+								memcpy(&wg, w + mm*fs, 4);
+								s[mm] = dotInt8(s[mm], b, _mm256_set1_epi32(wg));
+							}
+						}
+					}
+					for(int mm = 0; mm < 8; mm++)
+						_mm256_storeu_si256((__m256i*)(out + (m0 + mm)*ldo + i), s[mm]);
+				}
+			}
+#endif
+		}
+#endif
+		for(; i < n; i++) {
+			for(int m = 0; m < nm; m++) {
+				const int8_t *w = f + m*fs;
+				int32_t d = 0;
+				for(int fy = 0; fy < fh; fy++)
+					for(int fx = 0; fx < fw4; fx++)
+						d += w[fy*fw4 + fx] * x[fy*ld + i*inc + fx];
+				out[m*ldo + i] = d;
+			}
+		}
+	}
+
+protected:
+
+	// mc x kc block of op(A) as MR-row panels, each panel column-major, zero padded
+	template<typename T>
+	static void packA(bool ta, int mc, int kc, const T *A, int lda, int i0, int k0, T *pa) {
+
+		const int MR = nnVec<T>::mr;
+		for(int ir = 0; ir < mc; ir += MR) {
+			const int mr = MIN(MR, mc - ir);
+			for(int p = 0; p < kc; p++, pa += MR) {
+				int r = 0;
+				if(ta) {
+					const T *a = A + (k0 + p)*lda + i0 + ir;
+					for(; r < mr; r++)
+						pa[r] = a[r];
+				}
+				else {
+					const T *a = A + (i0 + ir)*lda + k0 + p;
+					for(; r < mr; r++)
+						pa[r] = a[r*lda];
+				}
+				for(; r < MR; r++)
+					pa[r] = 0;
+			}
+		}
+	}
+
+	// kc x nc panel of op(B) as NR-column panels, each panel row-major, zero padded
+	template<typename T>
+	static void packB(bool tb, int kc, int nc, const T *B, int ldb, int k0, int j0, T *pb) {
+
+		const int NR = nnVec<T>::nr;
+		for(int jr = 0; jr < nc; jr += NR) {
+			const int nr = MIN(NR, nc - jr);
+			for(int p = 0; p < kc; p++, pb += NR) {
+				int s = 0;
+				if(tb) {
+					const T *b = B + (j0 + jr)*ldb + k0 + p;
+					for(; s < nr; s++)
+						pb[s] = b[s*ldb];
+				}
+				else {
+					const T *b = B + (k0 + p)*ldb + j0 + jr;
+					for(; s < nr; s++)
+						pb[s] = b[s];
+				}
+				for(; s < NR; s++)
+					pb[s] = 0;
+			}
+		}
+	}
+
+	template<typename T, int H>
+	static inline typename nnVec<T>::reg loadWiden(const uint16_t *p) {
+		return (H == nnHalf::BF16) ? nnVec<T>::loadb(p) : nnVec<T>::loadh(p);
+	}
+
+	// gemv with the rows of A widened from H, 4 rows share every load of x
+	template<typename T, int H>
+	static void gemvWiden(int m, int n, const uint16_t *A, int lda, const T *x, T *y) {
+
+		typedef nnVec<T> V;
+		const int W = V::width;
+
+		for(int jb = 0; jb < n; jb += GEMV_BLOCK) {
+			const int je = MIN(n, jb + GEMV_BLOCK);
+
+			int i = 0;
+			for(; i + 4 <= m; i += 4) {
+				const uint16_t *a0 = A + i*lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+				typename V::reg s0 = V::zero(), s1 = V::zero(), s2 = V::zero(), s3 = V::zero();
+				int j = jb;
+				for(; j + W <= je; j += W) {
+					typename V::reg x0 = V::load(x + j);
+					s0 = V::fmadd(loadWiden<T, H>(a0 + j), x0, s0);
+					s1 = V::fmadd(loadWiden<T, H>(a1 + j), x0, s1);
+					s2 = V::fmadd(loadWiden<T, H>(a2 + j), x0, s2);
+					s3 = V::fmadd(loadWiden<T, H>(a3 + j), x0, s3);
+				}
+				T d0 = V::sum(s0), d1 = V::sum(s1), d2 = V::sum(s2), d3 = V::sum(s3);
+				for(; j < je; j++) {
+					d0 += nnHalf::toFloat(a0[j], H) * x[j];
+					d1 += nnHalf::toFloat(a1[j], H) * x[j];
+					d2 += nnHalf::toFloat(a2[j], H) * x[j];
+					d3 += nnHalf::toFloat(a3[j], H) * x[j];
+				}
+				y[i] += d0;
+				y[i+1] += d1;
+				y[i+2] += d2;
+				y[i+3] += d3;
+			}
+			for(; i < m; i++) {
+				const uint16_t *a0 = A + i*lda;
+				typename V::reg s0 = V::zero();
+				int j = jb;
+				for(; j + W <= je; j += W)
+					s0 = V::fmadd(loadWiden<T, H>(a0 + j), V::load(x + j), s0);
+				T d0 = V::sum(s0);
+				for(; j < je; j++)
+					d0 += nnHalf::toFloat(a0[j], H) * x[j];
+				y[i] += d0;
+			}
+		}
+	}
+
+#if defined(__AVX512BW__)
+	// lane t of s += sum of the 4 products of the unsigned bytes 4t..4t+3 of x and the signed ones of a,
+	// without VNNI from even and odd bytes widened to 16 bits
+	static inline __m512i dotInt8(__m512i s, __m512i x, __m512i a) {
+#ifdef __AVX512VNNI__
+		return _mm512_dpbusd_epi32(s, x, a);
+#else
+		__m512i xe = _mm512_and_si512(x, _mm512_set1_epi16(0xFF)), xo = _mm512_srli_epi16(x, 8);
+		__m512i ae = _mm512_srai_epi16(_mm512_slli_epi16(a, 8), 8), ao = _mm512_srai_epi16(a, 8);
+		return _mm512_add_epi32(s, _mm512_add_epi32(_mm512_madd_epi16(xe, ae), _mm512_madd_epi16(xo, ao)));
+#endif
+	}
+#elif defined(__AVX2__)
+	static inline __m256i dotInt8(__m256i s, __m256i x, __m256i a) {
+#ifdef __AVXVNNI__
+		return _mm256_dpbusd_avx_epi32(s, x, a);
+#else
+		__m256i xe = _mm256_and_si256(x, _mm256_set1_epi16(0xFF)), xo = _mm256_srli_epi16(x, 8);
+		__m256i ae = _mm256_srai_epi16(_mm256_slli_epi16(a, 8), 8), ao = _mm256_srai_epi16(a, 8);
+		return _mm256_add_epi32(s, _mm256_add_epi32(_mm256_madd_epi16(xe, ae), _mm256_madd_epi16(xo, ao)));
+#endif
+	}
+	static inline int32_t sumInt32(__m256i s) {
+		__m128i t = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+		t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0x4E));
+		t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0xB1));
+		return _mm_cvtsi128_si32(t);
+	}
+#endif
+
+	// C[MR, NR] += pa[MR, kc] * pb[kc, NR], accumulated in registers
+	template<typename T>
+	static inline void microKernel(int kc, const T *pa, const T *pb, T *C, int ldc) {
+
+		typedef nnVec<T> V;
+		enum { MR = V::mr, NV = V::nr / V::width, W = V::width };
+
+		typename V::reg c[MR][NV];
+		for(int r = 0; r < MR; r++)
+			for(int v = 0; v < NV; v++)
+				c[r][v] = V::zero();
+
+		for(int p = 0; p < kc; p++, pa += MR, pb += V::nr) {
+			typename V::reg b[NV];
+			for(int v = 0; v < NV; v++)
+				b[v] = V::load(pb + v*W);
+			for(int r = 0; r < MR; r++) {
+				typename V::reg a = V::set1(pa[r]);
+				for(int v = 0; v < NV; v++)
+					c[r][v] = V::fmadd(a, b[v], c[r][v]);
+			}
+		}
+
+		for(int r = 0; r < MR; r++)
+			for(int v = 0; v < NV; v++)
+				V::store(C + r*ldc + v*W, V::add(V::load(C + r*ldc + v*W), c[r][v]));
+	}
+};
+
+#endif
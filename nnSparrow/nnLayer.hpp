@@ -31,8 +31,12 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cfloat>
+#include <map>
 
 #include "nnActivation.hpp"
+#include "nnKernel.hpp"
+#include "nnArena.hpp"
+#include "nnThreadPool.hpp"
 
 #ifndef __NN_LAYER__
 #define __NN_LAYER__
@@ -46,11 +50,35 @@ protected:
 	nnLayer* _prev;
 	nnLayer* _next;
 
-	double* _u_a;
-	double* _u_delta;
-	double* _u_W;
-	double* _u_b;
+	nnreal* _u_a;
+	nnreal* _u_delta;
+	nnreal* _u_W;
+	nnreal* _u_b;
 
+	// weights as 16 bit of nnHalf type _weight_storage for inference, in place of the nnreal ones
+	uint16_t* _u_Wh;
+	int _weight_storage;
+
+	// 0 for the weights removed by prune(), NULL if the layer was not pruned
+	unsigned char* _u_mask;
+
+	// _u_a and _u_delta are slices of another layer's buffers, see shareBatch()
+	bool _shared_batch;
+
+	// arena of the network holding some of the buffers, see appendBuffers()
+	nnArena* _arena;
+
+	// false runs forward only: no deltas, gradients or velocities are kept, see setTrainable()
+	bool _trainable;
+
+	// the layer whose weights this copy runs on, see replicate()
+	nnLayer* _master;
+	// other copies update the weights at the same time, see setRacing()
+	bool _racing;
+
+	// threads of the network the layer splits its own work over, NULL keeps it serial, see parallelRange()
+	nnThreadPool* _pool;
+	long _parallel_threshold;
 
 	int _unit_count;
 	int _prev_unit_count;
@@ -59,6 +87,10 @@ protected:
 	int _map_num;
 	int _layer_type;
 
+	// per-sample buffers hold _batch_size samples, _batch_count of them are in use
+	int _batch_size;
+	int _batch_count;
+
 	activation _act_f;
 	activation _d_act_f;
 public:
@@ -85,25 +117,164 @@ public:
 		_prev_unit_count = 0;
 		_map_num = 0;
 		_layer_type = DEFAULT_LAYER;
+		_batch_size = 1;
+		_batch_count = 1;
 
 		_u_a = NULL;
 		_u_delta = NULL;
 		_u_W = NULL;
 		_u_b = NULL;
+		_u_Wh = NULL;
+		_weight_storage = nnHalf::NONE;
+		_u_mask = NULL;
+		_shared_batch = false;
+		_arena = NULL;
+		_trainable = true;
+		_master = NULL;
+		_racing = false;
+		_pool = NULL;
+		_parallel_threshold = 0;
 	}
-	~nnLayer() {
+	virtual ~nnLayer() {
 		clear();
 	}
 
+	// delete [] a buffer, unless it lives in the arena
+	template<typename T>
+	void release(T *p) {
+		if(p && !(_arena && _arena->contains(p)))
+			delete [] p;
+	}
+
+	// record the buffers to move into a network arena: activations and deltas here, the layers add
+	// their weights, gradients and velocities. Scratch buffers stay on the heap.
+	virtual void appendBuffers(nnArena &arena) {
+		if(!_shared_batch) {
+			long n = (long)getTotalUnitCount() * _batch_size;
+			arena.add(&_u_a, n);
+			arena.add(&_u_delta, n);
+		}
+	}
+	void setArena(nnArena *arena) {
+		_arena = arena;
+	}
+
 	void clear() {
-		if(_u_a)
-			delete [] _u_a;
-		if(_u_delta)
-			delete [] _u_delta;
-		if(_u_W)
-			delete [] _u_W;
-		if(_u_b)
-			delete [] _u_b;
+		releaseBatch();
+		if(_u_W) {
+			release(_u_W);
+			_u_W = NULL;
+		}
+		if(_u_b) {
+			release(_u_b);
+			_u_b = NULL;
+		}
+		if(_u_Wh) {
+			release(_u_Wh);
+			_u_Wh = NULL;
+		}
+		_weight_storage = nnHalf::NONE;
+		if(_u_mask) {
+			release(_u_mask);
+			_u_mask = NULL;
+		}
+	}
+
+	// zero the n weights w below threshold, with their momentum v, and keep them masked out
+	void pruneWeights(nnreal *w, nnreal *v, int n, double threshold) {
+		if(!_u_mask) {
+			_u_mask = new unsigned char[n];
+			memset(_u_mask, 1, n);
+		}
+		for(int i = 0; i < n; i++) {
+			if(fabs(w[i]) < threshold)
+				_u_mask[i] = 0;
+		}
+		applyMask(w, v, n);
+	}
+	void applyMask(nnreal *w, nnreal *v, int n) {
+		applyMask(w, v, 0, n);
+	}
+	// the weights [b, e) only
+	void applyMask(nnreal *w, nnreal *v, int b, int e) {
+		if(!_u_mask)
+			return;
+		nnreal z = 0;
+		for(int i = b; i < e; i++) {
+			if(!_u_mask[i]) {
+				if(_racing)
+					__atomic_store(w + i, &z, __ATOMIC_RELAXED);
+				else
+					w[i] = 0;
+				if(v)
+					v[i] = 0;
+			}
+		}
+	}
+
+	// momentum step on the weights [b, e): v = mu v + alpha (rm g + lambda w), w -= v, g = 0.
+	// A racing copy loads and stores w by relaxed atomics.
+	void momentumStep(nnreal *w, nnreal *v, nnreal *g, long b, long e, double alpha, double rm, double lambda, double mu) {
+		if(!_racing) {
+			for(long i = b; i < e; i++) {
+				v[i] = v[i] * mu + alpha * (rm * g[i] + lambda * w[i]);
+				w[i] -= v[i];
+				g[i] = 0;
+			}
+			return;
+		}
+		for(long i = b; i < e; i++) {
+			nnreal x;
+			__atomic_load(w + i, &x, __ATOMIC_RELAXED);
+			v[i] = v[i] * mu + alpha * (rm * g[i] + lambda * x);
+			x -= v[i];
+			__atomic_store(w + i, &x, __ATOMIC_RELAXED);
+			g[i] = 0;
+		}
+	}
+
+	// allocate activations and, if trainable, deltas for _batch_size samples,
+	// sample b starts at b * getTotalUnitCount()
+	virtual void initBatch() {
+
+		int n = getTotalUnitCount() * _batch_size;
+
+		releaseBatch();
+		_u_a = new nnreal[n];
+		memset(_u_a, 0, n*sizeof(nnreal));
+
+		if(_trainable) {
+			_u_delta = new nnreal[n];
+			memset(_u_delta, 0, n*sizeof(nnreal));
+		}
+	}
+
+	// work in a and delta, owned by another layer, until the next initBatch(). They must hold
+	// getTotalUnitCount() units for every sample of the batch counts the layer is used with.
+	void shareBatch(nnreal *a, nnreal *delta) {
+		releaseBatch();
+		_u_a = a;
+		_u_delta = delta;
+		_shared_batch = true;
+	}
+	// activation buffer a planner may place, 0 if the layer works in another layer's buffer
+	virtual long getActivationSize() {
+		return _shared_batch ? 0 : (long)getTotalUnitCount() * _batch_size;
+	}
+	// work in a, owned by the planner, as the activation buffer of a layer that is not trainable
+	virtual void placeActivation(nnreal *a) {
+		shareBatch(a, NULL);
+	}
+	void releaseBatch() {
+		if(!_shared_batch) {
+			if(_u_a)
+				release(_u_a);
+			if(_u_delta)
+				release(_u_delta);
+		}
+		_u_a = NULL;
+		_u_delta = NULL;
+		_shared_batch = false;
 	}
 
 	virtual void write(std::ofstream &fout) = 0;
@@ -112,6 +283,74 @@ public:
 	nnLayer *getPrevLayer() {
 		return _prev;
 	}
+	// layers whose activations forward() reads
+	virtual void appendInputLayers(std::vector<nnLayer*> &in) {
+		if(_prev)
+			in.push_back(_prev);
+	}
+
+	// units j0 .. j0 + n - 1 of the samples of a batch, sample b at a + b*ld and, if d is not NULL, d + b*ld
+	struct Block {
+		int j0, n, ld;
+		nnreal *a, *d;
+	};
+	// the activations and deltas of the batch as blocks of units: the sample-major buffers as one block,
+	// unless the layer lays them out otherwise for a next layer that readsBlocks(), see nnJointLayer
+	virtual void getBlocks(std::vector<Block> &blocks) {
+		int n = getTotalUnitCount();
+		Block k = {0, n, n, _u_a, _u_delta};
+		blocks.assign(1, k);
+	}
+	// true if forward() and backpropagation() reach the batch of the previous layer by getBlocks()
+	virtual bool readsBlocks() {
+		return false;
+	}
+
+	// a copy for a context of the network, see nnSparrow::createContext(): it reads the weights of this
+	// layer, never changing or freeing them, and keeps its own activations and scratch buffers. relink()
+	// points it to the copies of its neighbours and initBatch() sets it up.
+	virtual nnLayer *replicate() = 0;
+	virtual void relink(std::map<nnLayer*, nnLayer*> &copies) {
+		_prev = _prev ? copies[_prev] : NULL;
+		_next = _next ? copies[_next] : NULL;
+	}
+	// drop the pointers to the weights of the master before the copy is deleted
+	virtual void detachWeights() {
+		_u_W = _u_b = NULL;
+		_u_Wh = NULL;
+		_u_mask = NULL;
+	}
+	nnLayer *getMaster() {
+		return _master;
+	}
+	// the gradient buffers backpropagation() adds to and updateParameters() clears, with their sizes
+	virtual void appendGradients(std::vector<std::pair<nnreal*, long> > &g) {
+	}
+	// another copy of the layer changed the weights: what was derived from them is redone
+	virtual void weightsChanged() {
+		clearSparse();
+	}
+	// updateParameters() of a copy that other threads update the same weights with meanwhile, see
+	// nnSparrow::setHogwild(): it loads and stores them by relaxed atomics, the products of forward()
+	// and backpropagation() still read them with plain loads
+	void setRacing(bool r) {
+		_racing = r;
+	}
+	// forward(), backpropagation() and updateParameters() split loops of at least twice threshold
+	// multiply-adds over pool, each thread taking threshold or more; NULL runs them on the calling thread
+	void setThreadPool(nnThreadPool *pool, long threshold) {
+		_pool = pool;
+		_parallel_threshold = threshold;
+	}
+	// weights of the layer, the elements updateParameters() runs over
+	long getParameterCount() {
+		std::vector<std::pair<nnreal*, long> > g;
+		appendGradients(g);
+		long n = 0;
+		for(int i = 0; i < g.size(); i++)
+			n += g[i].second;
+		return n;
+	}
 	nnLayer *getNextLayer() {
 		return _next;
 	}
@@ -131,17 +370,32 @@ public:
 	int getMapNum() {
 		return _map_num;
 	}
+	int getLayerType() {
+		return _layer_type;
+	}
 
 	int getUnitCount() {
 		return _unit_count;
 	}
 
-	double* getActivation() {
+	int getBatchCount() {
+		return _batch_count;
+	}
+	// number of samples of the next forward/backpropagation, grows the buffers if needed
+	virtual void setBatchCount(int b) {
+		if(b > _batch_size) {
+			_batch_size = b;
+			initBatch();
+		}
+		_batch_count = b;
+	}
+
+	nnreal* getActivation() {
 		return _u_a;
 	}
 
 
-	double* getDelta() {
+	nnreal* getDelta() {
 		return _u_delta;
 	}
 
@@ -154,13 +408,103 @@ public:
 	virtual void updateParameters(int,double,double,double) = 0;
 	virtual int getTotalUnitCount() = 0;
 
-	void setDelta(double *a, int n) {
+	void setDelta(nnreal *a, int n) {
 
-		memcpy(_u_delta, a, sizeof(double)*n);
+		memcpy(_u_delta, a, sizeof(nnreal)*n);
 	}
-	double* getWeights() {
+	nnreal* getWeights() {
 		return _u_W;
 	}
+	nnreal* getBias() {
+		return _u_b;
+	}
+
+	// nnHalf::FP16 or BF16 keep the weights in 16 bit, widened in the forward kernels; nnHalf::NONE widens
+	// them back for training. Layers without weights ignore it.
+	virtual void setWeightStorage(int type) {
+	}
+	int getWeightStorage() {
+		return _weight_storage;
+	}
+
+	// zeroed gradients and velocities of the weights, set up by init() of trainable layers
+	virtual void initTraining() {
+	}
+	virtual void clearTraining() {
+	}
+	// false frees the deltas, gradients and velocities, leaving forward() only; true brings them back
+	// zeroed. Layers not set up yet only take the flag. The activations are reallocated.
+	void setTrainable(bool t) {
+		if(t == _trainable)
+			return;
+		_trainable = t;
+		if(!_u_a)
+			return;
+		if(t)
+			initTraining();
+		else
+			clearTraining();
+		initBatch();
+	}
+	bool isTrainable() {
+		return _trainable;
+	}
+
+	// magnitude pruning, see nnSparrow::prune(); layers without weights ignore it
+	virtual void appendWeightMagnitudes(std::vector<nnreal> &m) {
+	}
+	virtual void prune(double threshold) {
+	}
+	// run forward on a CSR copy of the weights if their density is below nnKernel::sparseBreakEven()
+	virtual void updateSparse() {
+	}
+	// forward() runs on the dense weights until updateSparse()
+	virtual void clearSparse() {
+	}
+	virtual bool isSparse() {
+		return false;
+	}
+
+protected:
+	// replicate() of a layer class L
+	template<typename L>
+	static nnLayer *copyOf(L *src) {
+		L *l = new L(*src);
+		((nnLayer*)l)->detachCopy(src);
+		return l;
+	}
+	// f(b, e) over [0, n) of cost multiply-adds per item, in contiguous ranges split among the threads
+	// of the pool when there is enough work. The ranges start at multiples of align, so kernels that
+	// treat blocks of rows or lanes together give the same results however the items are split.
+	template<typename F>
+	void parallelRange(int n, long cost, F f, int align = 1) {
+		int blocks = (n + align - 1) / align;
+		long parts = 1;
+		if(_pool && _parallel_threshold > 0)
+			parts = MIN((long)MIN(_pool->getThreadCount(), blocks), (long)n * cost / _parallel_threshold);
+		if(parts <= 1) {
+			if(n > 0)
+				f(0, n);
+			return;
+		}
+		_pool->parallelFor(parts, [&](int p) {
+			f(MIN(n, (int)(blocks * p / parts) * align), MIN(n, (int)(blocks * (p + 1) / parts) * align));
+		});
+	}
+
+	// a member-wise copy of src lets go of every buffer but the weights, the layers null their own
+	virtual void detachCopy(nnLayer *src) {
+		_master = src;
+		_racing = false;
+		_pool = NULL;
+		_arena = NULL;
+		_u_a = NULL;
+		_u_delta = NULL;
+		_shared_batch = false;
+		_trainable = false;
+		_batch_size = 1;
+		_batch_count = 1;
+	}
 };
 
 
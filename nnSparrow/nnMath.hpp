@@ -0,0 +1,258 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+
+#include "nnKernel.hpp"
+
+#ifndef __NN_MATH__
+#define __NN_MATH__
+
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+
+// Vectorized exp, log1p and the activations built on them, over arrays of float or double.
+//	exp:	x = n ln2 + r, |r| <= ln2/2, e^x = 2^n p(r) with p the Taylor polynomial of e^r
+//	log1p:	u in [0, 1], log(1 + u) = 2 atanh(s), |s| <= 3 - 2 sqrt(2), after halving 1 + u above sqrt(2)
+// The accuracy decides the polynomial degrees. EXACT goes through libm.
+class nnMath {
+
+public:
+	enum ACCURACY {
+		EXACT = 0,	// libm
+		HIGH = 1,	// within a few ulp of libm
+		FAST = 2	// relative error about 1e-7 in double, 1e-6 in float
+	};
+
+	static int getAccuracy() {
+		return accuracy();
+	}
+	static void setAccuracy(int acc) {
+		accuracy() = acc;
+	}
+
+protected:
+	static int &accuracy() {
+		static int acc = HIGH;
+		return acc;
+	}
+
+	// exp clamp that keeps 2^n a normal number, ln2 split in a short high part and the rest,
+	// exp degree and atanh terms of each accuracy
+	template<typename T, int ACC>
+	struct param {
+		static T clamp() { return 708.0; }
+		static T ln2hi() { return 6.93147180369123816490e-01; }
+		static T ln2lo() { return 1.90821492927058770002e-10; }
+		enum { exp = (ACC == FAST) ? 6 : 13, log = (ACC == FAST) ? 4 : 10 };
+	};
+	template<int ACC>
+	struct param<float, ACC> {
+		static float clamp() { return 87.0f; }
+		static float ln2hi() { return 0.693359375f; }
+		static float ln2lo() { return -2.12194440e-4f; }
+		enum { exp = (ACC == FAST) ? 5 : 7, log = (ACC == FAST) ? 3 : 5 };
+	};
+
+	// x = n ln2 + r, returns q = e^r - 1 and n
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg expq(typename nnVec<T>::reg x, typename nnVec<T>::reg &n) {
+
+		typedef nnVec<T> V;
+		typedef param<T, ACC> P;
+		static const double c[] = {1.0, 1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040,
+			1.0/40320, 1.0/362880, 1.0/3628800, 1.0/39916800, 1.0/479001600, 1.0/6227020800.0};
+
+		x = V::max(V::min(x, V::set1(P::clamp())), V::set1(-P::clamp()));
+		n = V::round(V::mul(x, V::set1(1.4426950408889634074)));
+		typename V::reg r = V::fmadd(n, V::set1(-P::ln2hi()), x);
+		r = V::fmadd(n, V::set1(-P::ln2lo()), r);
+		typename V::reg p = V::set1(c[P::exp]);
+		for(int k = P::exp - 1; k >= 1; k--)
+			p = V::fmadd(p, r, V::set1(c[k]));
+		return V::mul(p, r);
+	}
+
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg expv(typename nnVec<T>::reg x) {
+		typedef nnVec<T> V;
+		typename V::reg n, q = expq<T, ACC>(x, n);
+		return V::scale2(V::add(q, V::set1(1.0)), n);
+	}
+
+	// 2^n (1 + q) - 1, exact in q when n = 0
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg expm1v(typename nnVec<T>::reg x) {
+		typedef nnVec<T> V;
+		typename V::reg n, q = expq<T, ACC>(x, n);
+		typename V::reg s = V::scale2(V::set1(1.0), n);
+		return V::fmadd(s, q, V::sub(s, V::set1(1.0)));
+	}
+
+	// log(1 + u), u in [0, 1]
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg log1pv(typename nnVec<T>::reg u) {
+
+		typedef nnVec<T> V;
+		const int L = param<T, ACC>::log;
+
+		typename V::mask big = V::gt(u, V::set1(0.41421356237309504880));
+		typename V::reg one = V::set1(1.0);
+		typename V::reg num = V::blend(big, u, V::sub(u, one));
+		typename V::reg den = V::blend(big, V::add(u, V::set1(2.0)), V::add(u, V::set1(3.0)));
+		typename V::reg s = V::div(num, den), z = V::mul(s, s);
+		typename V::reg q = V::set1(1.0 / (2*L - 1));
+		for(int k = L - 2; k >= 0; k--)
+			q = V::fmadd(q, z, V::set1(1.0 / (2*k + 1)));
+		q = V::mul(V::add(s, s), q);
+		return V::add(q, V::blend(big, V::zero(), V::set1(0.69314718055994530942)));
+	}
+
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg sigmoidv(typename nnVec<T>::reg x) {
+		typedef nnVec<T> V;
+		typename V::reg one = V::set1(1.0);
+		return V::div(one, V::add(expv<T, ACC>(V::sub(V::zero(), x)), one));
+	}
+
+	// -e / (2 + e), e = expm1(-2|x|), sign of x
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg tanhv(typename nnVec<T>::reg x) {
+		typedef nnVec<T> V;
+		typename V::mask neg = V::gt(V::zero(), x);
+		typename V::reg ax = V::blend(neg, x, V::sub(V::zero(), x));
+		typename V::reg e = expm1v<T, ACC>(V::mul(ax, V::set1(-2.0)));
+		typename V::reg t = V::div(V::sub(V::zero(), e), V::add(e, V::set1(2.0)));
+		return V::blend(neg, t, V::sub(V::zero(), t));
+	}
+
+	// max(x, 0) + log(1 + exp(-|x|))
+	template<typename T, int ACC>
+	static inline typename nnVec<T>::reg softplusv(typename nnVec<T>::reg x) {
+		typedef nnVec<T> V;
+		typename V::reg ax = V::max(x, V::sub(V::zero(), x));
+		return V::add(V::max(x, V::zero()), log1pv<T, ACC>(expv<T, ACC>(V::sub(V::zero(), ax))));
+	}
+
+	// f over a[n], the tail through a padded register
+	template<typename T, typename nnVec<T>::reg (*f)(typename nnVec<T>::reg)>
+	static inline void apply(T *a, int n) {
+		typedef nnVec<T> V;
+		const int W = V::width;
+		int i = 0;
+		for(; i + W <= n; i += W)
+			V::store(a + i, f(V::load(a + i)));
+		if(i < n) {
+			T t[W];
+			for(int k = 0; k < W; k++)
+				t[k] = (i + k < n) ? a[i + k] : 0;
+			V::store(t, f(V::load(t)));
+			for(int k = 0; i + k < n; k++)
+				a[i + k] = t[k];
+		}
+	}
+
+public:
+	template<typename T>
+	static void exp(T *a, int n) {
+		switch(accuracy()) {
+		case FAST:
+			apply<T, expv<T, FAST> >(a, n);
+			break;
+		case HIGH:
+			apply<T, expv<T, HIGH> >(a, n);
+			break;
+		default:
+			for(int i = 0; i < n; i++)
+				a[i] = std::exp(a[i]);
+		}
+	}
+
+	// u in [0, 1]
+	template<typename T>
+	static void log1p(T *a, int n) {
+		switch(accuracy()) {
+		case FAST:
+			apply<T, log1pv<T, FAST> >(a, n);
+			break;
+		case HIGH:
+			apply<T, log1pv<T, HIGH> >(a, n);
+			break;
+		default:
+			for(int i = 0; i < n; i++)
+				a[i] = std::log1p(a[i]);
+		}
+	}
+
+	template<typename T>
+	static void sigmoid(T *a, int n) {
+		switch(accuracy()) {
+		case FAST:
+			apply<T, sigmoidv<T, FAST> >(a, n);
+			break;
+		case HIGH:
+			apply<T, sigmoidv<T, HIGH> >(a, n);
+			break;
+		default:
+			for(int i = 0; i < n; i++)
+				a[i] = 1 / (std::exp(-a[i]) + 1);
+		}
+	}
+
+	template<typename T>
+	static void tanh(T *a, int n) {
+		switch(accuracy()) {
+		case FAST:
+			apply<T, tanhv<T, FAST> >(a, n);
+			break;
+		case HIGH:
+			apply<T, tanhv<T, HIGH> >(a, n);
+			break;
+		default:
+			for(int i = 0; i < n; i++)
+				a[i] = std::tanh(a[i]);
+		}
+	}
+
+	template<typename T>
+	static void softplus(T *a, int n) {
+		switch(accuracy()) {
+		case FAST:
+			apply<T, softplusv<T, FAST> >(a, n);
+			break;
+		case HIGH:
+			apply<T, softplusv<T, HIGH> >(a, n);
+			break;
+		default:
+			for(int i = 0; i < n; i++)
+				a[i] = MAX(a[i], 0) + std::log1p(std::exp(-std::fabs(a[i])));
+		}
+	}
+};
+
+#endif
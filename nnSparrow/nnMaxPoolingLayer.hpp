@@ -34,20 +34,18 @@
 class nnMaxPoolingLayer : public nnLayer {
 
 private:
-	int* _u_joint;
+	//offset fy*fw + fx of the maximum inside the window of every output,
+	//a byte each for windows of up to 256 units, an int for larger ones
+	unsigned char* _u_argmax;
 	int _filter_width;
 	int _filter_height;
-	bool *_u_cW;
-	int* _u_W_idx;
 
 public:
 	nnMaxPoolingLayer(nnLayer *prev = NULL) : nnLayer(prev, NULL) {
 
 		_filter_width = 0;
 		_filter_height = 0;
-		_u_joint = NULL;
-		_u_cW = NULL;
-		_u_W_idx = NULL;
+		_u_argmax = NULL;
 		_layer_type = MAX_POOLING_LAYER;
 
 	}
@@ -74,156 +72,56 @@ public:
 		this->_prev_unit_count = prev ? prev->getUnitCount() : 0;
 		this->_layer_type = MAX_POOLING_LAYER;
 
-		_u_joint = NULL;
-		_u_cW = NULL;
-		_u_W_idx = NULL;
+		_u_argmax = NULL;
 	}
 	~nnMaxPoolingLayer() {
 
-		if(_u_joint)
-			delete [] _u_joint;
-		if(_u_cW)
-			delete [] _u_cW;
-		if(_u_W_idx)
-			delete [] _u_W_idx;
+		if(_u_argmax)
+			release(_u_argmax);
+	}
+
+	int getFilterWidth() {
+		return _filter_width;
+	}
+	int getFilterHeight() {
+		return _filter_height;
 	}
 
 	void init() {
 		clear();
-		int n = _unit_count, np = _prev_unit_count, nm = _map_num;
-
-		// _u_cW = new bool[n*np];
-		// memset(_u_cW, 0, sizeof(bool)*n*np);
-
-		_u_a = new double[n*nm];
-		memset(_u_a, 0, sizeof(double)*n*nm);
-
-		_u_delta = new double[n*nm];
-		memset(_u_delta, 0, sizeof(double)*n*nm);
-
-		_u_joint = new int[n*nm];
-		memset(_u_joint, 0, sizeof(int)*n*nm);
-
-		_u_W_idx = new int[n*_filter_height*2];
-		memset(_u_W_idx, -1, sizeof(int)*n*_filter_height*2);
-
-
-		mapFilterToWeights();
-
+		initBatch();
 	}
 
 
-	void mapFilterToWeights() {
-
-		if(!_prev)
-			return;
-
-
-		int pw = _prev->getWidth();
-		int ph = _prev->getHeight();
-		int fw = _filter_width;
-		int fh = _filter_height;
-		int n = _unit_count, np = _prev_unit_count;
+	void initBatch() {
 
-		int wn = fh * 2;
+		int n = _unit_count * _map_num * _batch_size;
+		nnLayer::initBatch();
 
-		int step = 0;
-		for(int i = 0; i < n; i++) {
-			for(int j = 0; j < fh * pw; j += pw) {
-				if(step + j >= pw * ph)
-					break;
-
-				int lu = MIN(fw, (step/pw + 1)*pw-step);
-
-				_u_W_idx[i*wn + 2*j/pw + 0] = step + j + 0;
-				_u_W_idx[i*wn + 2*j/pw + 1] = step + j + lu;
-
-				// for(int k = 0; k < lu; k++) {
-				// 	_u_cW[i*np + step+j + k] = true;
-				// }
-			}
-			if(step % pw + fw >= pw)
-				step = (step / pw + fh) * pw;
-			else
-				step += fw;
-		}
+		if(_u_argmax)
+			release(_u_argmax);
+		n *= wideArgmax() ? sizeof(int) : 1;
+		_u_argmax = new unsigned char[n];
+		memset(_u_argmax, 0, n);
 	}
 
 	void forward() {
 
-		const int n = _unit_count, np = _prev_unit_count, nm = _map_num;
-		const int pw = _prev->getWidth();
-		const int fw = _filter_width;
-		const int fh = _filter_height;
-
-		double *ppa = _prev->getActivation();
-		double *pa = _u_a;
-		int *pjt = _u_joint;
-
-		int wn = fh * 2;
-
-		for(int mi = 0; mi < nm; mi++, ppa += np) {
-
-			int *pidx = _u_W_idx;
-			//int step = 0, h = 0;
-			for(int i = 0; i < n; i++, pa++, pjt++, pidx+=wn) {//, h++, step+=fw) {
-
-				// if(h >= _width) {
-				// 	step = ((step-fw) / pw + fh) * pw;
-				// 	h = 0;
-				// }
-				// int klen = MIN( fw, (pw - (step % pw)) );
-				// int mx = -1;
-				// double mxv = DBL_MIN;
-				// for(int j = 0; j < fh*pw; j += pw) {
-				// 	if(step + j >= np)
-				// 		break;
-				// 	for(int k = 0; k < klen; k++) {
-				// 		if(mx < 0 || *(ppa + step + j + k) > mxv) {
-				// 		 		mxv = *(ppa + step + j + k);
-				// 		 		mx = step + j + k;
-				// 		}
-				// 	}
-				// }
-
-				int mx = -1;
-				double mxv = DBL_MIN;
-				for(int j = 0; j < wn; j += 2) {
-					int st = *(pidx + j + 0);
-					if(st < 0)
-						break;
-					int ed = *(pidx + j + 1);
-					for(int k = st; k < ed; k++) {
-						if(mx < 0 || *(ppa + k) > mxv) {
-							mxv = *(ppa + k);
-							mx = k;
-						}
-					}
-				}
-				*pa = mxv;
-				*pjt = mx;
-			}
-
-		}
+		if(wideArgmax())
+			forwardMaps((int*)_u_argmax);
+		else
+			forwardMaps(_u_argmax);
 	}
 
 	void backpropagation() {
 
-		double *ppd = _prev->getDelta();
-		const int n = _unit_count, np = _prev_unit_count, nm = _map_num;
-
-		if(ppd) {
-			memset(ppd, 0, sizeof(double)*_prev->getTotalUnitCount());
-			double *pd = _u_delta;
-			int *pjt = _u_joint;
-
-			for(int mi = 0; mi < nm; mi++, pd += n, ppd += np, pjt += n) {
-				for(int i = 0; i < n; i++) {
-					*(ppd + *(pjt + i)) = *(pd + i);
-				}
-			}
-			_prev->updateDelta();
-		}
+		if(!_prev->getDelta())
+			return;
+		if(wideArgmax())
+			backpropagateMaps((int*)_u_argmax);
+		else
+			backpropagateMaps(_u_argmax);
+		_prev->updateDelta();
 	}
 
 	void updateDelta() {
@@ -238,17 +136,9 @@ public:
 
 	void clear() {
 		nnLayer::clear();
-		if(_u_cW) {
-			delete [] _u_cW;
-			_u_cW = NULL;
-		}
-		if(_u_joint) {
-			delete [] _u_joint;
-			_u_joint = NULL;
-		}
-		if(_u_W_idx) {
-			delete [] _u_W_idx;
-			_u_W_idx = NULL;
+		if(_u_argmax) {
+			release(_u_argmax);
+			_u_argmax = NULL;
 		}
 	}
 	void write(std::ofstream &fout) {
@@ -265,6 +155,81 @@ public:
 		fin >> _width >> _height >> _map_num;
 		init();
 	}
+
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
+
+protected:
+	bool wideArgmax() {
+		return _filter_width * _filter_height > 256;
+	}
+
+	template<typename I>
+	void forwardMaps(I *argmax) {
+
+		const int n = _unit_count, np = _prev_unit_count, nm = _map_num * _batch_count;
+		const int pw = _prev->getWidth();
+		const int ph = _prev->getHeight();
+		const int fw = _filter_width;
+		const int fh = _filter_height;
+
+		// windows of a row are fw apart, the last one may be cut by the edge of the map
+		const int nfull = MIN(_width, pw / fw);
+		const int lw = pw - nfull * fw;
+
+		// the planes of every map and sample split among the threads
+		parallelRange(nm, (long)np, [&](int m0, int m1) {
+			const nnreal *ppa = _prev->getActivation() + (long)m0*np;
+			nnreal *pa = _u_a + (long)m0*n;
+			I *parg = argmax + (long)m0*n;
+
+			for(int mi = m0; mi < m1; mi++, ppa += np, pa += n, parg += n) {
+				for(int y = 0; y < _height; y++) {
+					const nnreal *row = ppa + y*fh*pw;
+					int ch = MIN(fh, ph - y*fh);
+					nnKernel::maxPoolRow(nfull, row, pw, fw, ch, pa + y*_width, parg + y*_width);
+					if(nfull < _width)
+						nnKernel::maxPoolRow(1, row + nfull*fw, pw, lw, ch, pa + y*_width + nfull, parg + y*_width + nfull);
+				}
+			}
+		});
+	}
+
+	template<typename I>
+	void backpropagateMaps(const I *argmax) {
+
+		nnreal *ppd = _prev->getDelta();
+		const int n = _unit_count, np = _prev_unit_count, nm = _map_num * _batch_count;
+		const int pw = _prev->getWidth();
+		const int ph = _prev->getHeight();
+		const int fw = _filter_width;
+		const int fh = _filter_height;
+		const int nfull = MIN(_width, pw / fw);
+		const int lw = pw - nfull * fw;
+
+		// the windows cover the previous map, every unit is written
+		parallelRange(nm, (long)np, [&](int m0, int m1) {
+			const nnreal *pd = _u_delta + (long)m0*n;
+			const I *parg = argmax + (long)m0*n;
+			nnreal *pp = ppd + (long)m0*np;
+
+			for(int mi = m0; mi < m1; mi++, pd += n, pp += np, parg += n) {
+				for(int y = 0; y < _height; y++) {
+					nnreal *row = pp + y*fh*pw;
+					int ch = MIN(fh, ph - y*fh);
+					nnKernel::unpoolMaxRow(nfull, pd + y*_width, parg + y*_width, fw, ch, row, pw);
+					if(nfull < _width)
+						nnKernel::unpoolMaxRow(1, pd + y*_width + nfull, parg + y*_width + nfull, lw, ch, row + nfull*fw, pw);
+				}
+			}
+		});
+	}
+
+	void detachCopy(nnLayer *src) {
+		nnLayer::detachCopy(src);
+		_u_argmax = NULL;
+	}
 };
 
 
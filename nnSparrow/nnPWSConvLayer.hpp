@@ -26,6 +26,8 @@
 */
 
 #include "nnLayer.hpp"
+#include <sstream>
+#include <string>
 
 
 #ifndef __NN_PWS_CONV_LAYER__
@@ -49,14 +51,21 @@ private:
 	int _stride_y;
 
 
-	double* _u_conv;
-	double* _u_dconv;
+	nnreal* _u_conv;
+	nnreal* _u_dconv;
 
-	double* _u_convb;
-	double* _u_dconvb;
+	nnreal* _u_convb;
+	nnreal* _u_dconvb;
 
-	double* _u_vel;
-	double* _u_velb;
+	nnreal* _u_vel;
+	nnreal* _u_velb;
+
+	//a section filter widened from 16 bit weights
+	nnreal* _u_filt;
+
+	//sum of the previous maps and its delta
+	nnreal* _u_sum;
+	nnreal* _u_dsum;
 
 
 public:
@@ -69,12 +78,18 @@ public:
 		_section_height = 0;
 		_section_rows = 0;
 		_section_cols = 0;
+		_stride_x = 1;
+		_stride_y = 1;
+		_layer_type = PWS_CONV_LAYER;
 		_u_convb = NULL;
 		_u_conv = NULL;
 		_u_dconv = NULL;
 		_u_dconvb = NULL;
 		_u_vel = NULL;
 		_u_velb = NULL;
+		_u_filt = NULL;
+		_u_sum = NULL;
+		_u_dsum = NULL;
 	}
 
 	nnPWSConvLayer(int fw, int fh, int sw, int sh, int nm, int stpx, int stpy, int at, nnLayer *prev, nnLayer *next = NULL) : 	nnLayer(prev, next) {
@@ -117,38 +132,162 @@ public:
 		_u_dconvb = NULL;
 		_u_vel = NULL;
 		_u_velb = NULL;
+		_u_filt = NULL;
+		_u_sum = NULL;
+		_u_dsum = NULL;
 
 	}
 	~nnPWSConvLayer() {
 
 		if(_u_conv)
-			delete [] _u_conv;
-		if(_u_dconv)
-			delete [] _u_dconv;
+			release(_u_conv);
 		if(_u_convb)
-			delete [] _u_convb;
-		if(_u_dconvb)
-			delete [] _u_dconvb;
-		if(_u_vel)
-			delete [] _u_vel;
-		if(_u_velb)
-			delete [] _u_velb;
+			release(_u_convb);
+		clearTraining();
+		if(_u_filt)
+			release(_u_filt);
+		if(_u_sum)
+			release(_u_sum);
+	}
+
+	int getFilterWidth() {
+		return _filter_width;
+	}
+	int getFilterHeight() {
+		return _filter_height;
+	}
+	int getSectionWidth() {
+		return _section_width;
+	}
+	int getSectionHeight() {
+		return _section_height;
+	}
+	int getSectionRows() {
+		return _section_rows;
+	}
+	int getSectionCols() {
+		return _section_cols;
+	}
+	int getStrideX() {
+		return _stride_x;
+	}
+	int getStrideY() {
+		return _stride_y;
+	}
+	int getActivationType() {
+		return _actv_type;
 	}
 
-	double *getDConv() {
+	nnreal *getDConv() {
 		return _u_dconv;
 	}
-	double *getDConvb() {
+	nnreal *getDConvb() {
 		return _u_dconvb;
 	}
 
-	double *getConv() {
+	nnreal *getConv() {
 		return _u_conv;
 	}
-	double *getConvb() {
+	nnreal *getConvb() {
 		return _u_convb;
 	}
 
+	// filter of section sec, widened into _u_filt if the weights are kept in 16 bit
+	const nnreal *filter(int sec) {
+		return filter(sec, _u_filt);
+	}
+	// filter of section sec, widened into f if the weights are kept in 16 bit
+	const nnreal *filter(int sec, nnreal *f) {
+		int nf = _filter_size;
+		if(!_u_Wh)
+			return _u_conv + sec*nf;
+		nnHalf::unpack(_u_Wh + sec*nf, nf, _weight_storage, f);
+		return f;
+	}
+	// a filter for the maps of one thread, see parallelRange()
+	nnreal *threadFilter() {
+		static thread_local std::vector<nnreal> f;
+		f.resize(_filter_size);
+		return &f[0];
+	}
+
+	// the gradient and momentum buffers go with the nnreal weights and come back zeroed
+	void setWeightStorage(int type) {
+
+		int nw = _filter_size * _map_num * _section_rows * _section_cols;
+		if(type == _weight_storage || !(_u_conv || _u_Wh))
+			return;
+
+		if(type == nnHalf::NONE) {
+			_u_conv = new nnreal[nw];
+			nnHalf::unpack(_u_Wh, nw, _weight_storage, _u_conv);
+			release(_u_Wh);
+			_u_Wh = NULL;
+			release(_u_filt);
+			_u_filt = NULL;
+
+			if(_trainable) {
+				_u_dconv = new nnreal[nw];
+				memset(_u_dconv, 0, nw*sizeof(nnreal));
+				_u_vel = new nnreal[nw];
+				memset(_u_vel, 0, nw*sizeof(nnreal));
+			}
+		}
+		else if(_u_Wh) {
+			for(int i = 0; i < nw; i++)
+				_u_Wh[i] = nnHalf::fromFloat(nnHalf::toFloat(_u_Wh[i], _weight_storage), type);
+		}
+		else {
+			_u_Wh = new uint16_t[nw];
+			nnHalf::pack(_u_conv, nw, type, _u_Wh);
+			_u_filt = new nnreal[_filter_size];
+			release(_u_conv);
+			_u_conv = NULL;
+			release(_u_dconv);
+			_u_dconv = NULL;
+			release(_u_vel);
+			_u_vel = NULL;
+		}
+		_weight_storage = type;
+	}
+
+	// no filter gradient or momentum while the filters are in 16 bit
+	void initTraining() {
+
+		int nb = _map_num * _section_rows * _section_cols, nw = nb * _filter_size;
+		clearTraining();
+		if(_u_conv) {
+			_u_dconv = new nnreal[nw];
+			memset(_u_dconv, 0, nw*sizeof(nnreal));
+			_u_vel = new nnreal[nw];
+			memset(_u_vel, 0, nw*sizeof(nnreal));
+		}
+		_u_dconvb = new nnreal[nb];
+		memset(_u_dconvb, 0, nb*sizeof(nnreal));
+		_u_velb = new nnreal[nb];
+		memset(_u_velb, 0, nb*sizeof(nnreal));
+		_u_dsum = new nnreal[_prev_unit_count];
+	}
+	void clearTraining() {
+		release(_u_dconv);
+		release(_u_dconvb);
+		release(_u_vel);
+		release(_u_velb);
+		release(_u_dsum);
+		_u_dconv = _u_dconvb = _u_vel = _u_velb = _u_dsum = NULL;
+	}
+
+	void appendBuffers(nnArena &arena) {
+		long nb = (long)_map_num * _section_rows * _section_cols, nw = nb * _filter_size;
+		nnLayer::appendBuffers(arena);
+		arena.add(&_u_conv, nw);
+		arena.add(&_u_dconv, nw);
+		arena.add(&_u_vel, nw);
+		arena.add(&_u_convb, nb);
+		arena.add(&_u_dconvb, nb);
+		arena.add(&_u_velb, nb);
+	}
+
 	void init() {
 
 		clear();
@@ -156,36 +295,26 @@ public:
 
 		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
 
-		_u_a = new double[n*nm];
-		memset(_u_a, 0, n*nm*sizeof(double));
-
-		_u_delta = new double[n*nm];
-		memset(_u_delta, 0, n*nm*sizeof(double));
+		initBatch();
 
 
 		int ns = _section_rows * _section_cols;
 		//conv
-		_u_conv = new double[nf*nm*ns];
+		_u_conv = new nnreal[nf*nm*ns];
 		for(int i=0;i<nf*nm*ns;i++) {
-			_u_conv[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_conv[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
-		_u_dconv = new double[nf*nm*ns];
-		memset(_u_dconv, 0, nf*nm*ns*sizeof(double));
-
-		_u_vel = new double[nf*nm*ns];
-		memset(_u_vel, 0, nf*nm*ns*sizeof(double));
 
 
 		//bias
-		_u_convb = new double[nm*ns];
+		_u_convb = new nnreal[nm*ns];
 		for(int i=0;i<nm*ns;i++) {
-			_u_convb[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_convb[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
-		_u_dconvb = new double[nm*ns];
-		memset(_u_dconvb, 0, nm*ns*sizeof(double));
 
-		_u_velb = new double[nm*ns];
-		memset(_u_velb, 0, nm*ns*sizeof(double));
+		_u_sum = new nnreal[np];
+		if(_trainable)
+			initTraining();
 
 		this->_act_f = nnActivation::getActivation(_actv_type);
 		this->_d_act_f = nnActivation::getDActivation(_actv_type);
@@ -196,156 +325,154 @@ public:
 		return y/_section_height*_section_cols + x/_section_width;
 	}
 
+	// the filters of a section are shared by all previous maps, so they can be summed up first
+	const nnreal *sumMaps(const nnreal *pua) {
+		return nnKernel::sumRows(_prev->getMapNum(), _prev_unit_count, pua, _u_sum);
+	}
+
+	// outputs [x0, x0 + len) of row y read the previous plane from row y*sy + fy, column x0*sx + fx
+	inline int getSectionInput(int y, int x0, int fy) {
+		return (y*_stride_y + fy)*_prev->getWidth() + x0*_stride_x;
+	}
+
+	// section by section, each a tile of outputs sharing one filter
 	void forward() {
 
-		//_u_a = _u_W * _prev->getActivation() + _u_convb;// [n, np]*[np, 1]
 		int n = _unit_count, np = _prev_unit_count, nm = _map_num, nf = _filter_size;
 		int nmp =  _prev->getMapNum();
 		int pw = _prev->getWidth();
 		int fw = _filter_width;
 		int fh = _filter_height;
+		int sx = _stride_x;
 
 		//number of sections of a feature map
 		int ns = _section_rows * _section_cols;
 
-		double *ua = _u_a;
-		double *pua = _prev->getActivation();
-		double *cv = _u_conv;
-		for(int mi = 0; mi < nm; mi++, ua += n, cv += nf*ns) {
-
-			int x = 0, y = 0;
-			for(int i = 0; i < n; i++, x++) {
-				if(x >= _width) {
-					x = 0; y++;
-				}
-				*(ua + i) = _u_convb[mi*ns + getSection(y, x)];
-			}
-
-			// puast - start position of feature map of pua
-			for(int puast = 0; puast < np * nmp; puast += np) {
-
-				int x = 0, y = 0;
-				int step = 0;
-
-				// x and y controls step
-				for(int i = 0; i < n; i++, x++, step += _stride_x) {
-					if(x >= _width) {
-						step = (step / pw + _stride_y) * pw;
-						x = 0; y++;
-					}
-					int sec = getSection( y, x );
-					//printf("%d %d %d\n", y, x, sec);
-					double d = 0;
-
-					//j1 is vertical shift of pua
-					//j2 is vertical shift of conv filter
-					for(int j1 = 0, j2 = 0; j2 < nf; j1 += pw, j2 += fw ) {
-						for(int k = 0; k < fw; k++ ) {
-
-						//	printf("%lf\n", (*(cv + sec*nf + j2 + k)) * (*(pua + puast + (step + j1) + k)));
-							d += (*(cv + sec*nf + j2 + k)) * (*(pua + puast + (step + j1) + k));
+		nnreal *pua = _prev->getActivation();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp) {
+
+			const nnreal *s = sumMaps(pua);
+			nnreal *uab = _u_a + b*n*nm;
+			parallelRange(nm, (long)n * nf, [&](int m0, int m1) {
+				nnreal *f = _u_Wh ? threadFilter() : NULL;
+				for(int mi = m0; mi < m1; mi++) {
+
+					nnreal *ua = uab + mi*n;
+					for(int sr = 0; sr < _section_rows; sr++) {
+						int y0 = sr * _section_height;
+						int y1 = MIN(y0 + _section_height, _height);
+						for(int sc = 0; sc < _section_cols; sc++) {
+							int x0 = sc * _section_width;
+							int len = MIN(_section_width, _width - x0);
+							int sec = mi*ns + sr*_section_cols + sc;
+
+							const nnreal *cv = filter(sec, f);
+							for(int y = y0; y < y1; y++) {
+								nnreal *o = ua + y*_width + x0;
+								for(int i = 0; i < len; i++)
+									o[i] = _u_convb[sec];
+								nnKernel::correlateRow(len, s + getSectionInput(y, x0, 0), pw, sx, cv, fw, fh, o);
+							}
 						}
 					}
-					//printf("sum: %lf\n", *(ua+i));
-					*(ua + i) += d;
-					//printf("sum: %lf\n", *(ua+i));
-				}
-				//printf("\n");
-			}
 
-			_act_f(ua, n);
+					_act_f(ua, n);
+				}
+			});
 		}
 	}
+
 	void backpropagation() {
 
 		//accumulate dW
 		//dW = _u_delta * _prev->getActivation().transpose();
 		//[n, 1] *[1, np]
 		int n = _unit_count, np = _prev_unit_count, nf = _filter_size, nm = _map_num;
-		//int cc = nm / _prev->getMapNum();
 		int nmp = _prev->getMapNum();
-		int pw = _prev->getWidth();
 		int fw = _filter_width;
 		int fh = _filter_height;
+		int sx = _stride_x;
 
 		//number of sections of a feature map
 		int ns = _section_rows * _section_cols;
 
-		double *dc = _u_dconv;
-
-		double *pua = _prev->getActivation();
-		double *dt = _u_delta;
-		for(int mi = 0; mi < nm; mi++, dt += n, dc += nf*ns) {
-
-			//int puast = np * (mi / cc);
-			for(int puast = 0; puast < np * nmp; puast += np) {
-				int step = 0, x = 0, y = 0;
-				for(int i = 0; i < n; i++, x++, step += _stride_x ) {
-					if(x >= _width) {
-						step = (step / pw + _stride_y) * pw;
-						x = 0; y++;
+		nnreal *pua = _prev->getActivation();
+		nnreal *pdt = _prev->getDelta();
+		for(int b = 0; b < _batch_count; b++, pua += np * nmp) {
+
+			const nnreal *s = sumMaps(pua);
+			nnreal *dtb = _u_delta + b*n*nm;
+
+			// the sections of dW split among the threads by maps
+			parallelRange(nm, (long)n * nf, [&](int m0, int m1) {
+				for(int mi = m0; mi < m1; mi++) {
+
+					const nnreal *dt = dtb + mi*n;
+					for(int sr = 0; sr < _section_rows; sr++) {
+						int y0 = sr * _section_height;
+						int y1 = MIN(y0 + _section_height, _height);
+						for(int sc = 0; sc < _section_cols; sc++) {
+							int x0 = sc * _section_width;
+							int len = MIN(_section_width, _width - x0);
+							int sec = mi*ns + sr*_section_cols + sc;
+
+							nnreal *dc = _u_dconv + sec*nf;
+							for(int y = y0; y < y1; y++) {
+								const nnreal *d = dt + y*_width + x0;
+								for(int i = 0; i < len; i++)
+									_u_dconvb[sec] += d[i];
+
+								for(int fy = 0; fy < fh; fy++) {
+									int st = getSectionInput(y, x0, fy);
+									for(int fx = 0; fx < fw; fx++)
+										dc[fy*fw + fx] += nnKernel::dot(len, d, s + st + fx, sx);
+								}
+							}
+						}
 					}
-					int sec = getSection( y, x );
-					double d = *(dt + i);
-					//printf("\n%d %d %d %lf\n\n", y, x, sec, d);
-					for(int j1 = 0, j2 = 0; j2 < nf; j1 += pw, j2 += fw ) {
-						for(int k = 0; k < fw; k++ ) {
-							*(dc + sec*nf + j2 + k) += d * (*(pua + puast + (step + j1) + k));
-						//	printf("%d %lf\n", sec*nf + j2 + k, (*(pua + puast + (step + j1) + k)));
+				}
+			});
+
+			// strided sections overlap in the sum, its delta stays on one thread
+			if(pdt) {
+				memset(_u_dsum, 0, np*sizeof(nnreal));
+				for(int mi = 0; mi < nm; mi++) {
+
+					const nnreal *dt = dtb + mi*n;
+					for(int sr = 0; sr < _section_rows; sr++) {
+						int y0 = sr * _section_height;
+						int y1 = MIN(y0 + _section_height, _height);
+						for(int sc = 0; sc < _section_cols; sc++) {
+							int x0 = sc * _section_width;
+							int len = MIN(_section_width, _width - x0);
+							const nnreal *cv = _u_conv + (mi*ns + sr*_section_cols + sc)*nf;
+							for(int y = y0; y < y1; y++) {
+								const nnreal *d = dt + y*_width + x0;
+								for(int fy = 0; fy < fh; fy++) {
+									int st = getSectionInput(y, x0, fy);
+									for(int fx = 0; fx < fw; fx++)
+										nnKernel::axpyTo(len, cv[fy*fw + fx], d, _u_dsum + st + fx, sx);
+								}
+							}
 						}
 					}
 				}
 			}
-		}
 
-		dt = _u_delta;
-		double *dcb = _u_dconvb;
-		for(int mi = 0; mi < nm; mi++, dt += n, dcb += ns) {
-			int x = 0, y = 0;
-			for(int i = 0; i < n; i++, x++ ) {
-				if(x >= _width) {
-					x = 0; y++;
-				}
-				int sec = getSection(y,x);
-				*(dcb + sec) += *(dt + i);
+			//every previous map receives the delta of their sum
+			if(pdt) {
+				for(int sh = 0; sh < np * nmp; sh += np)
+					memcpy(pdt + b * np * nmp + sh, _u_dsum, np*sizeof(nnreal));
 			}
 		}
 
-		//t = (_u_W.transpose() * _u_delta); // [np, n] * [n, 1]
-		//_prev->updateDelta();
-		double *pdt = _prev->getDelta();
-		if(pdt) {
-
-			memset(pdt, 0, sizeof(double)*_prev->getTotalUnitCount());
-			dt = _u_delta;
-			double *cv = _u_conv;
-			for(int mi = 0; mi < nm; mi++, dt += n, cv += nf*ns) {
-
-				//int puast = np * (mi / cc);
-				for(int puast = 0; puast < np * nmp; puast += np) {
-					int step = 0, x = 0, y = 0;
-					for(int i = 0; i < n; i++, x++, step += _stride_x ) {
-						if(x >= _width) {
-							step = (step / pw + _stride_y) * pw;
-							x = 0; y++;
-						}
-						int sec = getSection( y, x );
-						double d = *(dt + i);
-						for(int j1 = 0, j2 = 0; j2 < nf; j1 += pw, j2 += fw ) {
-							for(int k = 0; k < fw; k++ ) {
-								*(pdt + puast + (step + j1) + k) += *(cv + sec*nf + j2 + k) * d;
-							}
-						}
-					}
-				}
-			}
+		if(pdt)
 			_prev->updateDelta();
-		}
 	}
 
 	void updateDelta() {
 
-		int n = _unit_count, nm = _map_num;
+		int n = _unit_count, nm = _map_num * _batch_count;
 		// mat = ( W'delta )
 		// f'(z), where a = f(z) is sigmoid funtion
 		_d_act_f(_u_a, n*nm);
@@ -361,28 +488,12 @@ public:
 		double rm = 1.0 / m;
 
 		//_u_conv = _u_conv - alpha * ( rm * _u_dconv + lambda * _u_conv );
-		for(int i = 0; i < nf*nm*ns; i++) {
-			//_u_conv[i] *= mu;
-			_u_vel[i] = _u_vel[i] * mu + alpha * ( rm * _u_dconv[i] + lambda * _u_conv[i] );
-			_u_conv[i] -= _u_vel[i];
-			//_u_conv[i] -= alpha * ( rm * _u_dconv[i] + lambda * _u_conv[i] );
-		}
+		parallelRange(nf*nm*ns, 1, [&](int b, int e) {
+			momentumStep(_u_conv, _u_vel, _u_dconv, b, e, alpha, rm, lambda, mu);
+		});
 
 		//_u_convb = _u_convb - alpha * (rm * _u_dconvb );
-		for(int i = 0; i < nm*ns; i++) {
-			//_u_convb[i] *= mu;
-			_u_velb[i] = _u_velb[i] * mu + alpha * ( rm * _u_dconvb[i] );
-			_u_convb[i] -= _u_velb[i];
-			//_u_convb[i] -= alpha * ( rm * _u_dconvb[i] );
-		}
-
-
-		for(int i = 0; i < nm*nf*ns; i++) {
-			_u_dconv[i] = 0;
-		}
-		for(int i = 0; i < nm*ns; i++) {
-			_u_dconvb[i] = 0;
-		}
+		momentumStep(_u_convb, _u_velb, _u_dconvb, 0, nm*ns, alpha, rm, 0, mu);
 	}
 
 
@@ -394,30 +505,22 @@ public:
 	void clear() {
 		nnLayer::clear();
 		if(_u_conv) {
-			delete [] _u_conv;
+			release(_u_conv);
 			_u_conv = NULL;
 		}
 		if(_u_convb) {
-			delete [] _u_convb;
+			release(_u_convb);
 			_u_convb = NULL;
 		}
 
-		if(_u_dconv) {
-			delete [] _u_dconv;
-			_u_dconv = NULL;
+		clearTraining();
+		if(_u_sum) {
+			release(_u_sum);
+			_u_sum = NULL;
 		}
-		if(_u_dconvb) {
-			delete [] _u_dconvb;
-			_u_dconvb = NULL;
-		}
-
-		if(_u_vel) {
-			delete [] _u_vel;
-			_u_vel = NULL;
-		}
-		if(_u_velb) {
-			delete [] _u_velb;
-			_u_velb = NULL;
+		if(_u_filt) {
+			release(_u_filt);
+			_u_filt = NULL;
 		}
 	}
 
@@ -429,11 +532,14 @@ public:
 		fout << _filter_width << " " << _filter_height << " ";
 		fout << _section_width << " " << _section_height << " ";
 		fout << _section_rows << " " << _section_cols << " ";
-		fout << _width << " " << _height << " " << _map_num << std::endl;
+		fout << _width << " " << _height << " " << _map_num << " ";
+		fout << _stride_x << " " << _stride_y << std::endl;
 
 		int ns = _section_rows * _section_cols;
-		for(int i=0;i<_filter_size*ns*_map_num;i++) {
-			fout << _u_conv[i] << " ";
+		for(int sec=0;sec<ns*_map_num;sec++) {
+			const nnreal *cv = filter(sec);
+			for(int i=0;i<_filter_size;i++)
+				fout << cv[i] << " ";
 		}
 		fout<<std::endl;
 		for(int i=0;i<_map_num*ns;i++) {
@@ -450,6 +556,14 @@ public:
 		fin >> _section_rows >> _section_cols;
 		fin >> _width >> _height >> _map_num;
 
+		// the strides close the line, files written before they were saved have none
+		std::string line;
+		std::getline(fin, line);
+		std::istringstream ss(line);
+		if(!(ss >> _stride_x >> _stride_y)) {
+			_stride_x = 1;
+			_stride_y = 1;
+		}
 
 		_filter_size = _filter_width * _filter_height;
 
@@ -466,6 +580,26 @@ public:
 
 	}
 
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
+	void detachWeights() {
+		nnLayer::detachWeights();
+		_u_conv = _u_convb = NULL;
+	}
+	void appendGradients(std::vector<std::pair<nnreal*, long> > &g) {
+		long nb = (long)_map_num * _section_rows * _section_cols;
+		g.push_back(std::make_pair(_u_dconv, nb * _filter_size));
+		g.push_back(std::make_pair(_u_dconvb, nb));
+	}
+
+protected:
+	void detachCopy(nnLayer *src) {
+		nnLayer::detachCopy(src);
+		_u_dconv = _u_dconvb = _u_vel = _u_velb = _u_dsum = NULL;
+		_u_filt = _u_Wh ? new nnreal[_filter_size] : NULL;
+		_u_sum = new nnreal[_prev_unit_count];
+	}
 };
 
 
@@ -0,0 +1,543 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cfloat>
+#include <vector>
+#include <stdint.h>
+
+#include "nnSparrow.hpp"
+
+#ifndef __NN_QUANTIZED__
+#define __NN_QUANTIZED__
+
+// Int8 inference copy of a trained nnSparrow: a chain of full, FWS/PWS conv, pooling and softmax layers.
+// Activations are uint8, real = scale * (q - zero), with the range of every layer calibrated by running
+// the float network on sample inputs. Weights are int8 with one scale per unit, filter or section filter,
+// and the dot products are summed in int32 by nnKernel::gemvInt8 and nnKernel::correlateRowInt8.
+class nnQuantizedNet {
+
+protected:
+	struct nnQRange {
+		nnreal lo;
+		nnreal hi;
+		nnreal scale;
+		int zero;
+
+		nnQRange() {
+			lo = FLT_MAX;
+			hi = -FLT_MAX;
+			scale = 1;
+			zero = 0;
+		}
+		void update(const nnreal *a, int n) {
+			for(int i = 0; i < n; i++) {
+				if(a[i] < lo)
+					lo = a[i];
+				if(a[i] > hi)
+					hi = a[i];
+			}
+		}
+		// the range always holds 0, so that it is represented exactly
+		void finish() {
+			lo = MIN(lo, 0);
+			hi = MAX(hi, 0);
+			scale = (hi > lo) ? (hi - lo) / 255 : 1;
+			zero = MIN(255, MAX(0, (int)lrint(-lo / scale)));
+		}
+		// q = round(v / scale) + zero, clamped
+		template<typename T>
+		void quantize(const T *v, int n, uint8_t *q) const {
+			nnreal r = 1 / scale, z = zero + (nnreal)0.5;
+			for(int i = 0; i < n; i++) {
+				nnreal t = v[i] * r + z;
+				t = (t < 0) ? 0 : ((t > 255) ? 255 : t);
+				q[i] = (uint8_t)(int)t;
+			}
+		}
+	};
+
+	struct nnQLayer {
+		int type;
+		int act;
+		int w, h, nm;		// output maps
+		int pw, ph, nmp;	// input maps
+		int fw, fh;			// filter or pooling window
+		int sw, sh, scols;	// PWS sections
+		int sx, sy;			// PWS strides
+		int k;				// weights per row
+		int ns, nm8, fw4;	// conv sections, maps padded to 8, filter rows padded to 4
+		int nw;				// weights of the float layer
+
+		std::vector<int8_t> W;
+		std::vector<int32_t> wsum;	// sum of the int8 weights of a row, for the zero point
+		std::vector<nnreal> wscale;
+		std::vector<nnreal> bias;
+
+		nnQRange sum;		// summed input maps of a conv layer
+		nnQRange out;
+		std::vector<uint8_t> q;
+	};
+
+	std::vector<nnQLayer> _layers;
+	nnQRange _in;
+	int _input_size;
+	int _output_size;
+
+	std::vector<uint8_t> _u_in;
+	std::vector<uint8_t> _u_sum;
+	std::vector<int32_t> _u_acc;
+	std::vector<float> _u_real;
+
+	static void quantizeRows(const nnreal *w, int rows, int k, nnQLayer &l) {
+
+		l.k = k;
+		l.nw = rows * k;
+		l.W.resize(rows * k);
+		l.wsum.resize(rows);
+		l.wscale.resize(rows);
+		for(int r = 0; r < rows; r++) {
+			const nnreal *wr = w + r*k;
+			nnreal amax = 0;
+			for(int j = 0; j < k; j++)
+				amax = MAX(amax, fabs(wr[j]));
+			nnreal sc = (amax > 0) ? amax / 127 : 1;
+			int32_t s = 0;
+			for(int j = 0; j < k; j++) {
+				int q = (int)lrint(wr[j] / sc);
+				q = MIN(127, MAX(-127, q));
+				l.W[r*k + j] = (int8_t)q;
+				s += q;
+			}
+			l.wsum[r] = s;
+			l.wscale[r] = sc;
+		}
+	}
+
+	// sum of the nmp input maps requantized to the range of the sum, the maps themselves if there is one
+	const uint8_t *sumMaps(const nnQLayer &l, const uint8_t *x, const nnQRange &in) {
+
+		int np = l.pw * l.ph;
+		if(l.nmp == 1)
+			return x;
+		int32_t *s = &_u_acc[0];
+		for(int p = 0; p < np; p++)
+			s[p] = x[p] - l.nmp * in.zero;
+		for(int m = 1; m < l.nmp; m++) {
+			const uint8_t *xm = x + m*np;
+			for(int p = 0; p < np; p++)
+				s[p] += xm[p];
+		}
+		// as a real plane in the unit of the input scale
+		float *r = &_u_real[0];
+		for(int p = 0; p < np; p++)
+			r[p] = s[p] * in.scale;
+		l.sum.quantize(r, np, &_u_sum[0]);
+		return &_u_sum[0];
+	}
+
+	// filters of a section as nm8 x fh x fw4 for nnKernel::correlateRowInt8, zero padded, sections one after the other
+	static void packFilters(nnQLayer &l, int nf) {
+
+		std::vector<int8_t> p(l.ns * l.nm8 * l.fh * l.fw4, 0);
+		for(int sec = 0; sec < l.ns; sec++)
+			for(int mi = 0; mi < l.nm; mi++)
+				for(int fy = 0; fy < l.fh; fy++)
+					for(int fx = 0; fx < l.fw; fx++)
+						p[((sec*l.nm8 + mi)*l.fh + fy)*l.fw4 + fx] = l.W[(mi*l.ns + sec)*nf + fy*l.fw + fx];
+		l.W.swap(p);
+		l.k = l.fh * l.fw4;
+	}
+
+	// out = scale of row * scale of input * (acc - zero * sum of weights) + bias
+	static inline void dequantize(const nnQLayer &l, int row, const int32_t *acc, int n, const nnQRange &in, float *out) {
+		float a = l.wscale[row] * in.scale;
+		float c = l.bias[row] - a * in.zero * l.wsum[row];
+		for(int i = 0; i < n; i++)
+			out[i] = a * acc[i] + c;
+	}
+
+	// the activations of the float layers in single precision, the outputs only keep 8 bits
+	static void activate(int act, float *a, int n) {
+		switch(act) {
+			case SIGMOID:
+				nnMath::sigmoid(a, n);
+				break;
+			case TANH:
+				nnMath::tanh(a, n);
+				break;
+			case SOFTPLUS:
+				nnMath::softplus(a, n);
+				break;
+			case RECTIFIER:
+				for(int i = 0; i < n; i++)
+					a[i] = (a[i] < 0) ? 0 : a[i];
+				break;
+		}
+	}
+
+	void forwardFull(nnQLayer &l, const uint8_t *x, const nnQRange &in, bool last) {
+
+		int n = l.nm;
+		nnKernel::gemvInt8(n, l.k, &l.W[0], l.k, x, &_u_acc[0]);
+		for(int r = 0; r < n; r++)
+			dequantize(l, r, &_u_acc[r], 1, in, &_u_real[r]);
+
+		if(l.type == nnLayer::SOFTMAX_LAYER) {
+			float maxv = _u_real[0], sum = 0;
+			for(int i = 1; i < n; i++)
+				maxv = MAX(maxv, _u_real[i]);
+			for(int i = 0; i < n; i++)
+				_u_real[i] -= maxv;
+			nnMath::exp(&_u_real[0], n);
+			for(int i = 0; i < n; i++)
+				sum += _u_real[i];
+			for(int i = 0; i < n; i++)
+				_u_real[i] /= sum;
+		}
+		else
+			activate(l.act, &_u_real[0], n);
+
+		if(!last)
+			l.out.quantize(&_u_real[0], n, &l.q[0]);
+	}
+
+	// rows of outputs, cut at the section edges of a PWS layer, against all filters of their section
+	void forwardConv(nnQLayer &l, const uint8_t *x, const nnQRange &in, bool last) {
+
+		int n = l.w * l.h, ns = l.ns;
+		int runw = (ns > 1) ? l.sw : l.w;
+		const uint8_t *s = sumMaps(l, x, in);
+		const nnQRange &sr = (l.nmp == 1) ? in : l.sum;
+
+		for(int y = 0; y < l.h; y++) {
+			for(int x0 = 0; x0 < l.w; x0 += runw) {
+				int len = MIN(runw, l.w - x0);
+				int sec = (ns > 1) ? (y / l.sh) * l.scols + x0 / l.sw : 0;
+				int32_t *acc = &_u_acc[y*l.w + x0];
+				nnKernel::correlateRowInt8(len, s + y*l.sy*l.pw + x0*l.sx, l.pw, l.sx, &l.W[sec*l.nm8*l.k],
+					l.fw4, l.fh, l.nm8, acc, n);
+				for(int mi = 0; mi < l.nm; mi++)
+					dequantize(l, mi*ns + sec, acc + mi*n, len, sr, &_u_real[mi*n + y*l.w + x0]);
+			}
+		}
+
+		activate(l.act, &_u_real[0], n*l.nm);
+		if(!last)
+			l.out.quantize(&_u_real[0], n*l.nm, &l.q[0]);
+	}
+
+	// windows as in the float layers, the last ones cut by the edge of the map; the range is kept.
+	// The window rows are reduced column by column first.
+	void forwardPool(nnQLayer &l, const uint8_t *x) {
+
+		bool avg = l.type == nnLayer::AVG_POOLING_LAYER;
+		uint8_t *cm = &_u_sum[0];
+		int32_t *cs = &_u_acc[0];
+		for(int mi = 0; mi < l.nm; mi++) {
+			const uint8_t *xm = x + mi*l.pw*l.ph;
+			uint8_t *o = &l.q[mi*l.w*l.h];
+			for(int y = 0; y < l.h; y++) {
+				int y0 = y*l.fh, y1 = MIN(y0 + l.fh, l.ph);
+				const uint8_t *r = xm + y0*l.pw;
+				if(avg) {
+					for(int px = 0; px < l.pw; px++)
+						cs[px] = r[px];
+					for(int py = y0 + 1; py < y1; py++) {
+						r += l.pw;
+						for(int px = 0; px < l.pw; px++)
+							cs[px] += r[px];
+					}
+				}
+				else {
+					memcpy(cm, r, l.pw);
+					for(int py = y0 + 1; py < y1; py++) {
+						r += l.pw;
+						for(int px = 0; px < l.pw; px++)
+							cm[px] = MAX(cm[px], r[px]);
+					}
+				}
+				for(int xo = 0; xo < l.w; xo++) {
+					int x0 = xo*l.fw, x1 = MIN(x0 + l.fw, l.pw);
+					if(avg) {
+						// rounded mean, the reciprocal is nudged so that exact quotients are not cut below
+						int s = 0, c = (y1 - y0) * (x1 - x0);
+						for(int px = x0; px < x1; px++)
+							s += cs[px];
+						o[y*l.w + xo] = (uint8_t)(int)((s + c/2) * (1.0 / c) + 1e-4);
+					}
+					else {
+						uint8_t m = cm[x0];
+						for(int px = x0 + 1; px < x1; px++)
+							m = MAX(m, cm[px]);
+						o[y*l.w + xo] = m;
+					}
+				}
+			}
+		}
+	}
+
+public:
+	nnQuantizedNet() {
+		_input_size = 0;
+		_output_size = 0;
+	}
+
+	int getLayerCount() {
+		return _layers.size();
+	}
+	int getOutputSize() {
+		return _output_size;
+	}
+
+	// bytes of the weights and biases, and what the float network keeps for them
+	long getWeightBytes() {
+		long b = 0;
+		for(int i = 0; i < _layers.size(); i++) {
+			b += _layers[i].W.size();
+			b += (_layers[i].wscale.size() + _layers[i].bias.size()) * sizeof(nnreal) + _layers[i].wsum.size() * sizeof(int32_t);
+		}
+		return b;
+	}
+	long getFloatWeightBytes() {
+		long b = 0;
+		for(int i = 0; i < _layers.size(); i++)
+			b += (_layers[i].nw + _layers[i].bias.size()) * sizeof(nnreal);
+		return b;
+	}
+
+	// copy of the weights of nn, ranges of the activations from running nn on the calibration inputs
+	// false if nn is not a single chain of full, conv, pooling and softmax layers, or keeps 16 bit weights
+	bool build(nnSparrow &nn, std::vector<std::vector<double> > &calib) {
+
+		_layers.clear();
+		if(nn.getInputLayerCount() != 1 || nn.getLayerCount() < 1 || calib.empty())
+			return false;
+
+		nnLayer *prev = nn.getInputLayer(0);
+		_input_size = prev->getTotalUnitCount();
+
+		int maxn = 0;
+		for(int i = 0; i < nn.getLayerCount(); i++) {
+
+			nnLayer *pl = nn.getLayer(i);
+			if(pl->getPrevLayer() != prev || pl->getWeightStorage() != nnHalf::NONE)
+				return false;
+
+			nnQLayer l;
+			l.type = pl->getLayerType();
+			l.act = SIGMOID;
+			l.w = pl->getWidth();
+			l.h = pl->getHeight();
+			l.nm = pl->getMapNum();
+			l.pw = prev->getWidth();
+			l.ph = prev->getHeight();
+			l.nmp = prev->getMapNum();
+			l.fw = l.fh = 1;
+			l.sw = l.sh = l.scols = 1;
+			l.sx = l.sy = 1;
+			l.k = 0;
+			l.nw = 0;
+			l.ns = 1;
+			l.nm8 = (l.nm + 7) / 8 * 8;
+			l.fw4 = 4;
+
+			switch(l.type) {
+				case nnLayer::FULL_LAYER:
+				case nnLayer::SOFTMAX_LAYER: {
+					nnFLayer *f = (nnFLayer*)pl;
+					l.act = f->getActivationType();
+					l.nm = f->getUnitCount();
+					quantizeRows(f->getWeights(), l.nm, prev->getTotalUnitCount(), l);
+					l.bias.assign(f->getBias(), f->getBias() + l.nm);
+					break;
+				}
+				case nnLayer::FWS_CONV_LAYER: {
+					nnFWSConvLayer *c = (nnFWSConvLayer*)pl;
+					l.act = c->getActivationType();
+					l.fw = c->getFilterWidth();
+					l.fh = c->getFilterHeight();
+					l.fw4 = (l.fw + 3) / 4 * 4;
+					quantizeRows(c->getConv(), l.nm, l.fw * l.fh, l);
+					packFilters(l, l.fw * l.fh);
+					l.bias.assign(c->getConvb(), c->getConvb() + l.nm);
+					break;
+				}
+				case nnLayer::PWS_CONV_LAYER: {
+					nnPWSConvLayer *c = (nnPWSConvLayer*)pl;
+					l.act = c->getActivationType();
+					l.fw = c->getFilterWidth();
+					l.fh = c->getFilterHeight();
+					l.sw = c->getSectionWidth();
+					l.sh = c->getSectionHeight();
+					l.scols = c->getSectionCols();
+					l.sx = c->getStrideX();
+					l.sy = c->getStrideY();
+					l.ns = c->getSectionRows() * c->getSectionCols();
+					l.fw4 = (l.fw + 3) / 4 * 4;
+					quantizeRows(c->getConv(), l.nm * l.ns, l.fw * l.fh, l);
+					packFilters(l, l.fw * l.fh);
+					l.bias.assign(c->getConvb(), c->getConvb() + l.nm * l.ns);
+					break;
+				}
+				case nnLayer::MAX_POOLING_LAYER:
+					l.fw = ((nnMaxPoolingLayer*)pl)->getFilterWidth();
+					l.fh = ((nnMaxPoolingLayer*)pl)->getFilterHeight();
+					break;
+				case nnLayer::AVG_POOLING_LAYER:
+					l.fw = ((nnAvgPoolingLayer*)pl)->getFilterWidth();
+					l.fh = ((nnAvgPoolingLayer*)pl)->getFilterHeight();
+					break;
+				default:
+					_layers.clear();
+					return false;
+			}
+
+			// the conv kernel reads up to 64 bytes past its last input
+			l.q.assign(pl->getTotalUnitCount() + 64, 0);
+			maxn = MAX(maxn, MAX(pl->getTotalUnitCount(), l.nm8 * pl->getUnitCount()));
+			_layers.push_back(l);
+			prev = pl;
+		}
+		_output_size = prev->getTotalUnitCount();
+
+		// ranges of the input, of every output and of the summed input maps of the conv layers
+		// of the normalized softmax, every layer keeping its own activations
+		std::vector<nnreal> s;
+		std::vector<double> o(_output_size);
+		int lab;
+		bool plan = nn.getActivationPlanning();
+		nn.setActivationPlanning(false);
+		for(int c = 0; c < calib.size(); c++) {
+			nn.predict(calib[c], lab, &o[0]);
+			_in.update(nn.getInputLayer(0)->getActivation(), _input_size);
+			for(int i = 0; i < _layers.size(); i++) {
+				nnQLayer &l = _layers[i];
+				nnLayer *pl = nn.getLayer(i);
+				l.out.update(pl->getActivation(), pl->getTotalUnitCount());
+				if((l.type == nnLayer::FWS_CONV_LAYER || l.type == nnLayer::PWS_CONV_LAYER) && l.nmp > 1) {
+					int np = l.pw * l.ph;
+					const nnreal *pa = pl->getPrevLayer()->getActivation();
+					s.assign(pa, pa + np);
+					for(int m = 1; m < l.nmp; m++)
+						nnKernel::axpy(np, (nnreal)1, pa + m*np, 1, &s[0]);
+					l.sum.update(&s[0], np);
+				}
+			}
+		}
+
+		nn.setActivationPlanning(plan);
+
+		// pooling keeps the range of its input
+		_in.finish();
+		for(int i = 0; i < _layers.size(); i++) {
+			nnQLayer &l = _layers[i];
+			l.sum.finish();
+			if(l.type == nnLayer::MAX_POOLING_LAYER || l.type == nnLayer::AVG_POOLING_LAYER)
+				l.out = (i > 0) ? _layers[i-1].out : _in;
+			else
+				l.out.finish();
+		}
+
+		_u_in.assign(_input_size + 64, 0);
+		_u_sum.assign(MAX(_input_size, maxn) + 64, 0);
+		_u_acc.assign(maxn, 0);
+		_u_real.assign(maxn, 0);
+		return true;
+	}
+
+	bool predict(std::vector<double> &input, int &output, double *ovec = NULL) {
+
+		if(_layers.empty() || input.size() != _input_size)
+			return false;
+
+		_in.quantize(&input[0], _input_size, &_u_in[0]);
+
+		const uint8_t *x = &_u_in[0];
+		const nnQRange *in = &_in;
+		for(int i = 0; i < _layers.size(); i++) {
+			nnQLayer &l = _layers[i];
+			bool last = i + 1 == _layers.size();
+			switch(l.type) {
+				case nnLayer::FULL_LAYER:
+				case nnLayer::SOFTMAX_LAYER:
+					forwardFull(l, x, *in, last);
+					break;
+				case nnLayer::FWS_CONV_LAYER:
+				case nnLayer::PWS_CONV_LAYER:
+					forwardConv(l, x, *in, last);
+					break;
+				default:
+					forwardPool(l, x);
+					if(last) {
+						for(int j = 0; j < _output_size; j++)
+							_u_real[j] = l.out.scale * (l.q[j] - l.out.zero);
+					}
+					break;
+			}
+			x = &l.q[0];
+			in = &l.out;
+		}
+
+		output = 0;
+		for(int i = 1; i < _output_size; i++) {
+			if(_u_real[i] > _u_real[output])
+				output = i;
+		}
+		if(ovec) {
+			for(int i = 0; i < _output_size; i++)
+				ovec[i] = _u_real[i];
+		}
+		return true;
+	}
+
+	// accuracy of nn and of its int8 copy on the same samples, how often they agree,
+	// and the largest difference of their outputs; returns the int8 accuracy
+	double report(nnSparrow &nn, std::vector<std::vector<double> > &input, std::vector<int> &label) {
+
+		int cf = 0, cq = 0, agree = 0;
+		double diff = 0;
+		std::vector<double> of(_output_size), oq(_output_size);
+		for(int i = 0; i < input.size(); i++) {
+			int lf = -1, lq = -1;
+			nn.predict(input[i], lf, &of[0]);
+			predict(input[i], lq, &oq[0]);
+			cf += lf == label[i];
+			cq += lq == label[i];
+			agree += lf == lq;
+			for(int j = 0; j < _output_size; j++)
+				diff = MAX(diff, fabs(of[j] - oq[j]));
+		}
+		int n = MAX(1, (int)input.size());
+		printf("float accuracy %.2lf%%, int8 accuracy %.2lf%%, agreement %.2lf%%, max output difference %.4lf, weights %ld -> %ld bytes\n",
+			100.0 * cf / n, 100.0 * cq / n, 100.0 * agree / n, diff, getFloatWeightBytes(), getWeightBytes());
+		return double(cq) / n;
+	}
+};
+
+#endif
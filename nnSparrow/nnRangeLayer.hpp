@@ -32,17 +32,27 @@
 
 #define __NN_RANGE_LAYER__
 
+// Output (y, i) sees the st + i first units of row y of the first previous map. The weights of each output row
+// are packed as rows of growing length, see nnKernel::prefixOffset().
 class nnRangeLayer : public nnLayer {
 
 protected:
 
 	int _actv_type;
-	double* _u_dW;
-	double* _u_db;
-	double* _u_vW;
-	double* _u_vb;
+	nnreal* _u_dW;
+	nnreal* _u_db;
+	nnreal* _u_vW;
+	nnreal* _u_vb;
 	int _range_start;
 
+	// packed weights of an output row
+	long rowWeightCount() {
+		return nnKernel::prefixOffset(_width, _range_start);
+	}
+	long weightCount() {
+		return _height * rowWeightCount();
+	}
+
 public:
 	nnRangeLayer(nnLayer *prev=NULL) : nnLayer(prev, NULL) {
 		_u_dW = NULL;
@@ -50,7 +60,7 @@ public:
 		_u_vW = NULL;
 		_u_vb = NULL;
 		_actv_type = SIGMOID;
-		_layer_type = FULL_LAYER;
+		_layer_type = RANGE_LAYER;
 		_range_start = 0;
 	}
 
@@ -77,82 +87,101 @@ public:
 		this->_layer_type = RANGE_LAYER;
 	}
 	~nnRangeLayer() {
-		if(_u_dW)
-			delete [] _u_dW;
-		if(_u_db)
-			delete [] _u_db;
-		if(_u_vW)
-			delete [] _u_vW;
-		if(_u_vb)
-			delete [] _u_vb;
+		clearTraining();
+	}
+
+
+	int getRangeStart() {
+		return _range_start;
+	}
+	int getActivationType() {
+		return _actv_type;
 	}
 
+	void appendBuffers(nnArena &arena) {
+		long n = _unit_count, nw = weightCount();
+		nnLayer::appendBuffers(arena);
+		arena.add(&_u_W, nw);
+		arena.add(&_u_b, n);
+		arena.add(&_u_dW, nw);
+		arena.add(&_u_db, n);
+		arena.add(&_u_vW, nw);
+		arena.add(&_u_vb, n);
+	}
 
 	void init() {
 
 		int np = _prev_unit_count;
 		int n = _unit_count;
+		long nw = weightCount();
 
 		clear();
 
 
 		double rg = sqrt(6) / sqrt(n + np);
 
-		_u_W = new double[n*np];
-		for(int i=0;i<n*np;i++) {
-			_u_W[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+		_u_W = new nnreal[nw];
+		for(int i=0;i<nw;i++) {
+			_u_W[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
 
-		_u_b = new double[n];
+		_u_b = new nnreal[n];
 		for(int i=0;i<n;i++) {
-			_u_b[i] = ((double) rand() / (RAND_MAX))*2*rg - rg;
+			_u_b[i] = ((nnreal) rand() / (RAND_MAX))*2*rg - rg;
 		}
 
-		_u_a = new double[n];
-		memset(_u_a, 0, n*sizeof(double));
+		initBatch();
+		if(_trainable)
+			initTraining();
 
-		_u_delta = new double[n];
-		memset(_u_delta, 0, n*sizeof(double));
+		this->_act_f = nnActivation::getActivation(_actv_type);
+		this->_d_act_f = nnActivation::getDActivation(_actv_type);
+	}
 
-		_u_dW = new double[n*np];
-		memset(_u_dW, 0, n*np*sizeof(double));
 
-		_u_db = new double[n];
-		memset(_u_db, 0, n*sizeof(double));
+	void initTraining() {
 
-		_u_vW = new double[n*np];
-		memset(_u_vW, 0, n*np*sizeof(double));
+		int n = _unit_count;
+		long nw = weightCount();
+		clearTraining();
 
-		_u_vb = new double[n];
-		memset(_u_vb, 0, n*sizeof(double));
+		_u_dW = new nnreal[nw];
+		memset(_u_dW, 0, nw*sizeof(nnreal));
 
-		this->_act_f = nnActivation::getActivation(_actv_type);
-		this->_d_act_f = nnActivation::getDActivation(_actv_type);
-	}
+		_u_db = new nnreal[n];
+		memset(_u_db, 0, n*sizeof(nnreal));
+
+		_u_vW = new nnreal[nw];
+		memset(_u_vW, 0, nw*sizeof(nnreal));
 
+		_u_vb = new nnreal[n];
+		memset(_u_vb, 0, n*sizeof(nnreal));
+	}
+	void clearTraining() {
+		release(_u_dW);
+		release(_u_db);
+		release(_u_vW);
+		release(_u_vb);
+		_u_dW = _u_db = _u_vW = _u_vb = NULL;
+	}
 
 	void forward() {
- 		// [n, np]*[np, 1] + [n, 1]
-		//_u_a = _u_W * _prev->getActivation() + _u_b;
+		//_u_a = _u_W * _prev->getActivation() + _u_b, row by row on the packed prefixes
 		int n = _unit_count, np = _prev_unit_count;
-		memcpy(_u_a, _u_b, n*sizeof(double));
-
 		int pw = _prev->getWidth();
-		int ph = _prev->getHeight();
-
-		double *pua = _prev->getActivation();
-		double *ua = _u_a;
-
-		for(int y = 0; y < ph; y++, pua += pw, ua += _width) {
-			for(int i = 0; i < _width; i++) {
-				double d = 0;
-				for(int j = 0; j < i+_range_start; j++) {
-					d += _u_W[y*_width*pw + i*pw + j] * pua[j];
-				}
-				ua[i] += d;
+		long rw = rowWeightCount();
+
+		// the rows split among the threads
+		parallelRange(_height, (long)_batch_count * rw, [&](int y0, int y1) {
+			for(int b = 0; b < _batch_count; b++) {
+				nnreal *pua = _prev->getActivation() + b*np;
+				nnreal *ua = _u_a + b*n;
+				memcpy(ua + y0*_width, _u_b + y0*_width, (y1 - y0)*_width*sizeof(nnreal));
+				for(int y = y0; y < y1; y++)
+					nnKernel::gemvPrefix(_width, _range_start, _u_W + y*rw, pua + y*pw, ua + y*_width);
+				_act_f(ua + y0*_width, (y1 - y0)*_width);
 			}
-		}
-		_act_f(_u_a, n);
+		});
 
 	}
 	void backpropagation() {
@@ -160,60 +189,53 @@ public:
 		//accumulate dW, db
 		//_u_dW = mu*_u_dW + _u_delta * _prev->getActivation().transpose(); [n,1] * [1,np]
 		int n = _unit_count, np = _prev_unit_count;
-
-		double *pua = _prev->getActivation();
-		double *dt = _u_delta;
-
 		int pw = _prev->getWidth();
-		int ph = _prev->getHeight();
-		for(int y = 0; y < ph; y++, pua += pw, dt += _width) {
-			for(int i = 0; i < _width; i++) {
-				double d = dt[i];
-				for(int j = 0; j < i+_range_start; j++) {
-					_u_dW[y*_width*pw + i*pw + j] += d * pua[j];
-				}
+		long rw = rowWeightCount();
+
+		parallelRange(_height, (long)_batch_count * rw, [&](int y0, int y1) {
+			for(int b = 0; b < _batch_count; b++) {
+				nnreal *pua = _prev->getActivation() + b*np;
+				nnreal *dt = _u_delta + b*n;
+				for(int y = y0; y < y1; y++)
+					nnKernel::gerPrefix(_width, _range_start, dt + y*_width, pua + y*pw, _u_dW + y*rw);
 			}
-		}
-
+		});
 
 		//_u_db = mu*_u_db + _u_delta;
-		for(int i=0;i<n;i++) {
-			//_u_db[i] *= mu;
-		 	_u_db[i] += _u_delta[i];
+		nnreal *dt = _u_delta;
+		for(int b = 0; b < _batch_count; b++, dt += n) {
+			for(int i=0;i<n;i++) {
+				//_u_db[i] *= mu;
+			 	_u_db[i] += dt[i];
+			}
 		}
 
+		//W' * delta, the units past the last prefix and the other maps get none
+		nnreal *pdt = _prev->getDelta();
+		if(pdt) {
 
-
+			memset(pdt, 0, np*_batch_count*sizeof(nnreal));
+			for(int b = 0; b < _batch_count; b++) {
+				for(int y = 0; y < _height; y++)
+					nnKernel::gemvTPrefix(_width, _range_start, _u_W + y*rw, _u_delta + b*n + y*_width, pdt + b*np + y*pw);
+			}
+			_prev->updateDelta();
+		}
 	}
 	void updateParameters(int m, double alpha, double lambda, double mu) {
 
 
-		int n = _unit_count, np = _prev_unit_count;
+		int n = _unit_count;
+		long nw = weightCount();
 		double rm = 1.0 / m;
 
 		//_u_W = _u_W - alpha * ( rm * _u_dW + lambda * _u_W );
-		for(int i=0;i<n*np;i++) {
-			_u_vW[i] = _u_vW[i] * mu + alpha * (rm * _u_dW[i] + lambda * _u_W[i]);
-			_u_W[i] -= _u_vW[i];
-			//_u_W[i] -= alpha * (rm * _u_dW[i] + lambda * _u_W[i]);
-		}
+		parallelRange(nw, 1, [&](int b, int e) {
+			momentumStep(_u_W, _u_vW, _u_dW, b, e, alpha, rm, lambda, mu);
+		});
 
 		//_u_b = _u_b - alpha * ( rm * _u_db );
-		for(int i=0;i<n;i++) {
-			//_u_b[i] -= alpha * (rm * _u_db[i]);
-			_u_vb[i] = _u_vb[i] * mu + alpha * (rm * _u_db[i]);
-			_u_b[i] -= _u_vb[i];
-			//printf("%lf ", _u_b[i] );
-		}
-
-		for(int i = 0; i < n; i++) {
-			for(int j = 0; j < np; j++) {
-				_u_dW[i*np+j] = 0;
-			}
-		}
-		for(int i=0;i<n;i++) {
-			_u_db[i] = 0;
-		}
+		momentumStep(_u_b, _u_vb, _u_db, 0, n, alpha, rm, 0, mu);
 
 	}
 	void updateDelta() {
@@ -221,18 +243,19 @@ public:
 		// mat = ( W'delta )
 		// f'(z), where a = f(z) is sigmoid funtion
 
-		_d_act_f(_u_a, _unit_count);
+		int n = _unit_count * _batch_count;
+		_d_act_f(_u_a, n);
 
-		for(int i=0;i<_unit_count;i++) {
+		for(int i=0;i<n;i++) {
 			_u_delta[i] *= _u_a[i];
 		}
 	}
 
-	bool calculateDelta(double *result, int n) {
+	bool calculateDelta(nnreal *result, int n) {
 		if(n != _unit_count)
 			return false;
 
-		for(int i=0;i<_unit_count;i++)
+		for(int i=0;i<_unit_count*_batch_count;i++)
 			_u_delta[i] = -(result[i] - _u_a[i]);
 
 
@@ -245,35 +268,24 @@ public:
 
 	void clear() {
 		nnLayer::clear();
-
-		if(_u_dW) {
-			delete [] _u_dW;
-			_u_dW = NULL;
-		}
-		if(_u_db) {
-			delete [] _u_db;
-			_u_db = NULL;
-		}
-		if(_u_vW) {
-			delete [] _u_vW;
-			_u_vW = NULL;
-		}
-		if(_u_vb) {
-			delete [] _u_vb;
-			_u_vb = NULL;
-		}
+		clearTraining();
 
 	}
+	// the packed prefixes, one output unit per line
 	void write(std::ofstream &fout) {
 
 		fout << _layer_type << std::endl;
 		fout << _actv_type << " ";
 		fout << _unit_count << " " << _prev_unit_count << " ";
-
-		for(int i=0;i<_unit_count;i++) {
-			for(int j=0;j<_prev_unit_count;j++)
-				fout << _u_W[i*_prev_unit_count+j] << " ";
-			fout<<std::endl;
+		fout << _range_start << " " << _width << " " << _height << std::endl;
+
+		const nnreal *w = _u_W;
+		for(int y=0;y<_height;y++) {
+			for(int i=0;i<_width;i++) {
+				for(int j=0;j<_range_start+i;j++)
+					fout << *w++ << " ";
+				fout<<std::endl;
+			}
 		}
 		for(int i=0;i<_unit_count;i++) {
 			fout << _u_b[i] << " ";
@@ -284,18 +296,32 @@ public:
 
 		fin >> _actv_type;
 		fin >> _unit_count >> _prev_unit_count;
+		fin >> _range_start >> _width >> _height;
+		_map_num = 1;
 
 		init();
 
-		for(int i=0;i<_unit_count;i++) {
-			for(int j=0;j<_prev_unit_count;j++)
-				fin >> _u_W[i*_prev_unit_count+j];
+		for(long i=0;i<weightCount();i++) {
+			fin >> _u_W[i];
 		}
 		for(int i=0;i<_unit_count;i++) {
 			fin >> _u_b[i];
 		}
 	}
 
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
+	void appendGradients(std::vector<std::pair<nnreal*, long> > &g) {
+		g.push_back(std::make_pair(_u_dW, weightCount()));
+		g.push_back(std::make_pair(_u_db, (long)_unit_count));
+	}
+
+protected:
+	void detachCopy(nnLayer *src) {
+		nnLayer::detachCopy(src);
+		_u_dW = _u_db = _u_vW = _u_vb = NULL;
+	}
 };
 
 
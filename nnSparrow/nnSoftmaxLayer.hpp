@@ -33,47 +33,59 @@
 
 class nnSoftmaxLayer : public nnFLayer {
 
+protected:
+	bool _normalize;
 
 public:
 	nnSoftmaxLayer(nnLayer *prev=NULL) : nnFLayer(prev) {
 
 		this->_layer_type = SOFTMAX_LAYER;
+		_normalize = true;
 	}
 
 	nnSoftmaxLayer(int n, nnLayer *prev, nnLayer *next = NULL) :	nnFLayer(n, SIGMOID, prev, next) {
 
 		this->_layer_type = SOFTMAX_LAYER;
+		_normalize = true;
+	}
+
+	// false leaves the logits in the activations, enough for the label: they have the same argmax
+	void setNormalize(bool nm) {
+		_normalize = nm;
 	}
 
 	void forward() {
- 		// [n, np]*[np, 1] + [n, 1]
-		//_u_a = _u_W * _prev->getActivation() + _u_b;
-		int n = _unit_count, np = _prev_unit_count;
-		memcpy(_u_a, _u_b, n*sizeof(double));
-
-		double *pa = _prev->getActivation();
-		for(int i=0;i<n;i++) {
-			double d = 0;
-			for(int j=0;j<np;j++) {
-				d += _u_W[i*np+j] * pa[j];
+		//_u_a = _prev->getActivation() * _u_W.transpose() + _u_b;
+		int n = _unit_count, bc = _batch_count;
+		product();
+		if(!_normalize)
+			return;
+
+		for(int b = 0; b < bc; b++) {
+			nnreal *ua = _u_a + b*n;
+			nnreal sum = 0;
+			nnreal maxv = ua[0];
+			for(int i=1;i<n;i++) {
+				if(ua[i] > maxv)
+					maxv = ua[i];
+			}
+
+			for(int i=0;i<n;i++) {
+				ua[i] -= maxv;
+			}
+			nnMath::exp(ua, n);
+			for(int i=0;i<n;i++) {
+				sum += ua[i];
+			}
+			for(int i=0;i<n;i++) {
+				ua[i] /= sum;
 			}
-			_u_a[i] += d;
 		}
-    double sum = 0;
-    double maxv = _u_a[0];
-    for(int i=1;i<n;i++) {
-      if(_u_a[i] > maxv)
-        maxv = _u_a[i];
-    }
-
-	  for(int i=0;i<n;i++) {
-      sum += exp(_u_a[i]-maxv);
-    }
-    for(int i=0;i<n;i++) {
-      _u_a[i] = exp(_u_a[i]-maxv) / sum;
-    }
 	}
 
+	nnLayer *replicate() {
+		return copyOf(this);
+	}
 };
 
 
@@ -35,6 +35,7 @@
 #include "nnPWSConvLayer.hpp"
 #include "nnSoftmaxLayer.hpp"
 #include "nnRangeLayer.hpp"
+#include "nnThreadPool.hpp"
 #include <cstdlib>
 #include <vector>
 #include <fstream>
@@ -42,6 +43,9 @@
 #include <cfloat>
 #include <ctime>
 #include <cassert>
+#include <algorithm>
+#include <map>
+#include <atomic>
 
 #ifndef __NN_SPARROW__
 #define __NN_SPARROW__
@@ -63,9 +67,43 @@ protected:
 	int _epoch_count;
 	double _momentum;
 	int _train_batch_count;
+	int _conv_engine;
+	int _weight_storage;
 	clock_t _run_time;
 	bool _ready;
 
+	// NULL runs every layer on the calling thread
+	nnThreadPool *_pool;
+	// least work of a thread when a layer splits its own loops, see setParallelThreshold()
+	long _parallel_threshold;
+	// indices in _layers by level: a layer only reads layers of lower levels, see schedule()
+	std::vector<std::vector<int> > _levels;
+	int _scheduled_count;
+
+	// the buffers of all layers, see buildArena()
+	nnArena *_arena;
+	int _arena_mode;
+	// largest batch count the layers were set up for
+	int _batch_size;
+
+	// the layers keep no training state, see freeze()
+	bool _frozen;
+	// activation buffers shared by the layers of a frozen network, see planActivations()
+	bool _plan_activations;
+	std::vector<nnreal*> _u_slots;
+	std::vector<long> _slot_size;
+
+	// the network whose weights the layers of a context run on, see createContext()
+	nnSparrow *_master;
+
+	// train() splits each mini-batch over contexts with gradients of their own, see setDataParallel()
+	bool _data_parallel;
+	// the contexts update the weights themselves, see setHogwild()
+	bool _hogwild;
+	std::vector<nnSparrow*> _workers;
+	// one-hot targets of the samples of a batch
+	std::vector<nnreal> _target;
+
 public:
 	nnSparrow() {
 		_momentum = 0.9;
@@ -75,15 +113,296 @@ public:
 		_error_bound = 0.00001;
 		_epoch_count = 20;
 		_train_batch_count = 10;
+		_conv_engine = nnFWSConvLayer::CONV_AUTO;
+		_weight_storage = nnHalf::NONE;
 		_avg_error = 0;
 		_ready = false;
 		_call_back = NULL;
 		_run_time = clock();
+		_pool = NULL;
+		_parallel_threshold = 1 << 17;
+		_scheduled_count = 0;
+		_arena = NULL;
+		_arena_mode = nnArena::ALIGNED;
+		_batch_size = 1;
+		_frozen = false;
+		_plan_activations = true;
+		_master = NULL;
+		_data_parallel = false;
+		_hogwild = false;
 
 	}
 
 	~nnSparrow() {
 		reset();
+		if(_pool)
+			delete _pool;
+	}
+
+	// inference only: the deltas, gradients and momentum of all layers are freed, about two thirds of the
+	// memory of a model. predict() then leaves the softmax unnormalized when only the label is asked for.
+	// train() brings them back zeroed.
+	void freeze() {
+		setTrainable(false);
+	}
+	bool isFrozen() {
+		return _frozen;
+	}
+	void setTrainable(bool t) {
+		_frozen = !t;
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->setTrainable(t);
+		layoutBuffers();
+	}
+
+	// a frozen network keeps only the activations still to be read: layers whose outputs are never needed
+	// at the same time share one buffer, see planActivations(). On by default; layers of an unplanned
+	// network keep their activations after predict().
+	void setActivationPlanning(bool p) {
+		_plan_activations = p;
+		layoutBuffers();
+	}
+	bool getActivationPlanning() {
+		return _plan_activations;
+	}
+	// bytes of the activations of all layers but the input layers
+	size_t getActivationBytes() {
+		long n = 0;
+		if(!_u_slots.empty()) {
+			for(int i = 0; i < _slot_size.size(); i++)
+				n += _slot_size[i];
+		}
+		else {
+			for(int i = 0; i < _layers.size(); i++)
+				n += _layers[i]->getActivationSize();
+		}
+		return n * sizeof(nnreal);
+	}
+
+	// nnArena::ALIGNED (default) keeps the activations, deltas, weights, gradients and velocities of
+	// all layers in one block, every buffer on a cache line; nnArena::HUGE_PAGES backs it with 2MB
+	// pages; nnArena::HEAP leaves each buffer to its own new[].
+	void setArenaMode(int mode) {
+		_arena_mode = mode;
+		buildArena();
+	}
+	int getArenaMode() {
+		return _arena_mode;
+	}
+	// bytes of the arena, 0 without one
+	size_t getArenaSize() {
+		return _arena ? _arena->getSize() : 0;
+	}
+
+	// lifetime of the activations of a layer: from its level to the last level reading them, the output
+	// layer and layers nothing reads to the end of the pass. The children of joint layers write into
+	// the joint's buffer, which then lives from the first child. Each activation goes to a free slot,
+	// the smallest one large enough or else the largest one, which grows.
+	void planActivations() {
+
+		unplanActivations();
+		if(!_frozen || !_plan_activations || _layers.empty())
+			return;
+		if(_scheduled_count != _layers.size())
+			schedule();
+
+		int n = _layers.size(), nl = _levels.size();
+		std::map<nnLayer*, int> index;
+		std::vector<int> level(n), birth(n), death(n), slot(n, -1);
+		std::vector<long> size(n);
+		std::vector<nnLayer*> in;
+		for(int l = 0; l < nl; l++) {
+			for(int k = 0; k < _levels[l].size(); k++)
+				level[_levels[l][k]] = l;
+		}
+		for(int i = 0; i < n; i++) {
+			index[_layers[i]] = i;
+			size[i] = _layers[i]->getActivationSize();
+			birth[i] = level[i];
+			death[i] = i == n - 1 ? nl : -1;
+			in.clear();
+			_layers[i]->appendInputLayers(in);
+			for(int j = 0; j < in.size(); j++) {
+				std::map<nnLayer*, int>::iterator it = index.find(in[j]);
+				if(it == index.end())
+					continue;
+				int p = it->second;
+				death[p] = std::max(death[p], level[i]);
+				if(size[p] == 0)
+					birth[i] = std::min(birth[i], birth[p]);
+			}
+		}
+		for(int i = 0; i < n; i++) {
+			if(death[i] < 0)
+				death[i] = nl;
+		}
+
+		std::vector<int> order(n);
+		for(int i = 0; i < n; i++)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](int x, int y) { return birth[x] < birth[y]; });
+
+		std::vector<int> busy;
+		_slot_size.clear();
+		for(int k = 0; k < n; k++) {
+			int i = order[k], s = -1;
+			if(size[i] == 0)
+				continue;
+			for(int j = 0; j < busy.size(); j++) {
+				if(busy[j] >= birth[i])
+					continue;
+				bool fj = _slot_size[j] >= size[i], fs = s >= 0 && _slot_size[s] >= size[i];
+				if(s < 0 || (fj && (!fs || _slot_size[j] < _slot_size[s])) || (!fj && !fs && _slot_size[j] > _slot_size[s]))
+					s = j;
+			}
+			if(s < 0) {
+				s = busy.size();
+				busy.push_back(0);
+				_slot_size.push_back(0);
+			}
+			busy[s] = death[i];
+			_slot_size[s] = std::max(_slot_size[s], size[i]);
+			slot[i] = s;
+		}
+
+		for(int s = 0; s < _slot_size.size(); s++)
+			_u_slots.push_back(new nnreal[_slot_size[s]]);
+		for(int i = 0; i < n; i++) {
+			if(slot[i] >= 0)
+				_layers[i]->placeActivation(_u_slots[slot[i]]);
+		}
+	}
+	// the layers take their own activation buffers back
+	void unplanActivations() {
+
+		if(_u_slots.empty())
+			return;
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->initBatch();
+		freeSlots();
+	}
+	void freeSlots() {
+		for(int s = 0; s < _u_slots.size(); s++)
+			delete [] _u_slots[s];
+		_u_slots.clear();
+		_slot_size.clear();
+	}
+
+	void layoutBuffers() {
+		planActivations();
+		buildArena();
+	}
+
+	// move the buffers of all layers into a new arena, in layer order. Called once the layers are set
+	// up and whenever buffers were reallocated: weight storage changes and larger batches.
+	void buildArena() {
+
+		if((_arena_mode == nnArena::HEAP && !_arena) || _master)
+			return;
+		nnArena *a = new nnArena();
+		for(int i = 0; i < _inputlayers.size(); i++)
+			_inputlayers[i]->appendBuffers(*a);
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->appendBuffers(*a);
+		a->build(_arena_mode, _arena);
+
+		for(int i = 0; i < _inputlayers.size(); i++)
+			_inputlayers[i]->setArena(a);
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->setArena(a);
+		if(_arena)
+			delete _arena;
+		_arena = a;
+	}
+
+	// threads running the independent layers of a level together, 1 (default) runs them in order.
+	// A layer running alone also splits its own loops among them, see setParallelThreshold().
+	void setThreadCount(int n) {
+		if(_pool)
+			delete _pool;
+		_pool = n > 1 ? new nnThreadPool(n) : NULL;
+		shareThreads();
+	}
+	int getThreadCount() {
+		return _pool ? _pool->getThreadCount() : 1;
+	}
+
+	// a layer splits the maps, rows or weights of its forward, backward or update among the threads
+	// when each thread gets at least n multiply-adds, 0 never splits. Inside a level of several layers,
+	// and in contexts, the layers run serially.
+	void setParallelThreshold(long n) {
+		_parallel_threshold = n;
+		shareThreads();
+	}
+	long getParallelThreshold() {
+		return _parallel_threshold;
+	}
+
+	// a frozen network of copies of the layers, reading the weights of this one and keeping its own
+	// activations and scratch buffers (and the filter transforms of the FWS engines). Threads each
+	// predict() on a context of their own at the same time, without locks. The weights are not copied,
+	// so the contexts must be deleted before this network changes them or moves them: train(), prune(),
+	// load(), reset(), setWeightStorage(), setArenaMode() or setBatchCount() beyond the largest batch so
+	// far. Contexts cannot be trained and keep their buffers out of an arena.
+	nnSparrow *createContext() {
+
+		nnSparrow *c = new nnSparrow();
+		c->_master = this;
+		c->_conv_engine = _conv_engine;
+		c->_weight_storage = _weight_storage;
+		c->_arena_mode = nnArena::HEAP;
+		c->_plan_activations = _plan_activations;
+		c->_frozen = true;
+		c->_ready = true;
+
+		std::map<nnLayer*, nnLayer*> copies;
+		for(int i = 0; i < _inputlayers.size(); i++) {
+			c->_inputlayers.push_back((nnInputLayer*)_inputlayers[i]->replicate());
+			copies[_inputlayers[i]] = c->_inputlayers[i];
+		}
+		for(int i = 0; i < _layers.size(); i++) {
+			c->_layers.push_back(_layers[i]->replicate());
+			copies[_layers[i]] = c->_layers[i];
+		}
+		for(int i = 0; i < c->_inputlayers.size(); i++)
+			c->_inputlayers[i]->relink(copies);
+		for(int i = 0; i < c->_layers.size(); i++)
+			c->_layers[i]->relink(copies);
+		for(int i = 0; i < c->_inputlayers.size(); i++)
+			c->_inputlayers[i]->initBatch();
+		for(int i = 0; i < c->_layers.size(); i++)
+			c->_layers[i]->initBatch();
+		c->layoutBuffers();
+		return c;
+	}
+	nnSparrow *getMaster() {
+		return _master;
+	}
+
+	// with more than one thread (see setThreadCount()), train() gives each thread a slice of every mini-batch
+	// to run forward and backward on a trainable context. The gradients of the contexts are summed into
+	// the layers' before the one update of the batch, the same update as one thread up to rounding.
+	// Off by default: threads then run independent layers only.
+	void setDataParallel(bool p) {
+		_data_parallel = p;
+	}
+	bool getDataParallel() {
+		return _data_parallel;
+	}
+
+	// asynchronous training with more than one thread: each thread takes the next mini-batch, runs it on a
+	// trainable context and updates the weights with the momentum of its context, without waiting for or
+	// locking out the others (Hogwild). The threads race on the weights on purpose: an update may read
+	// weights another has just changed, which SGD absorbs. No reduction or barrier, at the cost of results
+	// that depend on the timing of the threads. The updates load and store the weights by relaxed atomics,
+	// but the products of forward and backward read them with plain vector loads while other threads
+	// store: a data race, undefined in C++, that is benign with GCC on x86-64 (aligned 8 byte stores are
+	// never torn) and not promised elsewhere. Takes precedence over setDataParallel().
+	void setHogwild(bool h) {
+		_hogwild = h;
+	}
+	bool getHogwild() {
+		return _hogwild;
 	}
 
 	clock_t getRunTime() {
@@ -115,6 +434,69 @@ public:
 	void setLearningDecayRate(double a) {
 		this->_learning_decay_rate = a;
 	}
+	// engine of the FWS conv layers, also used by the layers created in load()
+	// layers that cannot run the engine keep their own
+	void setConvEngine(int e) {
+		_conv_engine = e;
+		for(int i = 0; i < _layers.size(); i++) {
+			if(_layers[i]->getLayerType() == nnLayer::FWS_CONV_LAYER)
+				((nnFWSConvLayer*)_layers[i])->setEngine(e);
+		}
+	}
+
+	// nnHalf::FP16 or BF16 keep the weights of the full and conv layers in 16 bit for inference,
+	// half the memory and traffic of nnreal weights. train() widens them back to nnHalf::NONE.
+	void setWeightStorage(int type) {
+		if(_master)
+			return;
+		_weight_storage = type;
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->setWeightStorage(type);
+		layoutBuffers();
+	}
+	int getWeightStorage() {
+		return _weight_storage;
+	}
+
+	// magnitude pruning of the full, softmax and FWS conv weights: the fraction sparsity of smallest ones is zeroed,
+	// over all these layers together or, with per_layer, in each of them. Later training keeps them at zero, so
+	// train() afterwards fine-tunes the pruned network. Layers whose density is below nnKernel::sparseBreakEven()
+	// switch their forward pass to CSR kernels.
+	void prune(double sparsity, bool per_layer = false) {
+
+		if(_master)
+			return;
+		int ws = _weight_storage;
+		setWeightStorage(nnHalf::NONE);
+
+		std::vector<nnreal> m;
+		double threshold = 0;
+		if(!per_layer) {
+			for(int i = 0; i < _layers.size(); i++)
+				_layers[i]->appendWeightMagnitudes(m);
+			threshold = pruneThreshold(m, sparsity);
+		}
+		for(int i = 0; i < _layers.size(); i++) {
+			if(per_layer) {
+				m.clear();
+				_layers[i]->appendWeightMagnitudes(m);
+				threshold = pruneThreshold(m, sparsity);
+			}
+			_layers[i]->prune(threshold);
+		}
+		setWeightStorage(ws);
+	}
+
+	// the magnitude below which the fraction sparsity of m lies
+	static double pruneThreshold(std::vector<nnreal> &m, double sparsity) {
+		int k = (int)(sparsity * m.size());
+		if(m.empty() || k <= 0)
+			return 0;
+		if(k >= m.size())
+			return DBL_MAX;
+		std::nth_element(m.begin(), m.begin() + k, m.end());
+		return m[k];
+	}
 
 	double getAvgError() {
 		return this->_avg_error;
@@ -122,6 +504,8 @@ public:
 
 	void reset() {
 		while(!_layers.empty()) {
+			if(_master)
+				_layers.back()->detachWeights();
 			delete _layers.back();
 			_layers.pop_back();
 		}
@@ -129,13 +513,104 @@ public:
 			delete _inputlayers.back();
 			_inputlayers.pop_back();
 		}
+		if(_arena) {
+			delete _arena;
+			_arena = NULL;
+		}
+		freeSlots();
+		_batch_size = 1;
+		_levels.clear();
+		_scheduled_count = 0;
 		_ready = false;
+		_master = NULL;
+	}
+
+	// level of a layer: 1 + the highest level of the layers it reads, input layers being at -1.
+	// Layers are added after the layers they read, so one pass in order finds them all.
+	void schedule() {
+
+		std::map<nnLayer*, int> level;
+		std::vector<nnLayer*> in;
+		_levels.clear();
+		for(int i = 0; i < _layers.size(); i++) {
+			int lv = 0;
+			in.clear();
+			_layers[i]->appendInputLayers(in);
+			for(int j = 0; j < in.size(); j++) {
+				std::map<nnLayer*, int>::iterator it = level.find(in[j]);
+				if(it != level.end())
+					lv = std::max(lv, it->second + 1);
+			}
+			level[_layers[i]] = lv;
+			if(lv >= _levels.size())
+				_levels.resize(lv + 1);
+			_levels[lv].push_back(i);
+		}
+		_scheduled_count = _layers.size();
+		shareThreads();
+	}
+	void shareThreads() {
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->setThreadPool(_pool, _parallel_threshold);
+	}
+
+	// forward pass by level, the layers of a level on the thread pool
+	void forwardLayers() {
+		if(_scheduled_count != _layers.size())
+			schedule();
+		for(int l = 0; l < _levels.size(); l++)
+			runLevel(_levels[l], [](nnLayer *y) { y->forward(); });
+	}
+	// backpropagation from the last level to the first. Only input layers may feed more than one layer:
+	// a layer receives its delta from the single layer reading it.
+	void backwardLayers() {
+		if(_scheduled_count != _layers.size())
+			schedule();
+		for(int l = _levels.size() - 1; l >= 0; l--)
+			runLevel(_levels[l], [](nnLayer *y) { y->backpropagation(); });
+	}
+	// layers with weights enough to split their own update take the threads in turn, the others
+	// update together
+	void updateLayers(int m, double alpha, double lambda, double mu) {
+		if(_pool) {
+			std::vector<int> rest;
+			for(int i = 0; i < _layers.size(); i++) {
+				if(_parallel_threshold > 0 && _layers[i]->getParameterCount() >= 2 * _parallel_threshold)
+					_layers[i]->updateParameters(m, alpha, lambda, mu);
+				else
+					rest.push_back(i);
+			}
+			_pool->parallelFor(rest.size(), [&](int i) { _layers[rest[i]]->updateParameters(m, alpha, lambda, mu); });
+		}
+		else {
+			for(int i = _layers.size() - 1; i >= 0; i--)
+				_layers[i]->updateParameters(m, alpha, lambda, mu);
+		}
+	}
+
+	template<typename F>
+	void runLevel(const std::vector<int> &lv, F f) {
+		if(_pool)
+			_pool->parallelFor(lv.size(), [&](int i) { f(_layers[lv[i]]); });
+		else {
+			for(int i = 0; i < lv.size(); i++)
+				f(_layers[lv[i]]);
+		}
 	}
 
 
 	int getLayerCount() {
 		return _layers.size();
 	}
+	nnLayer *getLayer(int i) {
+		return _layers[i];
+	}
+	int getInputLayerCount() {
+		return _inputlayers.size();
+	}
+	nnInputLayer *getInputLayer(int i) {
+		return _inputlayers[i];
+	}
 
 	void addLayer(nnLayer *l) {
 
@@ -152,10 +627,14 @@ public:
 		for(int i=0;i<_layers.size();i++) {
 			_layers[i]->write(fout);
 		}
+		fout << _weight_storage << std::endl;
 	}
 
-	void load(const char *path) {
+	// inference_only loads a frozen model, see freeze(): the training buffers are never allocated
+	void load(const char *path, bool inference_only = false) {
 
+		if(_master)
+			return;
 		std::ifstream fin(path);
 		fin >> _momentum >> _learning_rate >> _learning_decay_rate >> _weight_decay_parameter;
 		int n = 0;
@@ -179,6 +658,7 @@ public:
 					break;
 				case nnLayer::FWS_CONV_LAYER:
 					l = new nnFWSConvLayer();
+					((nnFWSConvLayer*)l)->setEngine(_conv_engine);
 					break;
 				case nnLayer::PWS_CONV_LAYER:
 					l = new nnPWSConvLayer();
@@ -192,6 +672,9 @@ public:
 				case nnLayer::SOFTMAX_LAYER:
 					l = new nnSoftmaxLayer();
 					break;
+				case nnLayer::RANGE_LAYER:
+					l = new nnRangeLayer();
+					break;
 				default:
 					break;
 			}
@@ -199,6 +682,7 @@ public:
 				l->setPrevLayer(_layers.back());
 			}
 			_layers.push_back(l);
+			l->setTrainable(!inference_only);
 			l->read(fin);
 		}
 
@@ -206,6 +690,13 @@ public:
 		// 	_layers[i]->setPrevLayer(_layers[i-1]);
 		// }
 		_layers[0]->setPrevLayer(_inputlayers[0]);
+
+		// the weight storage closes the file, files written before it was saved have none
+		int ws;
+		if(!(fin >> ws))
+			ws = nnHalf::NONE;
+		_frozen = inference_only;
+		setWeightStorage(ws);
 		_ready = true;
 	}
 
@@ -217,11 +708,12 @@ public:
 		return l;
 	}
 
-	nnLayer* addFWSConvLayer(nnLayer* pl, int w, int h, int nm, int at = SIGMOID) {
+	nnLayer* addFWSConvLayer(nnLayer* pl, int w, int h, int nm, int at = SIGMOID, int engine = nnFWSConvLayer::CONV_AUTO) {
 		// if(_layers.empty())
 		// 	return NULL;
 		//nnLayer *pl = _layers.back();
 		nnFWSConvLayer *l = new nnFWSConvLayer(w, h, nm, at, pl, NULL);
+		l->setEngine(engine);
 		_layers.push_back((nnLayer*)l);
 		if(pl) {
 			pl->setNextLayer((nnLayer*)l);
@@ -319,6 +811,22 @@ public:
 	}
 
 
+	// number of samples the next forward/backpropagation of every layer processes
+	void setBatchCount(int bc) {
+
+		for(int i=0;i<_inputlayers.size();i++) {
+			_inputlayers[i]->setBatchCount(bc);
+		}
+		for(int i=0;i<_layers.size();i++) {
+			_layers[i]->setBatchCount(bc);
+		}
+		// the grown buffers were allocated outside the arena
+		if(bc > _batch_size) {
+			_batch_size = bc;
+			layoutBuffers();
+		}
+	}
+
 	void prepare() {
 
 		for(int i=0;i<_layers.size();i++) {
@@ -327,7 +835,7 @@ public:
 		for(int i=0;i<_inputlayers.size();i++) {
 			_inputlayers[i]->init();
 		}
-
+		setWeightStorage(_weight_storage);
 	}
 
 
@@ -339,12 +847,19 @@ public:
 			return false;
 		if(_inputlayers.front()->getTotalUnitCount() != input[0].size())
 			return false;
+		if(_master)
+			return false;
 		if(!_ready) {
 			prepare();
 			_ready = true;
 		}
-
-		int sz = _layers.size();
+		if(_frozen)
+			setTrainable(true);
+		if(_weight_storage != nnHalf::NONE)
+			setWeightStorage(nnHalf::NONE);
+		// the first update outdates the CSR copies, updateSparse() rebuilds them after training
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->clearSparse();
 
 		int len = input.size();
 		//int dim = input[0].size();
@@ -356,80 +871,167 @@ public:
 		}
 		_avg_error = 100;
 
-		double *ovec = new double[odim];
-
-		//nnInputLayer *input_layer = (nnInputLayer*)_layers.front();
-		nnFLayer *output_layer = (nnFLayer*)_layers.back();
+		//samples of a mini-batch go through the layers together
+		int bs = MIN(len, _train_batch_count > 0 ? _train_batch_count : 1);
+		int nw = _hogwild ? getThreadCount() : _data_parallel ? MIN(getThreadCount(), bs) : 1;
+		for(int t = 0; nw > 1 && t < nw; t++) {
+			_workers.push_back(createContext());
+			_workers[t]->setTrainable(true);
+			for(int i = 0; _hogwild && i < _layers.size(); i++)
+				_workers[t]->_layers[i]->setRacing(true);
+		}
 
 		int *rank = new int[len];
 		for(int i=0;i<len;i++)
 			rank[i] = i;
 
 		double E = 0;
-		unsigned long long itr;
-		unsigned long long tot = this->_epoch_count * len;
-		for(itr = 0; itr < tot; itr++) {
-
-			int idx = itr % len;
-			if(idx == 0) {
+		for(int ep = 0; ep < _epoch_count; ep++) {
 
-				//shuffle is important!!!
-				for(int i=0;i<len;i++) {
-					int j = i + rand() % (len - i);
-					std::swap(rank[i], rank[j]);
+			if(ep > 0) {
+				E /= len;
+				if(fabs(E-_avg_error) < _error_bound) {
+						printf("%lf %lf\n", E, _avg_error );
+						break;
 				}
+				_avg_error = E;
+				E = 0;
+				_learning_rate *= _learning_decay_rate;
+				if(this->_call_back)
+					this->_call_back(this);
+			}
+
+			//shuffle is important!!!
+			for(int i=0;i<len;i++) {
+				int j = i + rand() % (len - i);
+				std::swap(rank[i], rank[j]);
+			}
+			_run_time = clock();
 
-				if(itr > 0) {
-					E /= len;
-					if(itr > 0 && fabs(E-_avg_error) < _error_bound) {
-							printf("%lf %lf\n", E, _avg_error );
-							break;
-					}
-					_avg_error = E;
-					E = 0;
-					_learning_rate *= _learning_decay_rate;
-					if(this->_call_back)
-						this->_call_back(this);
+			if(_hogwild && !_workers.empty()) {
+				E += trainHogwild(input, output, rank, len, bs, odim);
+				continue;
+			}
+			for(int st = 0; st < len; st += bs) {
+
+				int bc = MIN(bs, len - st);
+				if(_workers.empty())
+					E += trainStep(input, output, rank + st, bc, odim);
+				else
+					E += trainParallel(input, output, rank + st, bc, odim);
+				updateLayers(bc, _learning_rate, _weight_decay_parameter, _momentum);
+				for(int t = 0; t < _workers.size(); t++) {
+					for(int i = 0; i < _layers.size(); i++)
+						_workers[t]->_layers[i]->weightsChanged();
 				}
-				_run_time = clock();
 			}
+		}
 
-			//printf("%d\n", idx);
-			idx = rank[idx];
+		delete [] rank;
+		for(int t = 0; t < _workers.size(); t++)
+			delete _workers[t];
+		_workers.clear();
 
-			for(int i=0;i<_inputlayers.size();i++)
-				_inputlayers[i]->inputSample(&input[idx][0], input[idx].size());
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->updateSparse();
 
-			for(int j=0;j<sz;j++) {
-				_layers[j]->forward();
-			}
+		return true;
+	}
 
+	// forward and backward on the bc samples idx of a mini-batch, adding to the gradients of the layers;
+	// returns the absolute error of the outputs
+	double trainStep(std::vector<std::vector<double> > &input, std::vector<int> &output, const int *idx, int bc, int odim) {
 
-			memset(ovec, 0, sizeof(double)*odim);
-			ovec[output[idx]] = 1;
+		nnFLayer *output_layer = (nnFLayer*)_layers.back();
+		setBatchCount(bc);
 
-			output_layer->calculateDelta(ovec, odim);
-			double *a = output_layer->getActivation();
-			for(int i=0;i<odim;i++) {
-				double t = a[i] - ovec[i];
-				E += fabs(t);
-			}
+		for(int b=0;b<bc;b++) {
+			for(int i=0;i<_inputlayers.size();i++)
+				_inputlayers[i]->inputSample(&input[idx[b]][0], input[idx[b]].size(), b);
+		}
 
-			for(int j=sz-1;j>=0;j--) {
-				_layers[j]->backpropagation();
-			}
+		forwardLayers();
+
+		_target.assign(bc*odim, 0);
+		for(int b=0;b<bc;b++)
+			_target[b*odim + output[idx[b]]] = 1;
+
+		output_layer->calculateDelta(&_target[0], odim);
+		nnreal *a = output_layer->getActivation();
+		double E = 0;
+		for(int i=0;i<bc*odim;i++) {
+			double t = a[i] - _target[i];
+			E += fabs(t);
+		}
+
+		backwardLayers();
+		return E;
+	}
 
-			if(itr % _train_batch_count == 0) {
-				for(int j=sz-1;j>=0;j--) {
-					_layers[j]->updateParameters(_train_batch_count, _learning_rate, _weight_decay_parameter, _momentum);
+	// trainStep() of a slice of the mini-batch on each worker, then the gradients of the workers summed
+	// into the layers. Contiguous parts of all gradients go to different threads, each adding the workers
+	// in order, so the sums do not depend on the threads.
+	double trainParallel(std::vector<std::vector<double> > &input, std::vector<int> &output, const int *idx, int bc, int odim) {
+
+		int nw = MIN(_workers.size(), bc);
+		std::vector<double> E(nw, 0);
+		_pool->parallelFor(nw, [&](int t) {
+			int b0 = (long)bc * t / nw, b1 = (long)bc * (t + 1) / nw;
+			E[t] = _workers[t]->trainStep(input, output, idx + b0, b1 - b0, odim);
+		});
+
+		std::vector<std::vector<std::pair<nnreal*, long> > > g(nw + 1);
+		for(int i = 0; i < _layers.size(); i++) {
+			_layers[i]->appendGradients(g[0]);
+			for(int t = 0; t < nw; t++)
+				_workers[t]->_layers[i]->appendGradients(g[t + 1]);
+		}
+		std::vector<long> start(g[0].size() + 1, 0);
+		for(int k = 0; k < g[0].size(); k++)
+			start[k + 1] = start[k] + g[0][k].second;
+
+		_pool->parallelRange(start.back(), 4096, [&](long b, long e) {
+			for(int k = 0; k < g[0].size(); k++) {
+				long lo = std::max(b, start[k]), hi = std::min(e, start[k + 1]);
+				if(lo >= hi)
+					continue;
+				nnreal *m = g[0][k].first + (lo - start[k]);
+				for(int t = 1; t <= nw; t++) {
+					nnreal *w = g[t][k].first + (lo - start[k]);
+					nnKernel::axpy(hi - lo, (nnreal)1, w, 1, m);
+					memset(w, 0, (hi - lo)*sizeof(nnreal));
 				}
 			}
-		}
+		});
 
-		delete [] rank;
-		delete [] ovec;
+		double sum = 0;
+		for(int t = 0; t < nw; t++)
+			sum += E[t];
+		return sum;
+	}
 
-		return true;
+	// an epoch of the mini-batches of rank, each worker taking the next one and updating the weights on its own,
+	// see setHogwild(). The layers of this network then redo what they derived from the weights.
+	double trainHogwild(std::vector<std::vector<double> > &input, std::vector<int> &output, const int *rank, int len, int bs, int odim) {
+
+		int nb = (len + bs - 1) / bs, nw = _workers.size();
+		std::atomic<int> next(0);
+		std::vector<double> E(nw, 0);
+		_pool->parallelFor(nw, [&](int t) {
+			nnSparrow *w = _workers[t];
+			for(int c = next++; c < nb; c = next++) {
+				int st = c * bs, bc = MIN(bs, len - st);
+				E[t] += w->trainStep(input, output, rank + st, bc, odim);
+				w->updateLayers(bc, _learning_rate, _weight_decay_parameter, _momentum);
+			}
+		});
+
+		for(int i = 0; i < _layers.size(); i++)
+			_layers[i]->weightsChanged();
+		double sum = 0;
+		for(int t = 0; t < nw; t++)
+			sum += E[t];
+		return sum;
 	}
 
 	bool predict(std::vector<double> &input, int &output, double *ovec=NULL) {
@@ -442,19 +1044,23 @@ public:
 		if(_inputlayers.front()->getTotalUnitCount() != dim)
 			return false;
 
+		setBatchCount(1);
 		for(int i=0;i<_inputlayers.size();i++)
 			_inputlayers[i]->inputSample(&input[0], dim);
 
 
-		int sz = _layers.size();
-		for(int i=0;i<sz;i++) {
-			_layers[i]->forward();
-		}
+		// the label alone is the argmax of the logits
+		bool logits = _frozen && !ovec && _layers.back()->getLayerType() == nnLayer::SOFTMAX_LAYER;
+		if(logits)
+			((nnSoftmaxLayer*)_layers.back())->setNormalize(false);
+		forwardLayers();
+		if(logits)
+			((nnSoftmaxLayer*)_layers.back())->setNormalize(true);
 
 
 		output = 0;
 
-		double *af = ((nnFLayer*)_layers.back())->getActivation();
+		nnreal *af = ((nnFLayer*)_layers.back())->getActivation();
 		for(int i=1;i<_layers.back()->getUnitCount();i++) {
 			if(af[i] > af[output])
 				output = i;
@@ -469,23 +1075,111 @@ public:
 		return true;
 	}
 
-	void backprop_once(double *ovec, int odim, double conf) {
+	// labels of all inputs and, with probs, their output vectors. Chunks of batch inputs run as one batch
+	// on a context of the network (see createContext()), one context for each thread of setThreadCount()
+	// taking the next chunk until none is left. Training may go on afterwards, e.g. from the callback.
+	bool predictBatch(std::vector<std::vector<double> > &input, std::vector<int> &labels,
+		std::vector<std::vector<double> > *probs = NULL, int batch = 32) {
+
+		if(_inputlayers.size() < 1 || _layers.size() < 1 || batch < 1)
+			return false;
+		int len = input.size(), dim = _inputlayers.front()->getTotalUnitCount();
+		for(int i = 0; i < len; i++) {
+			if(input[i].size() != dim)
+				return false;
+		}
+		labels.assign(len, 0);
+		if(probs)
+			probs->assign(len, std::vector<double>(_layers.back()->getUnitCount()));
+
+		int nc = (len + batch - 1) / batch;
+		int nt = MIN(getThreadCount(), nc);
+		std::vector<nnSparrow*> ctx;
+		for(int t = 0; t < nt; t++)
+			ctx.push_back(createContext());
+
+		std::atomic<int> next(0);
+		auto work = [&](int t) {
+			for(int c = next++; c < nc; c = next++)
+				ctx[t]->predictChunk(input, c*batch, MIN(len, (c + 1)*batch), labels, probs);
+		};
+		if(_pool && nt > 1)
+			_pool->parallelFor(nt, work);
+		else if(nt > 0)
+			work(0);
+
+		for(int t = 0; t < nt; t++)
+			delete ctx[t];
+		return true;
+	}
+
+	// the fraction of input predicted as labels by predictBatch(); confusion[t][p] counts the inputs of
+	// label t predicted as p
+	double evaluate(std::vector<std::vector<double> > &input, std::vector<int> &labels,
+		std::vector<std::vector<int> > *confusion = NULL, int batch = 32) {
+
+		std::vector<int> pred;
+		if(input.empty() || labels.size() != input.size() || !predictBatch(input, pred, NULL, batch))
+			return 0;
+		int n = _layers.back()->getUnitCount(), correct = 0;
+		if(confusion)
+			confusion->assign(n, std::vector<int>(n, 0));
+		for(int i = 0; i < pred.size(); i++) {
+			correct += pred[i] == labels[i];
+			if(confusion && labels[i] >= 0 && labels[i] < n)
+				(*confusion)[labels[i]][pred[i]]++;
+		}
+		return (double)correct / pred.size();
+	}
+
+	// input [st, end) as one batch, see predictBatch()
+	void predictChunk(std::vector<std::vector<double> > &input, int st, int end, std::vector<int> &labels,
+		std::vector<std::vector<double> > *probs) {
+
+		int bc = end - st, n = _layers.back()->getUnitCount();
+		setBatchCount(bc);
+		for(int b = 0; b < bc; b++) {
+			for(int i=0;i<_inputlayers.size();i++)
+				_inputlayers[i]->inputSample(&input[st + b][0], input[st + b].size(), b);
+		}
+
+		bool logits = !probs && _layers.back()->getLayerType() == nnLayer::SOFTMAX_LAYER;
+		if(logits)
+			((nnSoftmaxLayer*)_layers.back())->setNormalize(false);
+		forwardLayers();
+		if(logits)
+			((nnSoftmaxLayer*)_layers.back())->setNormalize(true);
+
+		nnreal *af = _layers.back()->getActivation();
+		for(int b = 0; b < bc; b++, af += n) {
+			int o = 0;
+			for(int i = 1; i < n; i++) {
+				if(af[i] > af[o])
+					o = i;
+			}
+			labels[st + b] = o;
+			if(probs) {
+				for(int i = 0; i < n; i++)
+					(*probs)[st + b][i] = af[i];
+			}
+		}
+	}
+
+	// needs the training state, a frozen model is left as it is
+	void backprop_once(nnreal *ovec, int odim, double conf) {
+
+		if(_frozen)
+			return;
 
 		nnSoftmaxLayer *output_layer = (nnSoftmaxLayer*)_layers.back();
 		output_layer->calculateDelta(ovec, odim);
-		double *dt = output_layer->getDelta();
+		nnreal *dt = output_layer->getDelta();
 		for(int i=0;i<odim;i++) {
 			dt[i] *= conf;
 		}
 
-		int sz = _layers.size();
-		for(int j=sz-1;j>=0;j--) {
-			_layers[j]->backpropagation();
-		}
-
-		for(int j=sz-1;j>=0;j--) {
-			_layers[j]->updateParameters(1, 0.1, 0, 0);
-		}
+		backwardLayers();
+		updateLayers(1, 0.1, 0, 0);
 	}
 };
 
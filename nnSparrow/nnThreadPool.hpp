@@ -0,0 +1,160 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#ifndef __NN_THREAD_POOL__
+#define __NN_THREAD_POOL__
+
+// Fixed set of worker threads running parallelFor jobs. The calling thread takes part in its job, and a
+// parallelFor started from inside a job runs serially on the calling thread.
+class nnThreadPool {
+
+protected:
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+	// held by the caller of a parallelFor for the whole job
+	std::mutex _serial;
+
+	// current job: tasks [0, _task_count) handed out through _next_task
+	std::function<void(int)> _job;
+	int _task_count;
+	std::atomic<int> _next_task;
+	int _busy;
+	long _generation;
+	bool _stop;
+
+	static bool &insideJob() {
+		static thread_local bool inside = false;
+		return inside;
+	}
+
+	void runTasks() {
+		insideJob() = true;
+		for(int i; (i = _next_task.fetch_add(1)) < _task_count; )
+			_job(i);
+		insideJob() = false;
+	}
+
+	void work() {
+		long seen = 0;
+		std::unique_lock<std::mutex> lock(_mutex);
+		for(;;) {
+			_wake.wait(lock, [&]() { return _stop || _generation != seen; });
+			if(_stop)
+				return;
+			seen = _generation;
+			_busy++;
+			lock.unlock();
+			runTasks();
+			lock.lock();
+			if(--_busy == 0)
+				_done.notify_all();
+		}
+	}
+
+public:
+	// n threads in all, the caller of parallelFor included; 0 for one per hardware thread
+	nnThreadPool(int n = 0) {
+		if(n <= 0)
+			n = std::thread::hardware_concurrency();
+		_task_count = 0;
+		_next_task = 0;
+		_busy = 0;
+		_generation = 0;
+		_stop = false;
+		for(int i = 1; i < n; i++)
+			_workers.push_back(std::thread(&nnThreadPool::work, this));
+	}
+	~nnThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_wake.notify_all();
+		for(int i = 0; i < _workers.size(); i++)
+			_workers[i].join();
+	}
+
+	int getThreadCount() {
+		return _workers.size() + 1;
+	}
+
+	// f(i) for every i in [0, n), returns when all have run
+	void parallelFor(int n, const std::function<void(int)> &f) {
+
+		if(n <= 0)
+			return;
+		if(n == 1 || _workers.empty() || insideJob()) {
+			for(int i = 0; i < n; i++)
+				f(i);
+			return;
+		}
+
+		// one job at a time, threads of other jobs wait here
+		std::lock_guard<std::mutex> serial(_serial);
+		std::unique_lock<std::mutex> lock(_mutex);
+		// a worker late for the previous job may still be looking at it
+		_done.wait(lock, [&]() { return _busy == 0; });
+		_job = f;
+		_task_count = n;
+		_next_task = 0;
+		_generation++;
+		lock.unlock();
+		_wake.notify_all();
+		runTasks();
+
+		lock.lock();
+		_done.wait(lock, [&]() { return _busy == 0; });
+	}
+
+	// [0, n) split in at most getThreadCount() contiguous ranges [begin, end), none shorter than grain;
+	// long, the flat gradients of a whole network may hold more than 2^31 values
+	void parallelRange(long n, long grain, const std::function<void(long, long)> &f) {
+
+		int parts = getThreadCount();
+		if(grain > 0 && n / grain < parts)
+			parts = n / grain;
+		if(parts <= 1) {
+			if(n > 0)
+				f(0, n);
+			return;
+		}
+		parallelFor(parts, [&](int p) {
+			f(n * p / parts, n * (p + 1) / parts);
+		});
+	}
+};
+
+#endif
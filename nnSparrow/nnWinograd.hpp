@@ -0,0 +1,284 @@
+/*
+    Copyright (c) 2015, Weihao Cheng
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+    names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+    DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <vector>
+
+#include "nnKernel.hpp"
+
+#ifndef __NN_WINOGRAD__
+#define __NN_WINOGRAD__
+
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+
+// Winograd minimal filtering F(m x m, r x r): a tile of m x m outputs of a stride 1
+// correlation with an r x r filter costs a*a multiplications, a = m + r - 1,
+// instead of m*m*r*r.
+//	Y = AT [ (G g G') .* (BT d BT') ] AT'
+// The transforms are built from the Toom-Cook points 0, 1, -1, 2, -2, 1/2, -1/2 and infinity.
+class nnWinograd {
+
+protected:
+	int _m;
+	int _r;
+	int _a;
+
+	std::vector<nnreal> _AT;	// m x a
+	std::vector<nnreal> _G;		// a x r
+	std::vector<nnreal> _BT;	// a x a
+
+	//workspace, one row of T tiles per element of a tile
+	std::vector<nnreal> _D;
+	std::vector<nnreal> _V;
+	std::vector<nnreal> _P;
+	std::vector<nnreal> _Y;
+
+public:
+	enum {
+		TILE_BLOCK = 64
+	};
+
+	nnWinograd() {
+		_m = 0;
+		_r = 0;
+		_a = 0;
+	}
+
+	int getTileSize() {
+		return _m;
+	}
+	int getFilterSize() {
+		return _r;
+	}
+	int getInputTileSize() {
+		return _a;
+	}
+
+	bool setup(int m, int r) {
+
+		static const double points[] = {0, 1, -1, 2, -2, 0.5, -0.5};
+
+		int a = m + r - 1;
+		if(m < 1 || r < 1 || a - 1 > (int)(sizeof(points)/sizeof(double)))
+			return false;
+
+		_m = m;
+		_r = r;
+		_a = a;
+
+		// evaluation of a polynomial of k coefficients at the points, leading coefficient at infinity
+		_AT.assign(m*a, 0);
+		_G.assign(a*r, 0);
+		std::vector<double> E(a*a, 0);
+		for(int j = 0; j < a; j++) {
+			for(int i = 0; i < a; i++) {
+				double v = (j < a - 1) ? pow(points[j], i) : (i == a - 1);
+				if(j < a - 1 && i == 0)
+					v = 1;
+				if(i < m)
+					_AT[i*a + j] = (j < a - 1) ? v : (i == m - 1);
+				if(i < r)
+					_G[j*r + i] = (j < a - 1) ? v : (i == r - 1);
+				E[j*a + i] = v;
+			}
+		}
+
+		// BT is the transposed interpolation matrix, E^-1'
+		std::vector<double> inv(a*a, 0);
+		for(int i = 0; i < a; i++)
+			inv[i*a + i] = 1;
+		for(int c = 0; c < a; c++) {
+			int p = c;
+			for(int i = c + 1; i < a; i++) {
+				if(fabs(E[i*a + c]) > fabs(E[p*a + c]))
+					p = i;
+			}
+			for(int k = 0; k < a; k++) {
+				std::swap(E[c*a + k], E[p*a + k]);
+				std::swap(inv[c*a + k], inv[p*a + k]);
+			}
+			double d = 1.0 / E[c*a + c];
+			for(int k = 0; k < a; k++) {
+				E[c*a + k] *= d;
+				inv[c*a + k] *= d;
+			}
+			for(int i = 0; i < a; i++) {
+				double f = E[i*a + c];
+				if(i == c || f == 0)
+					continue;
+				for(int k = 0; k < a; k++) {
+					E[i*a + k] -= f * E[c*a + k];
+					inv[i*a + k] -= f * inv[c*a + k];
+				}
+			}
+		}
+		_BT.assign(a*a, 0);
+		for(int i = 0; i < a; i++) {
+			for(int j = 0; j < a; j++) {
+				double v = inv[j*a + i];
+				_BT[i*a + j] = (fabs(v) < 1e-12) ? 0 : v;
+			}
+		}
+		return true;
+	}
+
+	// U[a, a] = G g G' of the r x r filter g
+	void transformFilter(const nnreal *g, nnreal *U) {
+
+		int a = _a, r = _r;
+		std::vector<nnreal> t(a*r, 0);
+		for(int i = 0; i < a; i++)
+			for(int k = 0; k < r; k++)
+				for(int j = 0; j < r; j++)
+					t[i*r + j] += _G[i*r + k] * g[k*r + j];
+		for(int i = 0; i < a; i++)
+			for(int j = 0; j < a; j++) {
+				nnreal d = 0;
+				for(int k = 0; k < r; k++)
+					d += t[i*r + k] * _G[j*r + k];
+				U[i*a + j] = d;
+			}
+	}
+
+	// out[nm, w*h] = bias + correlation of the pw x ph plane s with the nm transformed filters U
+	void forward(const nnreal *s, int pw, int ph, int w, int h, int nm,
+		const nnreal *U, const nnreal *bias, nnreal *out) {
+
+		transformInput(s, pw, ph, w, h);
+		_Y.resize(getWorkspaceSize());
+		forwardMaps(w, h, nm, U, bias, out, &_Y[0]);
+	}
+
+	// V = BT d BT' of the tiles of w x h outputs on the pw x ph plane s, for forwardMaps()
+	void transformInput(const nnreal *s, int pw, int ph, int w, int h) {
+
+		const int m = _m, a = _a;
+		const int tw = (w + m - 1) / m, th = (h + m - 1) / m;
+		const int T = tw * th;
+
+		_D.resize(a*a*T);
+		_V.resize(a*a*T);
+		_P.resize(a*a*T);
+
+		nnreal *D = &_D[0], *V = &_V[0], *R = &_P[0];
+
+		// input tiles overlap by r - 1, anything outside the plane reads as zero
+		for(int ty = 0, t = 0; ty < th; ty++) {
+			for(int tx = 0; tx < tw; tx++, t++) {
+				int oy = ty*m, ox = tx*m;
+				bool inside = (oy + a <= ph) && (ox + a <= pw);
+				for(int iy = 0; iy < a; iy++) {
+					for(int ix = 0; ix < a; ix++) {
+						int y = oy + iy, x = ox + ix;
+						D[(iy*a + ix)*T + t] = (inside || (y < ph && x < pw)) ? s[y*pw + x] : 0;
+					}
+				}
+			}
+		}
+
+		// BT d is built in R first
+		memset(R, 0, a*a*T*sizeof(nnreal));
+		for(int i = 0; i < a; i++)
+			for(int k = 0; k < a; k++) {
+				nnreal c = _BT[i*a + k];
+				if(c == 0)
+					continue;
+				for(int j = 0; j < a; j++)
+					nnKernel::axpy(T, c, D + (k*a + j)*T, 1, R + (i*a + j)*T);
+			}
+		memset(V, 0, a*a*T*sizeof(nnreal));
+		for(int i = 0; i < a; i++)
+			for(int j = 0; j < a; j++)
+				for(int k = 0; k < a; k++) {
+					nnreal c = _BT[j*a + k];
+					if(c == 0)
+						continue;
+					nnKernel::axpy(T, c, R + (i*a + k)*T, 1, V + (i*a + j)*T);
+				}
+	}
+
+	// nnreals of the workspace of forwardMaps()
+	int getWorkspaceSize() {
+		return (_m*_a + _m*_m) * TILE_BLOCK;
+	}
+
+	// out[nm, w*h] = bias + the correlation with the nm transformed filters U of the input of the last
+	// transformInput(). Calls on different maps may run at the same time, each with a workspace of its own.
+	void forwardMaps(int w, int h, int nm, const nnreal *U, const nnreal *bias, nnreal *out, nnreal *work) {
+
+		const int m = _m, a = _a;
+		const int tw = (w + m - 1) / m, th = (h + m - 1) / m;
+		const int T = tw * th;
+
+		const nnreal *V = &_V[0];
+		nnreal *P = work, *Y = work + m*a*TILE_BLOCK;
+
+		// the maps run over blocks of tiles so that V, P and Y stay in cache
+		for(int t0 = 0; t0 < T; t0 += TILE_BLOCK) {
+
+			int nt = MIN((int)TILE_BLOCK, T - t0);
+			const nnreal *Um = U;
+			for(int mi = 0; mi < nm; mi++, Um += a*a) {
+
+				// P = AT (U .* V), the element-wise product folded into the first pass
+				memset(P, 0, m*a*TILE_BLOCK*sizeof(nnreal));
+				for(int i = 0; i < m; i++)
+					for(int k = 0; k < a; k++) {
+						nnreal c = _AT[i*a + k];
+						if(c == 0)
+							continue;
+						for(int j = 0; j < a; j++)
+							nnKernel::axpy(nt, c * Um[k*a + j], V + (k*a + j)*T + t0, 1, P + (i*a + j)*TILE_BLOCK);
+					}
+
+				// Y = P AT'
+				memset(Y, 0, m*m*TILE_BLOCK*sizeof(nnreal));
+				for(int i = 0; i < m; i++)
+					for(int j = 0; j < m; j++)
+						for(int k = 0; k < a; k++) {
+							nnreal c = _AT[j*a + k];
+							if(c == 0)
+								continue;
+							nnKernel::axpy(nt, c, P + (i*a + k)*TILE_BLOCK, 1, Y + (i*m + j)*TILE_BLOCK);
+						}
+
+				for(int t = 0; t < nt; t++) {
+					int ty = (t0 + t) / tw, tx = (t0 + t) % tw;
+					int my = MIN(m, h - ty*m), mx = MIN(m, w - tx*m);
+					nnreal *o = out + mi*w*h + ty*m*w + tx*m;
+					for(int i = 0; i < my; i++)
+						for(int j = 0; j < mx; j++)
+							o[i*w + j] = bias[mi] + Y[(i*m + j)*TILE_BLOCK + t];
+				}
+			}
+		}
+	}
+};
+
+#endif